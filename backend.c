@@ -0,0 +1,360 @@
+/* The mmap and pread engines of backend.h, and what every engine shares.
+ * The engine in use is picked before the image is loaded, and never changes after. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "blocks.h"
+#include "cache.h"
+
+#define COPY_BLOCKS 64 // blocks copied or zeroed at a time (256KB)
+
+static const backend_t mmap_backend;
+static const backend_t pread_backend;
+
+static const backend_t *backends[] = { &mmap_backend, &pread_backend, &uring_backend };
+static const backend_t *backend = &mmap_backend;
+static int direct = 0;   // whether the image is open with O_DIRECT
+static int data_fd = -1; // the image, as the engine has it open
+
+static char *mapped = 0; // the shared mapping of the mmap engine
+static size_t mapped_size = 0;
+static int pread_fd = -1;
+
+// Map the image for the mmap engine.
+// returns 0 on success, -1 on fail.
+static int mmap_open(int fd, size_t size) {
+	mapped = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		mapped = 0;
+		return -1;
+	}
+	mapped_size = size;
+	return 0;
+}
+
+// Unmap the image of the mmap engine.
+static void mmap_close() {
+	munmap(mapped, mapped_size);
+	mapped = 0;
+}
+
+// Copy each piece out of the mapping.
+// returns 0.
+static int mmap_read(data_io_t *ios, int count) {
+	for (int i = 0; i < count; i++) {
+		memcpy(ios[i].buf, mapped + ios[i].pos, ios[i].size);
+	}
+	return 0;
+}
+
+// Copy each piece into the mapping.
+// returns 0.
+static int mmap_write(data_io_t *ios, int count) {
+	for (int i = 0; i < count; i++) {
+		memcpy(mapped + ios[i].pos, ios[i].buf, ios[i].size);
+	}
+	return 0;
+}
+
+// Write back a range of the mapping, and wait for it.
+// returns 0 on success, -1 on fail.
+static int mmap_sync(int64_t pos, int64_t size) {
+	return msync(mapped + pos, size, MS_SYNC);
+}
+
+static const backend_t mmap_backend = {
+	.name = "mmap",
+	.splice = 1,
+	.direct = 0,
+	.open = mmap_open,
+	.close = mmap_close,
+	.read = mmap_read,
+	.write = mmap_write,
+	.sync = mmap_sync,
+};
+
+// Keep the image file for the pread engine.
+// returns 0.
+static int pread_open(int fd, size_t size) {
+	pread_fd = fd;
+	return 0;
+}
+
+// Forget the image file of the pread engine.
+static void pread_close() {
+	pread_fd = -1;
+}
+
+// Read each piece in turn.
+// returns 0 on success, -1 on fail.
+static int pread_read(data_io_t *ios, int count) {
+	for (int i = 0; i < count; i++) {
+		if (data_io_sync(pread_fd, &ios[i], 0, 0) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Write each piece in turn.
+// returns 0 on success, -1 on fail.
+static int pread_write(data_io_t *ios, int count) {
+	for (int i = 0; i < count; i++) {
+		if (data_io_sync(pread_fd, &ios[i], 0, 1) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Write back a range of the image file, and wait for it.
+// returns 0 on success, -1 on fail.
+static int pread_sync(int64_t pos, int64_t size) {
+	// sync_file_range only starts and waits for the range's writeback, which the flush
+	// after it then has little left to do; only the flush empties the disk's write cache
+	if (sync_file_range(pread_fd, pos, size,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+		return -1;
+	}
+	return fdatasync(pread_fd);
+}
+
+static const backend_t pread_backend = {
+	.name = "pread",
+	.splice = 1,
+	.direct = 1,
+	.open = pread_open,
+	.close = pread_close,
+	.read = pread_read,
+	.write = pread_write,
+	.sync = pread_sync,
+};
+
+// Pick the engine for the next blocks_init.
+// returns 0 on success, -1 if there is no such engine or it can't use O_DIRECT.
+int backend_select(const char *name, int use_direct) {
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strcmp(backends[i]->name, name) == 0) {
+			if (use_direct && !backends[i]->direct) {
+				return -1;
+			}
+			backend = backends[i];
+			direct = use_direct;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Set up the engine picked for the image at the given path, open as fd.
+// returns 0 on success, -1 on fail.
+int backend_open(const char *path, int fd, size_t size) {
+	data_fd = direct ? open(path, O_RDWR | O_DIRECT) : fd;
+	if (data_fd < 0 || backend->open(data_fd, size) != 0) {
+		fprintf(stderr, "nufs: unable to use the %s engine%s on %s: %s\n", backend->name,
+			direct ? " with O_DIRECT" : "", path, strerror(errno));
+		if (direct && data_fd >= 0) {
+			close(data_fd);
+		}
+		return -1;
+	}
+	cache_init(direct);
+	return 0;
+}
+
+// Tear down the engine.
+void backend_close() {
+	cache_free();
+	backend->close();
+	if (direct) {
+		close(data_fd);
+	}
+	data_fd = -1;
+}
+
+// Check whether FUSE may read and write file data in the image file itself.
+int backend_splice() {
+	// O_DIRECT is only used by the engine, so FUSE would go through the page cache, and
+	// the cache would miss what FUSE wrote
+	return backend->splice && !direct && !cache_enabled();
+}
+
+// Drop size bytes of the image at byte offset pos from the page cache.
+void backend_drop(int64_t pos, size_t size) {
+	if (direct) {
+		return;
+	}
+	// pages the mmap engine still maps can't be dropped, so they are unmapped first;
+	// unmapping keeps what was written to them
+	if (mapped != 0) {
+		madvise(mapped + pos, size, MADV_DONTNEED);
+	}
+	posix_fadvise(data_fd, pos, size, POSIX_FADV_DONTNEED);
+}
+
+// Run a batch through the engine with O_DIRECT, which only takes whole blocks in aligned
+// buffers. Pieces that aren't go through aligned bounce buffers, and the blocks a write
+// only covers part of are read into them first.
+// returns 0 on success, -1 on fail.
+static int direct_io(data_io_t *ios, int count, int write) {
+	data_io_t *aligned = calloc(count, sizeof(data_io_t));
+	data_io_t *edges = calloc(2 * count, sizeof(data_io_t));
+	int edge_count = 0;
+	int rv = 0;
+	for (int i = 0; i < count && rv == 0; i++) {
+		data_io_t *io = &ios[i];
+		int64_t start = io->pos - io->pos % BLOCK_SIZE;
+		int64_t end = (io->pos + io->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+		aligned[i] = *io;
+		if (start == io->pos && end == io->pos + (int64_t) io->size
+				&& (uintptr_t) io->buf % BLOCK_SIZE == 0) {
+			continue;
+		}
+		aligned[i].pos = start;
+		aligned[i].size = end - start;
+		if (posix_memalign(&aligned[i].buf, BLOCK_SIZE, end - start) != 0) {
+			aligned[i].buf = io->buf;
+			rv = -1;
+			break;
+		}
+		if (write && io->pos != start) {
+			edges[edge_count++] = (data_io_t) { start, aligned[i].buf, BLOCK_SIZE };
+		}
+		// the last block may be the first, which is then already read
+		if (write && io->pos + (int64_t) io->size != end && !(io->pos != start && end - start == BLOCK_SIZE)) {
+			edges[edge_count++] = (data_io_t) { end - BLOCK_SIZE, aligned[i].buf + (end - BLOCK_SIZE - start), BLOCK_SIZE };
+		}
+	}
+	if (rv == 0 && write) {
+		rv = backend->read(edges, edge_count);
+		for (int i = 0; i < count && rv == 0; i++) {
+			if (aligned[i].buf != ios[i].buf) {
+				memcpy(aligned[i].buf + (ios[i].pos - aligned[i].pos), ios[i].buf, ios[i].size);
+			}
+		}
+		if (rv == 0) {
+			rv = backend->write(aligned, count);
+		}
+	} else if (rv == 0) {
+		rv = backend->read(aligned, count);
+		for (int i = 0; i < count && rv == 0; i++) {
+			if (aligned[i].buf != ios[i].buf) {
+				memcpy(ios[i].buf, aligned[i].buf + (ios[i].pos - aligned[i].pos), ios[i].size);
+			}
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		if (aligned[i].buf != ios[i].buf) {
+			free(aligned[i].buf);
+		}
+	}
+	free(aligned);
+	free(edges);
+	return rv;
+}
+
+// Read each of count pieces of the image into its buffer, straight from the engine.
+// returns 0 on success, -1 on fail.
+int backend_read(data_io_t *ios, int count) {
+	if (count == 0) {
+		return 0;
+	}
+	return direct ? direct_io(ios, count, 0) : backend->read(ios, count);
+}
+
+// Read each of count pieces of the image into its buffer.
+// returns 0 on success, -1 on fail.
+int data_read(data_io_t *ios, int count) {
+	if (count == 0) {
+		return 0;
+	}
+	return cache_enabled() ? cache_read(ios, count) : backend_read(ios, count);
+}
+
+// Write each of count pieces of the image from its buffer.
+// returns 0 on success, -1 on fail.
+int data_write(data_io_t *ios, int count) {
+	if (count == 0) {
+		return 0;
+	}
+	int rv = direct ? direct_io(ios, count, 1) : backend->write(ios, count);
+	if (cache_enabled()) {
+		cache_write(ios, count);
+	}
+	return rv;
+}
+
+// Write size zeros to the image at byte offset pos.
+// returns 0 on success, -1 on fail.
+int data_zero(int64_t pos, size_t size) {
+	static char *zeros = 0;
+	size_t chunk = (size_t) COPY_BLOCKS * BLOCK_SIZE;
+	if (__atomic_load_n(&zeros, __ATOMIC_ACQUIRE) == 0) {
+		void *buf;
+		if (posix_memalign(&buf, BLOCK_SIZE, chunk) != 0) {
+			return -1;
+		}
+		memset(buf, 0, chunk);
+		void *none = 0;
+		if (!__atomic_compare_exchange_n(&zeros, &none, buf, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			free(buf);
+		}
+	}
+	for (size_t done = 0; done < size; done += chunk) {
+		data_io_t io = { pos + done, zeros, size - done < chunk ? size - done : chunk };
+		if (data_write(&io, 1) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Copy count data blocks starting at from to the blocks starting at to.
+// returns 0 on success, -1 on fail.
+int data_copy(int to, int from, int count) {
+	void *buf;
+	if (posix_memalign(&buf, BLOCK_SIZE, (size_t) COPY_BLOCKS * BLOCK_SIZE) != 0) {
+		return -1;
+	}
+	int rv = 0;
+	for (int done = 0; done < count && rv == 0; done += COPY_BLOCKS) {
+		size_t size = (size_t) (count - done < COPY_BLOCKS ? count - done : COPY_BLOCKS) * BLOCK_SIZE;
+		data_io_t in = { (int64_t) (from + done) * BLOCK_SIZE, buf, size };
+		data_io_t out = { (int64_t) (to + done) * BLOCK_SIZE, buf, size };
+		rv = data_read(&in, 1) == 0 ? data_write(&out, 1) : -1;
+	}
+	free(buf);
+	return rv;
+}
+
+// Make count data blocks starting at block durable.
+// returns 0 on success, -1 on fail.
+int data_sync(int block, int count) {
+	return backend->sync((int64_t) block * BLOCK_SIZE, (int64_t) count * BLOCK_SIZE);
+}
+
+// Read or write the rest of a piece of I/O past its first done bytes with pread or pwrite.
+// returns 0 on success, -1 on fail.
+int data_io_sync(int fd, data_io_t *io, size_t done, int write) {
+	while (done < io->size) {
+		ssize_t n = write ? pwrite(fd, io->buf + done, io->size - done, io->pos + done)
+			: pread(fd, io->buf + done, io->size - done, io->pos + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
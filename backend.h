@@ -0,0 +1,86 @@
+/* Engines doing the I/O of file data in the disk image.
+ * Metadata is always reached through the private mapping of blocks.h, whose changes the
+ * journal writes out, but file data goes through the engine picked when mounting:
+ * - mmap: copies to and from a shared mapping of the image, as page faults read it in
+ * - pread: reads and writes the image file with pread and pwrite
+ * - uring: submits a batch of reads or writes to io_uring at once, keeping them all in
+ *   flight together
+ * The pread and uring engines can also bypass the page cache with O_DIRECT, bouncing
+ * I/O that isn't aligned to blocks through buffers that are. */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One piece of a batch of I/O: size bytes at byte offset pos of the image.
+typedef struct data_io {
+	int64_t pos;
+	void *buf;
+	size_t size;
+} data_io_t;
+
+// The operations of an engine. Each returns 0 on success, -1 on fail.
+typedef struct backend {
+	const char *name;
+	int splice; // whether FUSE may read and write file data in the image file itself
+	int direct; // whether it can use O_DIRECT
+	int (*open)(int fd, size_t size); // the image file, opened with O_DIRECT if asked for
+	void (*close)();
+	int (*read)(data_io_t *ios, int count);
+	int (*write)(data_io_t *ios, int count);
+	int (*sync)(int64_t pos, int64_t size); // make what was written durable
+} backend_t;
+
+extern const backend_t uring_backend;
+
+// Pick the engine for the next blocks_init, by name, with direct set to bypass the page cache.
+// Returns 0 on success, -1 if there is no such engine or it can't use O_DIRECT.
+int backend_select(const char *name, int direct);
+
+// Set up the engine picked for the image at the given path, open as fd, of size bytes.
+// Returns 0 on success, -1 on fail.
+int backend_open(const char *path, int fd, size_t size);
+
+// Tear down the engine.
+void backend_close();
+
+// Check whether FUSE may read and write file data in the image file itself.
+int backend_splice();
+
+// Drop size bytes of the image at byte offset pos from the page cache, once the cache of
+// cache.h holds them. Dirty pages in the range are written back first, so the range
+// should have none.
+void backend_drop(int64_t pos, size_t size);
+
+// Read each of count pieces of the image into its buffer straight from the engine, for the
+// cache of cache.h. Returns 0 on success, -1 on fail.
+int backend_read(data_io_t *ios, int count);
+
+// Read each of count pieces of the image into its buffer, all at once where the engine can.
+// Returns 0 on success, -1 on fail.
+int data_read(data_io_t *ios, int count);
+
+// Write each of count pieces of the image from its buffer, all at once where the engine can.
+// Returns 0 on success, -1 on fail.
+int data_write(data_io_t *ios, int count);
+
+// Write size zeros to the image at byte offset pos.
+// Returns 0 on success, -1 on fail.
+int data_zero(int64_t pos, size_t size);
+
+// Copy count data blocks starting at from to the blocks starting at to.
+// Returns 0 on success, -1 on fail.
+int data_copy(int to, int from, int count);
+
+// Make count data blocks starting at block durable, once written.
+// Returns 0 on success, -1 on fail.
+int data_sync(int block, int count);
+
+// Read or write the rest of a piece of I/O past its first done bytes with pread or pwrite,
+// for engines finishing what they couldn't do otherwise.
+// Returns 0 on success, -1 on fail.
+int data_io_sync(int fd, data_io_t *io, size_t done, int write);
+
+#endif
@@ -0,0 +1,266 @@
+/* Microbenchmarks of the core of nufs, run in-process with no FUSE in the way:
+ * block and inode allocation as the image grows, directory operations as directories
+ * grow, and file writes and reads as files grow. Results are printed as JSON.
+ *
+ * usage: core [-e engine] [-d] [-c cache MB] [scratch image]
+ * -e picks the engine doing the I/O of file data, -d has it use O_DIRECT, and -c sizes the
+ * cache of file data, as the backend, direct and cache_size mount options do. */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "blocks.h"
+#include "cache.h"
+#include "directory.h"
+#include "file.h"
+#include "icache.h"
+#include "inode.h"
+#include "journal.h"
+#include "report.h"
+
+#define MB (1024 * 1024)
+#define IO_SIZE (128 * 1024) // bytes per file_write and file_read, as FUSE would pass them
+#define IO_TOTAL (64 * MB)   // bytes written per file size, over as many files as it takes
+#define LOOKUPS 100000
+
+static const char *image = "bench-core.nufs";
+
+// A small xorshift generator, so runs are repeatable.
+static uint32_t next_rand(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+// Format and mount a fresh scratch image of the given size.
+static void setup(int64_t size) {
+	unlink(image);
+	if (blocks_format(image, size, 0) != 0 || blocks_init(image) != 0) {
+		perror(image);
+		exit(1);
+	}
+	directory_init();
+}
+
+// Unmount and remove the scratch image.
+static void teardown() {
+	blocks_free();
+	unlink(image);
+}
+
+// Make a file or directory with the given mode under directory dir, the way nufs_mknod does.
+// returns its inode index.
+static int make_node(int dir, const char *name, int mode) {
+	journal_begin();
+	cinode_t *ci = inode_lock(dir, 1);
+	int inum = alloc_inode(dir, mode);
+	inode_t *node = get_inode(inum);
+	journal_dirty(node, sizeof(inode_t));
+	node->refs = 0;
+	node->mode = mode;
+	node->size = 0;
+	directory_put(dir, name, inum);
+	inode_unlock(ci);
+	journal_end();
+	return inum;
+}
+
+// Allocate half the blocks and half the inodes of an image of the given size, one at a
+// time, then free them again.
+static void bench_alloc(int64_t size) {
+	setup(size);
+	superblock_t *sb = get_superblock();
+	int value = size / MB;
+
+	int count = (sb->block_count - sb->data_start) / 2;
+	int *blocks = malloc(count * sizeof(int));
+	double start = now();
+	for (int i = 0; i < count; i++) {
+		journal_begin();
+		blocks[i] = alloc_block();
+		journal_end();
+	}
+	report("block_alloc", "image_mb", value, count, 0, now() - start);
+	start = now();
+	for (int i = 0; i < count; i++) {
+		journal_begin();
+		free_block(blocks[i]);
+		journal_end();
+	}
+	report("block_free", "image_mb", value, count, 0, now() - start);
+	free(blocks);
+
+	count = sb->inode_count / 2;
+	int *inodes = malloc(count * sizeof(int));
+	start = now();
+	for (int i = 0; i < count; i++) {
+		journal_begin();
+		inodes[i] = alloc_inode(0, 0100644);
+		journal_end();
+	}
+	report("inode_alloc", "image_mb", value, count, 0, now() - start);
+	start = now();
+	for (int i = 0; i < count; i++) {
+		journal_begin();
+		cinode_t *ci = inode_lock(inodes[i], 1);
+		free_inode(inodes[i]);
+		inode_unlock(ci);
+		journal_end();
+	}
+	report("inode_free", "image_mb", value, count, 0, now() - start);
+	free(inodes);
+	teardown();
+}
+
+// Fill a new directory with the given number of files, look names up in it, and empty it.
+static void bench_directory(int entries) {
+	char name[DIR_NAME_LENGTH];
+	snprintf(name, sizeof(name), "d%d", entries);
+	int dir = make_node(0, name, 040755);
+
+	double start = now();
+	for (int i = 0; i < entries; i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		make_node(dir, name, 0100644);
+	}
+	report("dir_insert", "entries", entries, entries, 0, now() - start);
+
+	uint32_t seed = 1;
+	start = now();
+	for (int i = 0; i < LOOKUPS; i++) {
+		snprintf(name, sizeof(name), "file%u", next_rand(&seed) % entries);
+		cinode_t *ci = inode_lock(dir, 0);
+		directory_lookup(dir, name, strlen(name));
+		inode_unlock(ci);
+	}
+	report("dir_lookup", "entries", entries, LOOKUPS, 0, now() - start);
+
+	// the same lookups without the dentry cache
+	seed = 1;
+	start = now();
+	for (int i = 0; i < LOOKUPS; i++) {
+		snprintf(name, sizeof(name), "file%u", next_rand(&seed) % entries);
+		cinode_t *ci = inode_lock(dir, 0);
+		find_file_in_dir(get_inode(dir), name);
+		inode_unlock(ci);
+	}
+	report("dir_lookup_uncached", "entries", entries, LOOKUPS, 0, now() - start);
+
+	start = now();
+	for (int i = 0; i < entries; i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		journal_begin();
+		cinode_t *ci = inode_lock(dir, 1);
+		directory_delete(dir, name);
+		inode_unlock(ci);
+		journal_end();
+	}
+	report("dir_delete", "entries", entries, entries, 0, now() - start);
+}
+
+// Write files of the given size sequentially, read them back, and truncate them,
+// until IO_TOTAL bytes have gone each way.
+static void bench_file(int64_t size) {
+	char name[DIR_NAME_LENGTH];
+	snprintf(name, sizeof(name), "f%ld", size);
+	int inum = make_node(0, name, 0100644);
+	inode_t *node = get_inode(inum);
+	char *buf = malloc(IO_SIZE);
+	memset(buf, 'x', IO_SIZE);
+	int files = size < IO_TOTAL ? IO_TOTAL / size : 1;
+	double writing = 0;
+	double reading = 0;
+
+	for (int i = 0; i < files; i++) {
+		double start = now();
+		for (int64_t offset = 0; offset < size; offset += IO_SIZE) {
+			size_t len = size - offset < IO_SIZE ? size - offset : IO_SIZE;
+			journal_begin();
+			cinode_t *ci = inode_lock(inum, 1);
+			file_write(node, buf, len, offset);
+			inode_unlock(ci);
+			journal_end();
+		}
+		writing += now() - start;
+
+		start = now();
+		for (int64_t offset = 0; offset < size; offset += IO_SIZE) {
+			size_t len = size - offset < IO_SIZE ? size - offset : IO_SIZE;
+			cinode_t *ci = inode_lock(inum, 0);
+			file_read(node, buf, len, offset);
+			inode_unlock(ci);
+		}
+		reading += now() - start;
+
+		journal_begin();
+		cinode_t *ci = inode_lock(inum, 1);
+		shrink_inode(node, 0);
+		inode_unlock(ci);
+		journal_end();
+	}
+	int64_t ops = files * ((size + IO_SIZE - 1) / IO_SIZE);
+	report("file_write", "file_kb", size / 1024, ops, files * size, writing);
+	report("file_read", "file_kb", size / 1024, ops, files * size, reading);
+	free(buf);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-e mmap|pread|uring] [-d] [-c cache MB] [scratch image]\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	const char *engine = "mmap";
+	int direct = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "e:dc:")) != -1) {
+		switch (opt) {
+			case 'e':
+				engine = optarg;
+				break;
+			case 'd':
+				direct = 1;
+				break;
+			case 'c':
+				cache_mb = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc - optind > 1 || backend_select(engine, direct) != 0) {
+		usage(argv[0]);
+	}
+	if (optind < argc) {
+		image = argv[optind];
+	}
+	// the core prints messages of its own, so they go to stderr instead of the results
+	report_begin(fdopen(dup(STDOUT_FILENO), "w"), "core");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	int64_t image_sizes[] = { 64 * MB, 256 * MB, 1024 * MB };
+	for (int i = 0; i < sizeof(image_sizes) / sizeof(image_sizes[0]); i++) {
+		bench_alloc(image_sizes[i]);
+	}
+
+	setup(1024 * MB);
+	int dir_sizes[] = { 100, 1000, 10000, 50000 };
+	for (int i = 0; i < sizeof(dir_sizes) / sizeof(dir_sizes[0]); i++) {
+		bench_directory(dir_sizes[i]);
+	}
+	int64_t file_sizes[] = { 4096, 64 * 1024, MB, 16 * MB, 256 * MB };
+	for (int i = 0; i < sizeof(file_sizes) / sizeof(file_sizes[0]); i++) {
+		bench_file(file_sizes[i]);
+	}
+	teardown();
+
+	report_end();
+	return 0;
+}
@@ -0,0 +1,46 @@
+/* Printing benchmark results as JSON. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "report.h"
+
+static FILE *out = 0;
+static int results = 0;
+
+// Return the time in seconds from a monotonic clock.
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Start printing the results of the given suite to the given file.
+void report_begin(FILE *to, const char *suite) {
+	out = to;
+	fprintf(out, "{\n\"suite\": \"%s\",\n\"results\": [\n", suite);
+	results = 0;
+}
+
+// Print a result: ops operations moving bytes bytes took the given seconds, with the
+// parameter being varied, if any, given as a name and value.
+void report(const char *name, const char *param, int64_t value, uint64_t ops, uint64_t bytes,
+		double seconds) {
+	fprintf(out, "%s{\"name\": \"%s\"", results++ ? ",\n" : "", name);
+	if (param) {
+		fprintf(out, ", \"%s\": %ld", param, value);
+	}
+	fprintf(out, ", \"ops\": %lu, \"ops_per_sec\": %.0f, \"ns_per_op\": %.1f",
+		ops, ops / seconds, seconds * 1e9 / ops);
+	if (bytes > 0) {
+		fprintf(out, ", \"mb_per_sec\": %.1f", bytes / seconds / (1024 * 1024));
+	}
+	fprintf(out, "}");
+	fflush(out);
+}
+
+// Finish the results.
+void report_end() {
+	fprintf(out, "\n]\n}\n");
+	fflush(out);
+}
@@ -0,0 +1,25 @@
+/* Printing benchmark results as JSON.
+ * Each result goes on a line of its own, so the output of two versions can be compared
+ * with diff to spot regressions. */
+
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Return the time in seconds from a monotonic clock.
+double now();
+
+// Start printing the results of the given suite to the given file.
+void report_begin(FILE *to, const char *suite);
+
+// Print a result: ops operations moving bytes bytes took the given seconds, with the
+// parameter being varied, if any, given as a name and value.
+void report(const char *name, const char *param, int64_t value, uint64_t ops, uint64_t bytes,
+		double seconds);
+
+// Finish the results.
+void report_end();
+
+#endif
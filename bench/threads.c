@@ -0,0 +1,199 @@
+/* Measures how read and metadata throughput on a mounted nufs scale with the
+ * number of threads issuing requests.
+ *
+ * usage: threads mountpoint [seconds per run] */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILES 32
+#define FILE_SIZE (256 * 1024)
+#define READ_SIZE (16 * 1024)
+#define MAX_THREADS 16
+
+static const char *root;
+static double seconds = 2;
+static volatile int stop;
+
+typedef struct worker {
+	pthread_t thread;
+	int id;
+	uint64_t ops;
+	uint64_t bytes;
+} worker_t;
+
+// Return the time in seconds from a monotonic clock.
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A small xorshift generator, so threads don't share rand()'s state.
+static uint32_t next_rand(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+// Read random chunks of random files.
+static void *read_worker(void *arg) {
+	worker_t *w = arg;
+	uint32_t seed = w->id * 7919 + 1;
+	char path[256];
+	char *buf = malloc(READ_SIZE);
+	int fds[FILES];
+	for (int i = 0; i < FILES; i++) {
+		snprintf(path, sizeof(path), "%s/bench/f%d", root, i);
+		fds[i] = open(path, O_RDONLY);
+	}
+	while (!stop) {
+		int fd = fds[next_rand(&seed) % FILES];
+		off_t offset = (off_t) (next_rand(&seed) % (FILE_SIZE / READ_SIZE)) * READ_SIZE;
+		ssize_t got = pread(fd, buf, READ_SIZE, offset);
+		if (got > 0) {
+			w->ops++;
+			w->bytes += got;
+		}
+	}
+	for (int i = 0; i < FILES; i++) {
+		close(fds[i]);
+	}
+	free(buf);
+	return 0;
+}
+
+// Stat random files, the most common metadata operation.
+static void *stat_worker(void *arg) {
+	worker_t *w = arg;
+	uint32_t seed = w->id * 7919 + 1;
+	char path[256];
+	struct stat st;
+	while (!stop) {
+		snprintf(path, sizeof(path), "%s/bench/f%d", root, next_rand(&seed) % FILES);
+		if (stat(path, &st) == 0) {
+			w->ops++;
+		}
+	}
+	return 0;
+}
+
+// Create and remove files in a directory of the thread's own.
+static void *create_worker(void *arg) {
+	worker_t *w = arg;
+	char dir[256];
+	char path[320];
+	snprintf(dir, sizeof(dir), "%s/bench/d%d", root, w->id);
+	mkdir(dir, 0755);
+	for (uint64_t i = 0; !stop; i++) {
+		snprintf(path, sizeof(path), "%s/n%lu", dir, (unsigned long) (i % 64));
+		int fd = open(path, O_CREAT | O_WRONLY, 0644);
+		if (fd >= 0) {
+			close(fd);
+			unlink(path);
+			w->ops++;
+		}
+	}
+	rmdir(dir);
+	return 0;
+}
+
+// Run the given worker on the given number of threads, printing ops and MB per second.
+static void run(const char *name, void *(*fn)(void *), int threads) {
+	worker_t workers[MAX_THREADS];
+	stop = 0;
+	double start = now();
+	for (int i = 0; i < threads; i++) {
+		workers[i].id = i;
+		workers[i].ops = 0;
+		workers[i].bytes = 0;
+		pthread_create(&workers[i].thread, NULL, fn, &workers[i]);
+	}
+	usleep(seconds * 1e6);
+	stop = 1;
+	uint64_t ops = 0;
+	uint64_t bytes = 0;
+	for (int i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		bytes += workers[i].bytes;
+	}
+	double elapsed = now() - start;
+	printf("%-8s %3d threads %12.0f ops/s", name, threads, ops / elapsed);
+	if (bytes > 0) {
+		printf(" %10.1f MB/s", bytes / elapsed / (1024 * 1024));
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+// Create the files the workers use.
+static int setup() {
+	char path[256];
+	char *buf = malloc(FILE_SIZE);
+	memset(buf, 'x', FILE_SIZE);
+	snprintf(path, sizeof(path), "%s/bench", root);
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		perror(path);
+		return -1;
+	}
+	for (int i = 0; i < FILES; i++) {
+		snprintf(path, sizeof(path), "%s/bench/f%d", root, i);
+		int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, buf, FILE_SIZE) != FILE_SIZE) {
+			perror(path);
+			return -1;
+		}
+		close(fd);
+	}
+	free(buf);
+	return 0;
+}
+
+// Remove the files the workers used.
+static void cleanup() {
+	char path[256];
+	for (int i = 0; i < FILES; i++) {
+		snprintf(path, sizeof(path), "%s/bench/f%d", root, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/bench", root);
+	rmdir(path);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s mountpoint [seconds per run]\n", argv[0]);
+		return 1;
+	}
+	root = argv[1];
+	if (argc == 3) {
+		seconds = atof(argv[2]);
+	}
+	if (setup() != 0) {
+		return 1;
+	}
+	int counts[] = { 1, 2, 4, 8, 16 };
+	for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		run("read", read_worker, counts[i]);
+	}
+	for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		run("stat", stat_worker, counts[i]);
+	}
+	for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		run("create", create_worker, counts[i]);
+	}
+	cleanup();
+	return 0;
+}
@@ -0,0 +1,193 @@
+/* Workloads run against a mounted nufs: sequential and random I/O on a large file,
+ * a storm of small files being created, an `ls -lR` of them, and removing them again.
+ * Results are printed as JSON.
+ *
+ * Cached pages of the large file are dropped before it is read, and the walk waits for
+ * the kernel's cached attributes to expire, so the requests reach nufs.
+ *
+ * usage: workloads mountpoint */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "report.h"
+
+#define MB (1024 * 1024)
+#define FILE_SIZE (256 * MB)
+#define SEQ_SIZE MB          // bytes per sequential read or write
+#define RANDOM_SIZE 4096     // bytes per random read or write
+#define RANDOM_OPS 16384
+#define DIRS 16
+#define FILES_PER_DIR 512
+#define SMALL_SIZE 4096
+#define ATTR_TIMEOUT 1       // seconds the kernel caches attributes and names by default
+
+static char *buf;
+static int entries;
+
+// A small xorshift generator, so runs are repeatable.
+static uint32_t next_rand(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+// Stop with a message about the given path.
+static void fail(const char *path) {
+	perror(path);
+	exit(1);
+}
+
+// Write the large file from start to end, then read it back the same way.
+static void sequential(const char *path) {
+	int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		fail(path);
+	}
+	double start = now();
+	for (off_t offset = 0; offset < FILE_SIZE; offset += SEQ_SIZE) {
+		if (pwrite(fd, buf, SEQ_SIZE, offset) != SEQ_SIZE) {
+			fail(path);
+		}
+	}
+	fsync(fd);
+	report("seq_write", "file_mb", FILE_SIZE / MB, FILE_SIZE / SEQ_SIZE, FILE_SIZE, now() - start);
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	start = now();
+	for (off_t offset = 0; offset < FILE_SIZE; offset += SEQ_SIZE) {
+		if (pread(fd, buf, SEQ_SIZE, offset) != SEQ_SIZE) {
+			fail(path);
+		}
+	}
+	report("seq_read", "file_mb", FILE_SIZE / MB, FILE_SIZE / SEQ_SIZE, FILE_SIZE, now() - start);
+	close(fd);
+}
+
+// Write and then read small blocks at random places in the large file.
+static void random_io(const char *path) {
+	int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fail(path);
+	}
+	uint32_t seed = 1;
+	double start = now();
+	for (int i = 0; i < RANDOM_OPS; i++) {
+		off_t offset = (off_t) (next_rand(&seed) % (FILE_SIZE / RANDOM_SIZE)) * RANDOM_SIZE;
+		if (pwrite(fd, buf, RANDOM_SIZE, offset) != RANDOM_SIZE) {
+			fail(path);
+		}
+	}
+	fsync(fd);
+	report("random_write", "io_size", RANDOM_SIZE, RANDOM_OPS, (uint64_t) RANDOM_OPS * RANDOM_SIZE,
+		now() - start);
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	start = now();
+	for (int i = 0; i < RANDOM_OPS; i++) {
+		off_t offset = (off_t) (next_rand(&seed) % (FILE_SIZE / RANDOM_SIZE)) * RANDOM_SIZE;
+		if (pread(fd, buf, RANDOM_SIZE, offset) != RANDOM_SIZE) {
+			fail(path);
+		}
+	}
+	report("random_read", "io_size", RANDOM_SIZE, RANDOM_OPS, (uint64_t) RANDOM_OPS * RANDOM_SIZE,
+		now() - start);
+	close(fd);
+}
+
+// Create the small files, spread over a few directories.
+static void create_storm(const char *top) {
+	char path[512];
+	if (mkdir(top, 0755) != 0 && errno != EEXIST) {
+		fail(top);
+	}
+	double start = now();
+	for (int d = 0; d < DIRS; d++) {
+		snprintf(path, sizeof(path), "%s/d%d", top, d);
+		if (mkdir(path, 0755) != 0) {
+			fail(path);
+		}
+		for (int f = 0; f < FILES_PER_DIR; f++) {
+			snprintf(path, sizeof(path), "%s/d%d/f%d", top, d, f);
+			int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+			if (fd < 0 || write(fd, buf, SMALL_SIZE) != SMALL_SIZE) {
+				fail(path);
+			}
+			close(fd);
+		}
+	}
+	int files = DIRS * FILES_PER_DIR;
+	report("create", "files", files, files, (uint64_t) files * SMALL_SIZE, now() - start);
+}
+
+// Count an entry found by the walk; nftw has already called lstat on it.
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	entries++;
+	return 0;
+}
+
+// List the small files recursively with their attributes, as `ls -lR` would.
+static void list(const char *top) {
+	sleep(ATTR_TIMEOUT + 1);
+	entries = 0;
+	double start = now();
+	if (nftw(top, visit, 16, FTW_PHYS) != 0) {
+		fail(top);
+	}
+	report("ls_lR", "entries", entries, entries, 0, now() - start);
+}
+
+// Remove the small files and their directories.
+static void unlink_storm(const char *top) {
+	char path[512];
+	double start = now();
+	for (int d = 0; d < DIRS; d++) {
+		for (int f = 0; f < FILES_PER_DIR; f++) {
+			snprintf(path, sizeof(path), "%s/d%d/f%d", top, d, f);
+			if (unlink(path) != 0) {
+				fail(path);
+			}
+		}
+		snprintf(path, sizeof(path), "%s/d%d", top, d);
+		rmdir(path);
+	}
+	int files = DIRS * FILES_PER_DIR;
+	report("unlink", "files", files, files, 0, now() - start);
+	rmdir(top);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s mountpoint\n", argv[0]);
+		return 1;
+	}
+	const char *root = argv[1];
+	buf = malloc(SEQ_SIZE);
+	memset(buf, 'x', SEQ_SIZE);
+	char path[256];
+	report_begin(stdout, "workloads");
+
+	snprintf(path, sizeof(path), "%s/large", root);
+	sequential(path);
+	random_io(path);
+	unlink(path);
+
+	snprintf(path, sizeof(path), "%s/small", root);
+	create_storm(path);
+	list(path);
+	unlink_storm(path);
+
+	report_end();
+	free(buf);
+	return 0;
+}
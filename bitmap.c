@@ -2,6 +2,11 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "bitmap.h"
 
@@ -9,6 +14,63 @@
 #define byte_index(n) ((n) / 8)
 #define bit_index(n) ((n) % 8)
 
+// The search functions work on 64-bit words. Bitmaps always fill whole blocks,
+// so loading the word holding the last bit never reads past the bitmap.
+#define WORD_BITS 64
+#define ALL_ONES (~(uint64_t) 0)
+
+// Load the given 64-bit word of the bitmap (bit 0 of the bitmap is bit 0 of word 0).
+static inline uint64_t load_word(const uint8_t *base, int word) {
+  uint64_t value;
+  memcpy(&value, base + (size_t) word * 8, 8);
+  return value;
+}
+
+// Return the first word in [word, end_word) that isn't equal to skip (all ones or all zeros),
+// or end_word if they all are.
+static int skip_words(const uint8_t *base, int word, int end_word, uint64_t skip) {
+#ifdef __SSE2__
+  // compare two words at a time
+  __m128i pattern = _mm_set1_epi32((int) skip);
+  while (word + 2 <= end_word) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) (base + (size_t) word * 8));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern)) != 0xffff) {
+      break;
+    }
+    word += 2;
+  }
+#endif
+  while (word < end_word && load_word(base, word) == skip) {
+    word++;
+  }
+  return word;
+}
+
+// Find the first bit in [start, end) whose value differs from the all-ones or all-zeros skip pattern.
+// returns end if there is none.
+static int find_bit(void *bitmap_start, int start, int end, uint64_t skip) {
+  const uint8_t *base = (const uint8_t *) bitmap_start;
+  if (start >= end) {
+    return end;
+  }
+
+  int word = start / WORD_BITS;
+  int end_word = (end + WORD_BITS - 1) / WORD_BITS;
+  // ignore the bits of the first word that come before start
+  uint64_t below = (((uint64_t) 1) << (start % WORD_BITS)) - 1;
+  uint64_t bits = (load_word(base, word) ^ skip) & ~below;
+  while (bits == 0) {
+    word = skip_words(base, word + 1, end_word, skip);
+    if (word >= end_word) {
+      return end;
+    }
+    bits = load_word(base, word) ^ skip;
+  }
+
+  int index = word * WORD_BITS + __builtin_ctzll(bits);
+  return index < end ? index : end;
+}
+
 // Get the bit at the given index in the bitmap.
 int bitmap_get(void *bitmap_start, int index) {
   uint8_t *base = (uint8_t *) bitmap_start;
@@ -30,6 +92,65 @@ void bitmap_put(void *bitmap_start, int index, int value) {
   }
 }
 
+// Set length bits starting at the given index to the given value.
+void bitmap_put_range(void *bitmap_start, int index, int length, int value) {
+  uint8_t *base = (uint8_t *) bitmap_start;
+  int end = index + length;
+
+  // bits up to the next byte boundary, then whole bytes, then the remainder
+  while (index < end && bit_index(index) != 0) {
+    bitmap_put(bitmap_start, index++, value);
+  }
+  int bytes = (end - index) / 8;
+  memset(base + byte_index(index), value ? 0xff : 0, bytes);
+  index += bytes * 8;
+  while (index < end) {
+    bitmap_put(bitmap_start, index++, value);
+  }
+}
+
+// Find the first clear bit in [start, end), or -1 if every bit is set.
+int bitmap_find_zero(void *bitmap_start, int start, int end) {
+  int index = find_bit(bitmap_start, start, end, ALL_ONES);
+  return index < end ? index : -1;
+}
+
+// Find the first set bit in [start, end), or end if every bit is clear.
+int bitmap_find_one(void *bitmap_start, int start, int end) {
+  return find_bit(bitmap_start, start, end, 0);
+}
+
+// Find the first run of at least length clear bits in [start, end), or -1 if there is none.
+int bitmap_find_zero_run(void *bitmap_start, int start, int end, int length) {
+  while (start < end) {
+    int run_start = bitmap_find_zero(bitmap_start, start, end);
+    if (run_start < 0 || end - run_start < length) {
+      return -1;
+    }
+    // only the bits up to the required length need to be clear
+    int run_end = bitmap_find_one(bitmap_start, run_start, run_start + length);
+    if (run_end == run_start + length) {
+      return run_start;
+    }
+    start = run_end + 1;
+  }
+  return -1;
+}
+
+// Count the set bits in [0, length).
+int bitmap_count(void *bitmap_start, int length) {
+  const uint8_t *base = (const uint8_t *) bitmap_start;
+  int count = 0;
+  int words = length / WORD_BITS;
+  for (int i = 0; i < words; i++) {
+    count += __builtin_popcountll(load_word(base, i));
+  }
+  for (int i = words * WORD_BITS; i < length; i++) {
+    count += bitmap_get(bitmap_start, i);
+  }
+  return count;
+}
+
 // Pretty-print a given length of bits from a bitmap.
 void bitmap_print(void *bitmap_start, int length) {
 
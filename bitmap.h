@@ -9,6 +9,21 @@ int bitmap_get(void *bitmap_start, int index);
 // Set the bit at the given index in the bitmap to the given value.
 void bitmap_put(void *bitmap_start, int index, int value);
 
+// Set length bits starting at the given index to the given value.
+void bitmap_put_range(void *bitmap_start, int index, int length, int value);
+
+// Find the first clear bit in [start, end), or -1 if every bit is set.
+int bitmap_find_zero(void *bitmap_start, int start, int end);
+
+// Find the first set bit in [start, end), or end if every bit is clear.
+int bitmap_find_one(void *bitmap_start, int start, int end);
+
+// Find the first run of at least length clear bits in [start, end), or -1 if there is none.
+int bitmap_find_zero_run(void *bitmap_start, int start, int end, int length);
+
+// Count the set bits in [0, length).
+int bitmap_count(void *bitmap_start, int length);
+
 // Pretty-print a given length of bits from a bitmap.
 void bitmap_print(void *bitmap_start, int length);
 
@@ -6,33 +6,38 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "backend.h"
 #include "bitmap.h"
 #include "blocks.h"
+#include "cache.h"
 #include "inode.h"
+#include "journal.h"
+#include "refcount.h"
+#include "trace.h"
+#include "writeback.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
 const int BLOCK_SIZE = 4096; // each block has 4K bytes
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // the total disk size is 1MB
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8; // 256 bits = 32 bytes (Note: we assume BLOCK_COUNT is divisible by 8)
-const int INODE_BITMAP_SIZE = (BLOCK_SIZE - BLOCK_BITMAP_SIZE) / ((sizeof(inode_t) * 8) + 1);
-const int INODE_COUNT = 8 * INODE_BITMAP_SIZE;
-// We have 4096-32=4064 bytes for storing the inode bitmap and table. Each 8 inodes requires 1 byte of bitmap.
-// We end up with space for 31 bytes of inode bitmap, and the corresponding 248 inodes.
+const int64_t NUFS_DEFAULT_SIZE = 1024 * 1024; // 256 blocks
 
 static int blocks_fd = -1;
-static void *blocks_base = 0;
+static void *meta_base = 0; // private mapping, for metadata
+static size_t blocks_size = 0;
+static group_t *groups = 0; // in-memory state of each allocation group
+static int can_punch = 1;   // whether the image file supports punching holes
 
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
-	int quo = bytes / BLOCK_SIZE;
-	int rem = bytes % BLOCK_SIZE;
+int bytes_to_blocks(int64_t bytes) {
+	int64_t quo = bytes / BLOCK_SIZE;
+	int64_t rem = bytes % BLOCK_SIZE;
 	if (rem == 0) {
 		return quo;
 	} else {
@@ -40,75 +45,420 @@ int bytes_to_blocks(int bytes) {
 	}
 }
 
-// Load and initialize the given disk image.
-void blocks_init(const char *image_path) {
+// Lay out the metadata regions of a volume with the given geometry, in order:
+// superblock, group descriptors, block bitmap, inode bitmap, inode chunk index, reference count
+// index, journal, then data.
+static void layout_superblock(superblock_t *sb, int block_count, int inode_count) {
+	memset(sb, 0, sizeof(superblock_t));
+	sb->magic = NUFS_MAGIC;
+	sb->version = NUFS_VERSION;
+	sb->block_size = BLOCK_SIZE;
+	sb->block_count = block_count;
+
+	// every group gets the same share of inodes, rounded up to whole bitmap words
+	sb->blocks_per_group = BLOCK_SIZE * 8;
+	sb->group_count = ((int64_t) block_count + sb->blocks_per_group - 1) / sb->blocks_per_group;
+	int64_t per_group = ((int64_t) inode_count + sb->group_count - 1) / sb->group_count;
+	sb->inodes_per_group = (per_group + 63) / 64 * 64;
+	inode_count = sb->inodes_per_group * sb->group_count;
+	sb->inode_count = inode_count;
+
+	sb->group_desc_start = 1;
+	sb->group_desc_blocks = bytes_to_blocks((int64_t) sb->group_count * sizeof(group_desc_t));
+	sb->block_bitmap_start = sb->group_desc_start + sb->group_desc_blocks;
+	sb->block_bitmap_blocks = bytes_to_blocks(((int64_t) block_count + 7) / 8);
+	sb->inode_bitmap_start = sb->block_bitmap_start + sb->block_bitmap_blocks;
+	sb->inode_bitmap_blocks = bytes_to_blocks(((int64_t) inode_count + 7) / 8);
+	sb->inode_map_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+	sb->inode_map_blocks = bytes_to_blocks((int64_t) inode_count / INODE_CHUNK * sizeof(uint32_t));
+	sb->refcount_map_start = sb->inode_map_start + sb->inode_map_blocks;
+	sb->refcount_map_blocks = bytes_to_blocks(
+		((int64_t) block_count + REFCOUNT_CHUNK - 1) / REFCOUNT_CHUNK * sizeof(uint32_t));
+	sb->journal_start = sb->refcount_map_start + sb->refcount_map_blocks;
+	// about 1.5% of the volume, up to 64MB
+	sb->journal_blocks = block_count / 64;
+	sb->journal_blocks = sb->journal_blocks < 16 ? 16 : sb->journal_blocks > 16384 ? 16384 : sb->journal_blocks;
+	sb->data_start = sb->journal_start + sb->journal_blocks;
+}
+
+// Format the given disk image with a volume of the given size in bytes.
+// returns 0 on success, -1 on fail.
+int blocks_format(const char *image_path, int64_t size, int inode_count) {
+	int64_t block_count = size / BLOCK_SIZE;
+	if (block_count < 16 || block_count > INT32_MAX) {
+		fprintf(stderr, "nufs: unsupported volume size %ld\n", size);
+		return -1;
+	}
+	int64_t max_inodes = INT32_MAX - BLOCK_SIZE * 8 * 64;
+	if (inode_count <= 0) {
+		// an inode costs next to nothing until it is used, so there are plenty for small files
+		inode_count = block_count * 4 < max_inodes ? block_count * 4 : max_inodes;
+	}
+	if (inode_count > max_inodes) {
+		fprintf(stderr, "nufs: too many inodes\n");
+		return -1;
+	}
+
+	superblock_t sb;
+	layout_superblock(&sb, block_count, inode_count);
+	if (sb.data_start >= block_count) {
+		fprintf(stderr, "nufs: volume too small for %d inodes\n", sb.inode_count);
+		return -1;
+	}
+
+	int fd = open(image_path, O_CREAT | O_RDWR, 0644);
+	if (fd == -1) {
+		return -1;
+	}
+	// truncating to zero first guarantees all of the metadata starts out cleared
+	if (ftruncate(fd, 0) != 0 || ftruncate(fd, block_count * BLOCK_SIZE) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	// only the metadata regions need to be written
+	size_t meta_size = (size_t) sb.data_start * BLOCK_SIZE;
+	void *meta = mmap(0, meta_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(meta != MAP_FAILED);
+	memcpy(meta, &sb, sizeof(superblock_t));
+	// the metadata blocks are never available for allocation
+	void *bbm = meta + (size_t) sb.block_bitmap_start * BLOCK_SIZE;
+	bitmap_put_range(bbm, 0, sb.data_start, 1);
+	group_desc_t *desc = meta + (size_t) sb.group_desc_start * BLOCK_SIZE;
+	for (int g = 0; g < sb.group_count; g++) {
+		int64_t first = (int64_t) g * sb.blocks_per_group;
+		int64_t end = first + sb.blocks_per_group < block_count ? first + sb.blocks_per_group : block_count;
+		if (first < sb.data_start) {
+			first = end < sb.data_start ? end : sb.data_start;
+		}
+		desc[g].free_blocks = end - first;
+		desc[g].free_inodes = sb.inodes_per_group;
+	}
+	munmap(meta, meta_size);
+	fsync(fd);
+	close(fd);
+	return 0;
+}
+
+// Load the given disk image, formatting it with the default size if it is empty.
+// returns 0 on success, -1 on fail.
+int blocks_init(const char *image_path) {
 	blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
-	assert(blocks_fd != -1);
+	if (blocks_fd == -1) {
+		perror(image_path);
+		return -1;
+	}
 
-	// make sure the disk image is exactly 1MB
-	int rv = ftruncate(blocks_fd, NUFS_SIZE);
+	struct stat st;
+	int rv = fstat(blocks_fd, &st);
 	assert(rv == 0);
+	if (st.st_size == 0) {
+		// a brand new image, so lay out a default sized volume
+		close(blocks_fd);
+		if (blocks_format(image_path, NUFS_DEFAULT_SIZE, 0) != 0) {
+			return -1;
+		}
+		return blocks_init(image_path);
+	}
 
-	// map the image to memory
-	blocks_base =
-		mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-	assert(blocks_base != MAP_FAILED);
+	superblock_t sb;
+	if (pread(blocks_fd, &sb, sizeof(sb), 0) != sizeof(sb) || sb.magic != NUFS_MAGIC) {
+		fprintf(stderr, "nufs: %s is not a nufs image (run mkfs.nufs)\n", image_path);
+		close(blocks_fd);
+		return -1;
+	}
+	if (sb.version != NUFS_VERSION || sb.block_size != BLOCK_SIZE
+			|| st.st_size < (off_t) sb.block_count * BLOCK_SIZE) {
+		fprintf(stderr, "nufs: %s has an unsupported geometry\n", image_path);
+		close(blocks_fd);
+		return -1;
+	}
 
-	// block 0 stores the block bitmap, the inode bitmap, and the inode table
-	void *bbm = get_blocks_bitmap();
-	bitmap_put(bbm, 0, 1);
-	// block 1 stores the linked-lists of which blocks are being used by each inode
-	bitmap_put(bbm, 1, 1);
+	// finish any metadata updates that were committed before a crash
+	if (journal_replay(blocks_fd, &sb) != 0) {
+		fprintf(stderr, "nufs: unable to replay the journal of %s\n", image_path);
+		close(blocks_fd);
+		return -1;
+	}
+
+	// metadata is mapped to memory, while file data goes through the engine picked
+	blocks_size = (size_t) sb.block_count * BLOCK_SIZE;
+	if (backend_open(image_path, blocks_fd, blocks_size) != 0) {
+		close(blocks_fd);
+		return -1;
+	}
+	meta_base =
+		mmap(0, blocks_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, blocks_fd, 0);
+	assert(meta_base != MAP_FAILED);
+
+	groups = calloc(sb.group_count, sizeof(group_t));
+	uint32_t *chunk_map = get_inode_map();
+	int chunks = sb.inodes_per_group / INODE_CHUNK;
+	for (int g = 0; g < sb.group_count; g++) {
+		pthread_mutex_init(&groups[g].block_lock, NULL);
+		pthread_mutex_init(&groups[g].inode_lock, NULL);
+		groups[g].block_hint = group_first_block(g);
+		groups[g].inode_hint = g * sb.inodes_per_group;
+		// a group's chunks are allocated in order, so the frontier follows the last one
+		int c = chunks;
+		while (c > 0 && chunk_map[(int64_t) g * chunks + c - 1] == 0) {
+			c--;
+		}
+		groups[g].inode_frontier = g * sb.inodes_per_group + c * INODE_CHUNK;
+	}
+	journal_init();
+	writeback_init();
+	return 0;
 }
 
 // Close the disk image.
 void blocks_free() {
-	int rv = munmap(blocks_base, NUFS_SIZE);
+	writeback_close();
+	journal_close();
+	for (int g = 0; g < get_superblock()->group_count; g++) {
+		pthread_mutex_destroy(&groups[g].block_lock);
+		pthread_mutex_destroy(&groups[g].inode_lock);
+	}
+	free(groups);
+	groups = 0;
+	backend_close();
+	int rv = munmap(meta_base, blocks_size);
 	assert(rv == 0);
 	close(blocks_fd);
 }
 
 // Allocate a new block and return its index.
 int alloc_block() {
-	for (int i = 2; i < BLOCK_COUNT; i++) {
-		if (!bitmap_get(blocks_base, i)) {
-			bitmap_put(blocks_base, i, 1);
-			printf("+ alloc_block() -> %d\n", i);
-			return i;
+	int got;
+	return alloc_blocks(0, 1, &got);
+}
+
+// Allocate a run of up to count contiguous blocks within the given group, extending
+// the run ending just before goal if goal is free. Unless partial is set, only a full
+// run of count blocks will do.
+// returns the first block of the run, or -1 if the group has no room for it.
+static int group_alloc(int group, int goal, int count, int partial, int *got) {
+	group_desc_t *desc = get_group_desc(group);
+	if (__atomic_load_n(&desc->free_blocks, __ATOMIC_RELAXED) < (partial ? 1 : count)) {
+		return -1;
+	}
+	superblock_t *sb = get_superblock();
+	void *bbm = get_blocks_bitmap();
+	group_t *grp = &groups[group];
+	int first = group_first_block(group);
+	int end = (int64_t) (group + 1) * sb->blocks_per_group < sb->block_count
+		? (group + 1) * sb->blocks_per_group : sb->block_count;
+
+	pthread_mutex_lock(&grp->block_lock);
+	int run = -1;
+	if (goal >= first && goal < end && !bitmap_get(bbm, goal)) {
+		// extend the caller's previous run in place
+		run = goal;
+	} else {
+		// next fit: look for a long enough run after the last allocation, then wrap around
+		int start = grp->block_hint >= first && grp->block_hint < end ? grp->block_hint : first;
+		run = bitmap_find_zero_run(bbm, start, end, count);
+		if (run < 0) {
+			run = bitmap_find_zero_run(bbm, first, end, count);
+		}
+		if (run < 0 && partial) {
+			// no run is long enough, so settle for the first free blocks
+			run = bitmap_find_zero(bbm, start, end);
+			if (run < 0) {
+				run = bitmap_find_zero(bbm, first, end);
+			}
 		}
 	}
+	if (run >= 0) {
+		int run_end = run + count < end ? run + count : end;
+		*got = bitmap_find_one(bbm, run, run_end) - run;
+		bitmap_put_range(bbm, run, *got, 1);
+		journal_dirty_bits(bbm, run, *got);
+		grp->block_hint = run + *got;
+		__atomic_sub_fetch(&desc->free_blocks, *got, __ATOMIC_RELAXED);
+		journal_dirty(desc, sizeof(group_desc_t));
+	}
+	pthread_mutex_unlock(&grp->block_lock);
+	return run;
+}
 
-	return -1;
+// Allocate a run of up to count contiguous blocks, trying goal first.
+// returns the first block of the run, or -1 if the disk is full.
+int alloc_blocks(int goal, int count, int *got) {
+	superblock_t *sb = get_superblock();
+	int group_count = sb->group_count;
+	int home = goal >= sb->data_start && goal < sb->block_count ? block_group(goal) : 0;
+
+	// stay in the goal's group if it has any room, to keep files near their inode;
+	// otherwise take a full run from another group before splitting the request
+	int run = group_alloc(home, goal, count, 1, got);
+	for (int i = 1; run < 0 && i < group_count; i++) {
+		run = group_alloc((home + i) % group_count, 0, count, 0, got);
+	}
+	for (int i = 1; run < 0 && i < group_count; i++) {
+		run = group_alloc((home + i) % group_count, 0, count, 1, got);
+	}
+	if (run < 0) {
+		return -1;
+	}
+	trace_count(STAT_BLOCK_ALLOCS, 1);
+	trace_count(STAT_BLOCKS_ALLOCATED, *got);
+	return run;
 }
 
 // Deallocate the block at the given index.
 void free_block(int index) {
-	printf("+ free_block(%d)\n", index);
+	free_blocks(index, 1);
+}
+
+// Return count blocks starting at the given index to the free space.
+// Until the transaction commits, a crash would bring back the metadata that used the
+// blocks, so their bits stay set here and are only cleared in the copy of the bitmap the
+// journal logs; reuse_blocks clears them here once the commit is durable.
+static void release_blocks(int index, int count) {
+	trace_count(STAT_BLOCKS_FREED, count);
+	void *bbm = get_blocks_bitmap();
+	journal_revoke(index, count);
+	writeback_forget(index, count);
+	cache_forget(index, count);
+	// a run may cross into the next group, whose bits are under another lock
+	while (count > 0) {
+		int group = block_group(index);
+		int64_t group_end = (int64_t) (group + 1) * get_superblock()->blocks_per_group;
+		int n = count < group_end - index ? count : group_end - index;
+		pthread_mutex_lock(&groups[group].block_lock);
+		journal_dirty_bits(bbm, index, n);
+		__atomic_add_fetch(&get_group_desc(group)->free_blocks, n, __ATOMIC_RELAXED);
+		journal_dirty(get_group_desc(group), sizeof(group_desc_t));
+		pthread_mutex_unlock(&groups[group].block_lock);
+		index += n;
+		count -= n;
+	}
+}
+
+// Make count blocks starting at the given index, freed by a transaction that is now
+// durable, available to allocate again.
+void reuse_blocks(int index, int count) {
 	void *bbm = get_blocks_bitmap();
-	bitmap_put(bbm, index, 0);
+	while (count > 0) {
+		int group = block_group(index);
+		int64_t group_end = (int64_t) (group + 1) * get_superblock()->blocks_per_group;
+		int n = count < group_end - index ? count : group_end - index;
+		// the transaction logged the bits clear already, so this changes nothing to journal
+		pthread_mutex_lock(&groups[group].block_lock);
+		bitmap_put_range(bbm, index, n, 0);
+		pthread_mutex_unlock(&groups[group].block_lock);
+		index += n;
+		count -= n;
+	}
+}
+
+// Deallocate count blocks starting at the given index.
+void free_blocks(int index, int count) {
+	while (count > 0) {
+		// blocks shared with other files stay allocated until their last reference goes
+		int n = refcount_run(index, count, 0);
+		if (n == 0) {
+			n = 1;
+			if (!refcount_drop(index)) {
+				release_blocks(index, 1);
+			}
+		} else {
+			release_blocks(index, n);
+		}
+		index += n;
+		count -= n;
+	}
 }
 
-// Get the block at the given index, returning a pointer to its start.
+// Return the number of blocks free across the groups, including those still waiting on a commit.
+int64_t free_block_count() {
+	int64_t total = 0;
+	for (int g = 0; g < get_superblock()->group_count; g++) {
+		total += __atomic_load_n(&get_group_desc(g)->free_blocks, __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+// Make count data blocks starting at the given index read as zeros.
+void zero_blocks(int index, int count) {
+	off_t offset = (off_t) index * BLOCK_SIZE;
+	off_t len = (off_t) count * BLOCK_SIZE;
+	// punching them out of the image is cheaper than writing zeros, and gives the space back
+	if (__atomic_load_n(&can_punch, __ATOMIC_RELAXED)) {
+		if (fallocate(blocks_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+			cache_forget(index, count);
+			return;
+		}
+		if (errno == EOPNOTSUPP) {
+			__atomic_store_n(&can_punch, 0, __ATOMIC_RELAXED);
+		}
+	}
+	data_zero(offset, len);
+	writeback_dirty(index, count);
+}
+
+// Get the metadata block at the given index, returning a pointer to its start.
 void *get_block_at(int index) {
-	return blocks_base + BLOCK_SIZE * index;
+	return meta_base + (size_t) BLOCK_SIZE * index;
+}
+
+// Return the file descriptor of the disk image.
+int get_blocks_fd() {
+	return blocks_fd;
 }
 
-// The following functions return pointers to various parts of block 0, which consists of:
-// - 32 bytes (256 bits) of the block bitmap (representing which blocks are available)
-// - 31 bytes (248 bits) of the inode bitmap (representing which locations in the inode table are available to store inodes)
-// - 3968 bytes of the inode table (storing the actual inodes)
+// Return a pointer to the superblock.
+superblock_t *get_superblock() {
+	return meta_base;
+}
+
+// Return the descriptor of the given allocation group.
+group_desc_t *get_group_desc(int group) {
+	return (group_desc_t *) get_block_at(get_superblock()->group_desc_start) + group;
+}
+
+// Return the in-memory state of the given allocation group.
+group_t *get_group(int group) {
+	return &groups[group];
+}
+
+// Return the allocation group holding the given block.
+int block_group(int block) {
+	return block / get_superblock()->blocks_per_group;
+}
+
+// Return the allocation group holding the given inode.
+int inode_group(int inum) {
+	return inum / get_superblock()->inodes_per_group;
+}
+
+// Return the first block of the given allocation group that can hold data,
+// since the metadata regions may take up the start of the first groups.
+int group_first_block(int group) {
+	superblock_t *sb = get_superblock();
+	int first = group * sb->blocks_per_group;
+	return first > sb->data_start ? first : sb->data_start;
+}
+
+// The following functions return pointers to the metadata regions described by the superblock.
 
 // Return a pointer to the beginning of the block bitmap.
 void *get_blocks_bitmap() {
-	return blocks_base;
+	return get_block_at(get_superblock()->block_bitmap_start);
 }
 
 // Return a pointer to the beginning of the inode bitmap.
 void *get_inode_bitmap() {
-	return blocks_base + BLOCK_BITMAP_SIZE;
+	return get_block_at(get_superblock()->inode_bitmap_start);
+}
+
+// Return a pointer to the beginning of the chunk index of the inode table.
+uint32_t *get_inode_map() {
+	return get_block_at(get_superblock()->inode_map_start);
 }
 
-// Return a pointer to the beginning of the inode table.
-void *get_inode_table() {
-	return blocks_base + BLOCK_BITMAP_SIZE + INODE_BITMAP_SIZE;
+// Return a pointer to the beginning of the index of the reference count table.
+uint32_t *get_refcount_map() {
+	return get_block_at(get_superblock()->refcount_map_start);
 }
@@ -1,35 +1,137 @@
 /* A block-based abstraction over a disk image file.
- * The disk image is mmapped, so block data is accessed using pointers. */
+ * Metadata is accessed using pointers into a private mapping of the disk image, whose
+ * changes reach the image only when the journal commits them (see journal.h). File data
+ * is read and written through the I/O engine picked when mounting (see backend.h). */
 
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into 256 blocks
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 8
+
 extern const int BLOCK_SIZE; // each block has 4K bytes
-extern const int NUFS_SIZE; // the total disk size is 1MB
-extern const int BLOCK_BITMAP_SIZE; // 256 bits = 32 bytes for tracking the availability of the blocks
-extern const int INODE_BITMAP_SIZE;
-extern const int INODE_COUNT; // We end up with space for 31 bytes of inode bitmap, and the corresponding 248 inodes.
+extern const int64_t NUFS_DEFAULT_SIZE; // images created on mount without mkfs are 1MB
+
+// Structure of the superblock, stored at the start of block 0.
+// It records the geometry of the volume so that images can be any size.
+// The volume is split into allocation groups, each with its own stretch of blocks and
+// inodes, its own part of both bitmaps, and its own lock, so allocations in different
+// groups don't contend.
+typedef struct superblock {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t inode_count;
+	uint32_t block_bitmap_start; // first block of the block bitmap
+	uint32_t block_bitmap_blocks;
+	uint32_t inode_bitmap_start; // first block of the inode bitmap
+	uint32_t inode_bitmap_blocks;
+	uint32_t inode_map_start; // first block of the chunk index of the inode table (see inode.h)
+	uint32_t inode_map_blocks;
+	uint32_t refcount_map_start; // first block of the index of the reference count table (see refcount.h)
+	uint32_t refcount_map_blocks;
+	uint32_t data_start; // first block available for file data
+	uint32_t group_count;
+	uint32_t blocks_per_group; // one bitmap block's worth
+	uint32_t inodes_per_group; // a multiple of 64, so groups never share a bitmap word
+	uint32_t group_desc_start; // first block of the group descriptor table
+	uint32_t group_desc_blocks;
+	uint32_t journal_start; // first block of the metadata journal
+	uint32_t journal_blocks;
+} superblock_t;
+
+// Structure of a group descriptor, kept in a table right after the superblock.
+// The counts are changed with atomic operations, so they can be read without locks.
+typedef struct group_desc {
+	uint32_t free_blocks;
+	uint32_t free_inodes;
+	uint32_t dirs; // directories whose inodes are in the group
+	uint32_t _reserved;
+} group_desc_t;
 
+// In-memory state of an allocation group.
+typedef struct group {
+	pthread_mutex_t block_lock; // guards the group's part of the block bitmap
+	pthread_mutex_t inode_lock; // guards the group's part of the inode bitmap
+	int block_hint; // where the next-fit search for free blocks starts
+	int inode_hint; // where the next-fit search for free inodes starts
+	int inode_frontier; // no inode from here to the end of the group has its chunk allocated
+} group_t;
 
 // Compute the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes);
+int bytes_to_blocks(int64_t bytes);
 
-// Load and initialize the given disk image.
-void blocks_init(const char *image_path);
+// Format the given disk image with a volume of the given size in bytes.
+// An inode_count of 0 picks a default of four inodes per block. Only the inode bitmap and the
+// chunk index are sized by it; the inode table itself grows as inodes are allocated.
+// Returns 0 on success, or -1 if the image can't be created.
+int blocks_format(const char *image_path, int64_t size, int inode_count);
+
+// Load the given disk image, formatting it with the default size if it is empty.
+// Returns 0 on success, or -1 if the image is missing or isn't a nufs volume.
+int blocks_init(const char *image_path);
 
 // Close the disk image.
 void blocks_free();
 
+// Return the file descriptor of the disk image, for I/O that doesn't go through the mapping.
+int get_blocks_fd();
+
+// Return a pointer to the superblock.
+superblock_t *get_superblock();
+
+// Return the descriptor of the given allocation group.
+group_desc_t *get_group_desc(int group);
+
+// Return the in-memory state of the given allocation group.
+group_t *get_group(int group);
+
+// Return the allocation group holding the given block.
+int block_group(int block);
+
+// Return the allocation group holding the given inode.
+int inode_group(int inum);
+
+// Return the first block of the given allocation group that can hold data.
+int group_first_block(int group);
+
+// The allocation functions below may be called from any thread; each group has its own lock.
+
 // Allocate a new block and return its index.
 int alloc_block();
 
+// Allocate a run of up to count contiguous blocks, trying goal first (0 for no goal),
+// then the rest of goal's group, and only then the other groups.
+// Returns the first block of the run and sets got to its length, or returns -1 if the disk is full.
+int alloc_blocks(int goal, int count, int *got);
+
 // Deallocate the block at the given index.
 void free_block(int index);
 
-// Get the block at the given index, returning a pointer to its start.
+// Deallocate count blocks starting at the given index. Blocks that other files share
+// (see refcount.h) only lose a reference. Blocks freed can't be allocated again until
+// the transaction freeing them commits (see journal.h).
+void free_blocks(int index, int count);
+
+// Make count blocks starting at the given index, freed by a transaction that is now
+// durable, available to allocate again. Called by the journal.
+void reuse_blocks(int index, int count);
+
+// Returns the number of blocks free across the groups, counting those waiting for the
+// transaction freeing them to commit.
+int64_t free_block_count();
+
+// Make count data blocks starting at the given index read as zeros, giving their space
+// in the image file back to the host when it can.
+void zero_blocks(int index, int count);
+
+// Get the metadata block at the given index, returning a pointer to its start.
+// Changes to it must be declared to the journal.
 void *get_block_at(int index);
 
 // Return a pointer to the beginning of the block bitmap.
@@ -38,7 +140,10 @@ void *get_blocks_bitmap();
 // Return a pointer to the beginning of the inode bitmap.
 void *get_inode_bitmap();
 
-// Return a pointer to the beginning of the inode table.
-void *get_inode_table();
+// Return a pointer to the beginning of the chunk index of the inode table.
+uint32_t *get_inode_map();
+
+// Return a pointer to the beginning of the index of the reference count table.
+uint32_t *get_refcount_map();
 
 #endif
@@ -0,0 +1,507 @@
+/* The block cache of cache.h.
+ * The cache is split into shards by block, each an ARC of its own under its own lock, so
+ * threads reading different blocks rarely wait on each other. Every shard keeps the four
+ * lists of ARC: T1 and T2 of blocks cached, and B1 and B2 of blocks recently evicted from
+ * them, whose data is gone. Lists are linked through indices into the shard's entries.
+ *
+ * A block missing from the cache gets an entry that is loading while the engine reads it,
+ * with no lock held. A write to the block meanwhile marks the entry stale, and the data
+ * read is then thrown away rather than cached. Entries that are loading are never evicted,
+ * and a read finding one reads the block from the engine itself rather than waiting. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "cache.h"
+#include "trace.h"
+#include "writeback.h"
+
+#define CACHE_SHARDS 16
+#define DEFAULT_DIRECT_MB 64 // the cache when the engine bypasses the page cache
+#define DROP_CHUNK 512 // blocks in the largest folio the page cache is expected to use (2MB)
+
+// The lists of ARC, and the free entries.
+enum { T1, T2, B1, B2, FREE, LISTS };
+
+// The state of an entry with data.
+enum { READY, LOADING, STALE };
+
+// A block a shard knows about.
+typedef struct entry {
+	uint32_t block;
+	uint8_t list;
+	uint8_t state;
+	int32_t prev; // towards the most recently used end of its list, or -1
+	int32_t next; // towards the least recently used end, or -1
+	int32_t chain; // the next entry in its hash bucket, or -1
+	char *data; // for entries on T1 or T2
+} entry_t;
+
+// One of the lists of a shard.
+typedef struct list {
+	int32_t head; // the most recently used entry, or -1
+	int32_t tail; // the least recently used entry, or -1
+	int size;
+} list_t;
+
+// A shard of the cache.
+typedef struct shard {
+	pthread_mutex_t lock;
+	int capacity; // blocks of data
+	int target;   // the size of T1 that ARC aims for, p in its paper
+	entry_t *entries;
+	int32_t *buckets;
+	int bucket_mask;
+	list_t lists[LISTS];
+	char **spare; // data buffers not in use
+	int spare_count;
+	char *slab;   // all of the data buffers
+} shard_t;
+
+// A run of blocks missing from the cache, read from the engine in one piece.
+typedef struct miss {
+	int block;
+	int count;
+	char *buf;
+} miss_t;
+
+int cache_mb = -1;
+
+static shard_t *shards = 0;
+
+// Return the shard holding the given block.
+static shard_t *shard_of(int block) {
+	return &shards[block % CACHE_SHARDS];
+}
+
+// Unlink an entry from its list.
+static void list_remove(shard_t *s, entry_t *e) {
+	list_t *l = &s->lists[e->list];
+	if (e->prev >= 0) {
+		s->entries[e->prev].next = e->next;
+	} else {
+		l->head = e->next;
+	}
+	if (e->next >= 0) {
+		s->entries[e->next].prev = e->prev;
+	} else {
+		l->tail = e->prev;
+	}
+	e->prev = e->next = -1;
+	l->size--;
+}
+
+// Put an entry at the most recently used end of the given list.
+static void list_push(shard_t *s, entry_t *e, int list) {
+	list_t *l = &s->lists[list];
+	int32_t i = e - s->entries;
+	e->list = list;
+	e->prev = -1;
+	e->next = l->head;
+	if (l->head >= 0) {
+		s->entries[l->head].prev = i;
+	} else {
+		l->tail = i;
+	}
+	l->head = i;
+	l->size++;
+}
+
+// Move an entry to the most recently used end of the given list.
+static void list_move(shard_t *s, entry_t *e, int list) {
+	list_remove(s, e);
+	list_push(s, e, list);
+}
+
+// Return the entry of the given block, or null if the shard doesn't know it.
+static entry_t *find(shard_t *s, int block) {
+	for (int32_t i = s->buckets[block / CACHE_SHARDS & s->bucket_mask]; i >= 0; i = s->entries[i].chain) {
+		if (s->entries[i].block == (uint32_t) block) {
+			return &s->entries[i];
+		}
+	}
+	return 0;
+}
+
+// Forget an entry altogether, giving back its data buffer if it has one.
+static void drop(shard_t *s, entry_t *e) {
+	int32_t *link = &s->buckets[e->block / CACHE_SHARDS & s->bucket_mask];
+	while (*link != e - s->entries) {
+		link = &s->entries[*link].chain;
+	}
+	*link = e->chain;
+	if (e->data != 0) {
+		s->spare[s->spare_count++] = e->data;
+		e->data = 0;
+	}
+	list_move(s, e, FREE);
+}
+
+// Return the least recently used entry of the given list that isn't loading, or null.
+static entry_t *idle_tail(shard_t *s, int list) {
+	for (int32_t i = s->lists[list].tail; i >= 0; i = s->entries[i].prev) {
+		if (s->entries[i].state == READY) {
+			return &s->entries[i];
+		}
+	}
+	return 0;
+}
+
+// Evict a block from T1 to B1, or from T2 to B2, freeing a data buffer, as ARC's REPLACE
+// does; in_b2 says whether the block being admitted was found on B2.
+// returns 0 on success, -1 if every cached block is loading.
+static int replace(shard_t *s, int in_b2) {
+	int t1 = s->lists[T1].size;
+	int from = t1 > 0 && (t1 > s->target || (in_b2 && t1 == s->target)) ? T1 : T2;
+	entry_t *e = idle_tail(s, from);
+	if (e == 0) {
+		from = from == T1 ? T2 : T1;
+		e = idle_tail(s, from);
+	}
+	if (e == 0) {
+		return -1;
+	}
+	s->spare[s->spare_count++] = e->data;
+	e->data = 0;
+	list_move(s, e, from == T1 ? B1 : B2);
+	return 0;
+}
+
+// Make room for a block the shard doesn't know at all, as ARC does on a miss.
+// returns 0 on success, -1 if every cached block is loading.
+static int make_room(shard_t *s) {
+	int c = s->capacity;
+	int t1 = s->lists[T1].size;
+	int l1 = t1 + s->lists[B1].size;
+	int total = l1 + s->lists[T2].size + s->lists[B2].size;
+	if (l1 >= c) {
+		if (t1 < c) {
+			drop(s, &s->entries[s->lists[B1].tail]);
+			return replace(s, 0);
+		}
+		// T1 is the whole cache, so its oldest block goes without a trace
+		entry_t *e = idle_tail(s, T1);
+		if (e == 0) {
+			return -1;
+		}
+		drop(s, e);
+		return 0;
+	}
+	if (total >= c) {
+		if (total >= 2 * c) {
+			drop(s, &s->entries[s->lists[B2].tail]);
+		}
+		if (s->spare_count == 0) {
+			return replace(s, 0);
+		}
+	}
+	return 0;
+}
+
+// Admit a block missing from the cache: give it an entry that is loading, on T2 if it
+// was evicted recently and on T1 otherwise.
+// returns the entry, or null if there is no room for it.
+static entry_t *admit(shard_t *s, int block, entry_t *ghost) {
+	if (ghost != 0) {
+		// a hit on a ghost list grows the share of the list that would have had it
+		int b1 = s->lists[B1].size;
+		int b2 = s->lists[B2].size;
+		if (ghost->list == B1) {
+			int step = b2 / b1 > 1 ? b2 / b1 : 1;
+			s->target = s->target + step < s->capacity ? s->target + step : s->capacity;
+		} else {
+			int step = b1 / b2 > 1 ? b1 / b2 : 1;
+			s->target = s->target - step > 0 ? s->target - step : 0;
+		}
+		if (s->spare_count == 0 && replace(s, ghost->list == B2) != 0) {
+			return 0;
+		}
+		ghost->data = s->spare[--s->spare_count];
+		ghost->state = LOADING;
+		list_move(s, ghost, T2);
+		return ghost;
+	}
+	if (make_room(s) != 0 || s->spare_count == 0 || s->lists[FREE].size == 0) {
+		return 0;
+	}
+	entry_t *e = &s->entries[s->lists[FREE].tail];
+	e->block = block;
+	e->state = LOADING;
+	e->data = s->spare[--s->spare_count];
+	int32_t *bucket = &s->buckets[block / CACHE_SHARDS & s->bucket_mask];
+	e->chain = *bucket;
+	*bucket = e - s->entries;
+	list_move(s, e, T1);
+	return e;
+}
+
+// Set up the cache for the next image loaded.
+void cache_init(int direct) {
+	int mb = cache_mb >= 0 ? cache_mb : direct ? DEFAULT_DIRECT_MB : 0;
+	int64_t blocks = (int64_t) mb * 1024 * 1024 / BLOCK_SIZE;
+	if (blocks < CACHE_SHARDS) {
+		return;
+	}
+	shards = calloc(CACHE_SHARDS, sizeof(shard_t));
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		shard_t *s = &shards[i];
+		int c = blocks / CACHE_SHARDS;
+		// ARC knows at most twice as many blocks as it caches
+		int n = 2 * c + 1;
+		pthread_mutex_init(&s->lock, 0);
+		s->capacity = c;
+		s->entries = calloc(n, sizeof(entry_t));
+		int buckets = 1;
+		while (buckets < n) {
+			buckets *= 2;
+		}
+		s->buckets = malloc(buckets * sizeof(int32_t));
+		memset(s->buckets, -1, buckets * sizeof(int32_t));
+		s->bucket_mask = buckets - 1;
+		for (int l = 0; l < LISTS; l++) {
+			s->lists[l] = (list_t) { -1, -1, 0 };
+		}
+		for (int e = 0; e < n; e++) {
+			s->entries[e].prev = s->entries[e].next = s->entries[e].chain = -1;
+			list_push(s, &s->entries[e], FREE);
+		}
+		s->slab = malloc((size_t) c * BLOCK_SIZE);
+		s->spare = malloc(c * sizeof(char *));
+		for (int b = 0; b < c; b++) {
+			s->spare[b] = s->slab + (size_t) b * BLOCK_SIZE;
+		}
+		s->spare_count = c;
+	}
+}
+
+// Tear down the cache.
+void cache_free() {
+	if (shards == 0) {
+		return;
+	}
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		pthread_mutex_destroy(&shards[i].lock);
+		free(shards[i].entries);
+		free(shards[i].buckets);
+		free(shards[i].spare);
+		free(shards[i].slab);
+	}
+	free(shards);
+	shards = 0;
+}
+
+// Check whether there is a cache.
+int cache_enabled() {
+	return shards != 0;
+}
+
+// Copy the part of the given block that the piece of I/O covers between data, which holds
+// the block, and the piece's buffer, in the direction given.
+static void copy_part(data_io_t *io, int block, char *data, int to_block) {
+	int64_t start = (int64_t) block * BLOCK_SIZE;
+	int64_t from = io->pos > start ? io->pos : start;
+	int64_t end = io->pos + (int64_t) io->size < start + BLOCK_SIZE ? io->pos + (int64_t) io->size : start + BLOCK_SIZE;
+	if (to_block) {
+		memcpy(data + (from - start), io->buf + (from - io->pos), end - from);
+	} else {
+		memcpy(io->buf + (from - io->pos), data + (from - start), end - from);
+	}
+}
+
+// Check whether every one of count blocks starting at block is cached.
+static int holds(int block, int count) {
+	for (int b = block; b < block + count; b++) {
+		shard_t *s = shard_of(b);
+		pthread_mutex_lock(&s->lock);
+		entry_t *e = find(s, b);
+		int held = e != 0 && (e->list == T1 || e->list == T2) && e->state == READY;
+		pthread_mutex_unlock(&s->lock);
+		if (!held) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Drop a run of blocks just cached from the page cache. Dirty blocks stay, since dropping
+// them would write them back long before they expire.
+static void drop_cached(int block, int count) {
+	int run = -1;
+	for (int b = block; b <= block + count; b++) {
+		if (b < block + count && writeback_clean(b, 1)) {
+			if (run < 0) {
+				run = b;
+			}
+			continue;
+		}
+		if (run >= 0) {
+			backend_drop((int64_t) run * BLOCK_SIZE, (size_t) (b - run) * BLOCK_SIZE);
+			run = -1;
+		}
+	}
+	// the page cache may hold data in folios larger than a block, which only go once a
+	// drop covers them whole, so a run finishing a chunk drops all of it, as long as the
+	// cache has every block of it and none is dirty
+	for (int c = block / DROP_CHUNK; c < (block + count) / DROP_CHUNK; c++) {
+		if (holds(c * DROP_CHUNK, DROP_CHUNK) && writeback_clean(c * DROP_CHUNK, DROP_CHUNK)) {
+			backend_drop((int64_t) c * DROP_CHUNK * BLOCK_SIZE, (size_t) DROP_CHUNK * BLOCK_SIZE);
+		}
+	}
+}
+
+// Read each piece, copying the blocks cached and reading the rest from the engine, a run
+// of missing blocks at a time.
+// returns 0 on success, -1 on fail.
+int cache_read(data_io_t *ios, int count) {
+	int64_t hits = 0;
+	int64_t blocks = 0;
+	int max_misses = 0;
+	for (int i = 0; i < count; i++) {
+		max_misses += ios[i].size / BLOCK_SIZE + 2;
+	}
+	miss_t *misses = malloc(max_misses * sizeof(miss_t));
+	entry_t **loading = malloc(max_misses * sizeof(entry_t *)); // null where the block is read uncached
+	int miss_count = 0;
+	int loading_count = 0;
+	for (int i = 0; i < count; i++) {
+		data_io_t *io = &ios[i];
+		int first = io->pos / BLOCK_SIZE;
+		int last = (io->pos + io->size - 1) / BLOCK_SIZE;
+		for (int b = first; b <= last; b++) {
+			shard_t *s = shard_of(b);
+			pthread_mutex_lock(&s->lock);
+			entry_t *e = find(s, b);
+			blocks++;
+			if (e != 0 && (e->list == T1 || e->list == T2) && e->state == READY) {
+				hits++;
+				list_move(s, e, T2);
+				copy_part(io, b, e->data, 0);
+				pthread_mutex_unlock(&s->lock);
+				continue;
+			}
+			entry_t *load = 0;
+			if (e == 0 || e->list == B1 || e->list == B2) {
+				load = admit(s, b, e);
+			}
+			pthread_mutex_unlock(&s->lock);
+			// a missing block joins the run of the one before it, if that was missing too
+			miss_t *m = miss_count > 0 ? &misses[miss_count - 1] : 0;
+			if (m == 0 || m->block + m->count != b) {
+				m = &misses[miss_count++];
+				m->block = b;
+				m->count = 0;
+			}
+			m->count++;
+			loading[loading_count++] = load;
+		}
+	}
+	trace_count(STAT_BUFFER_HITS, hits);
+	trace_count(STAT_BUFFER_MISSES, blocks - hits);
+
+	int rv = 0;
+	if (miss_count > 0) {
+		size_t total = (size_t) loading_count * BLOCK_SIZE;
+		char *buf = 0;
+		rv = posix_memalign((void **) &buf, BLOCK_SIZE, total) == 0 ? 0 : -1;
+		data_io_t *reads = malloc(miss_count * sizeof(data_io_t));
+		for (int m = 0, at = 0; m < miss_count && rv == 0; at += misses[m].count, m++) {
+			misses[m].buf = buf + (size_t) at * BLOCK_SIZE;
+			reads[m] = (data_io_t) { (int64_t) misses[m].block * BLOCK_SIZE, misses[m].buf,
+				(size_t) misses[m].count * BLOCK_SIZE };
+		}
+		if (rv == 0) {
+			rv = backend_read(reads, miss_count);
+		}
+		free(reads);
+
+		// hand out the blocks read, and cache those still wanted; the page cache needn't
+		// keep the runs the cache now holds
+		int next = 0;
+		for (int m = 0; m < miss_count; m++) {
+			int run = -1; // where the blocks just cached start, if the last one was
+			for (int k = 0; k < misses[m].count; k++, next++) {
+				int b = misses[m].block + k;
+				char *data = rv == 0 ? misses[m].buf + (size_t) k * BLOCK_SIZE : 0;
+				for (int i = 0; i < count && data != 0; i++) {
+					int64_t start = (int64_t) b * BLOCK_SIZE;
+					if (ios[i].pos < start + BLOCK_SIZE && start < ios[i].pos + (int64_t) ios[i].size) {
+						copy_part(&ios[i], b, data, 0);
+					}
+				}
+				entry_t *e = loading[next];
+				int cached = 0;
+				if (e != 0) {
+					shard_t *s = shard_of(b);
+					pthread_mutex_lock(&s->lock);
+					if (data != 0 && e->state == LOADING) {
+						memcpy(e->data, data, BLOCK_SIZE);
+						e->state = READY;
+						cached = 1;
+					} else {
+						// written or forgotten while it was read, or not read at all
+						e->state = READY;
+						drop(s, e);
+					}
+					pthread_mutex_unlock(&s->lock);
+				}
+				if (cached && run < 0) {
+					run = b;
+				} else if (!cached && run >= 0) {
+					drop_cached(run, b - run);
+					run = -1;
+				}
+			}
+			if (run >= 0) {
+				drop_cached(run, misses[m].block + misses[m].count - run);
+			}
+		}
+		free(buf);
+	}
+	free(misses);
+	free(loading);
+	return rv;
+}
+
+// Note that count pieces of the image were just written.
+void cache_write(data_io_t *ios, int count) {
+	for (int i = 0; i < count; i++) {
+		data_io_t *io = &ios[i];
+		int first = io->pos / BLOCK_SIZE;
+		int last = (io->pos + io->size - 1) / BLOCK_SIZE;
+		for (int b = first; b <= last; b++) {
+			shard_t *s = shard_of(b);
+			pthread_mutex_lock(&s->lock);
+			entry_t *e = find(s, b);
+			if (e != 0 && (e->list == T1 || e->list == T2)) {
+				if (e->state == READY) {
+					copy_part(io, b, e->data, 1);
+				} else {
+					e->state = STALE;
+				}
+			}
+			pthread_mutex_unlock(&s->lock);
+		}
+	}
+}
+
+// Forget count blocks starting at block.
+void cache_forget(int block, int count) {
+	if (shards == 0) {
+		return;
+	}
+	for (int b = block; b < block + count; b++) {
+		shard_t *s = shard_of(b);
+		pthread_mutex_lock(&s->lock);
+		entry_t *e = find(s, b);
+		if (e != 0 && e->state != READY) {
+			e->state = STALE;
+		} else if (e != 0) {
+			drop(s, e);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
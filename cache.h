@@ -0,0 +1,44 @@
+/* A cache in user space of file data blocks, in front of the I/O engine (see backend.h).
+ * Blocks are kept by ARC: those read once sit on one list and those read again on another,
+ * and the share of the cache each list gets adapts to which of them recently evicted
+ * blocks would have been hits on. A single pass over a large file only ever churns the
+ * first list, so the blocks read again and again stay cached.
+ *
+ * File data read through the cache is dropped from the page cache once it is loaded, so
+ * streaming through large files doesn't crowd the metadata in the private mapping out of
+ * the page cache. Only blocks the cache holds are dropped, and never dirty ones, which
+ * are left for writeback. Data written still passes through the page cache until it is
+ * written back; metadata isn't pinned or given any priority there. With the cache, FUSE
+ * no longer splices file data to and from the image itself. */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "backend.h"
+
+// The most memory the cache may use for data, in MB, as set with -o cache_size. The
+// default of -1 gives 64MB when the engine bypasses the page cache, and no cache otherwise,
+// so FUSE can keep splicing file data to and from the page cache.
+extern int cache_mb;
+
+// Set up the cache for the next image loaded, with direct set if the engine bypasses the
+// page cache.
+void cache_init(int direct);
+
+// Tear down the cache.
+void cache_free();
+
+// Check whether there is a cache.
+int cache_enabled();
+
+// Read each of count pieces of the image into its buffer, from the cache where it can and
+// from the engine otherwise. Returns 0 on success, -1 on fail.
+int cache_read(data_io_t *ios, int count);
+
+// Note that count pieces of the image were just written, updating the copies cached.
+void cache_write(data_io_t *ios, int count);
+
+// Forget count blocks starting at block, which were freed or changed some other way.
+void cache_forget(int block, int count);
+
+#endif
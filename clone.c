@@ -0,0 +1,74 @@
+/* Clones a file on a mounted nufs volume, so the copy shares the original's blocks
+ * until either of them is changed. */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "ioctl.h"
+#include "volume.h"
+
+static void usage() {
+	fprintf(stderr, "usage: clone.nufs [-r src_offset:length:dest_offset] source dest\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	nufs_clone_range_t range;
+	memset(&range, 0, sizeof(range));
+	int whole = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:")) != -1) {
+		switch (opt) {
+			case 'r':
+				if (sscanf(optarg, "%" SCNd64 ":%" SCNd64 ":%" SCNd64,
+						&range.src_offset, &range.src_length, &range.dest_offset) != 3) {
+					usage();
+				}
+				whole = 0;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 2) {
+		usage();
+	}
+	const char *source = argv[optind];
+	const char *dest = argv[optind + 1];
+
+	// without a range, the destination becomes a copy of the whole source
+	int fd = open(dest, O_WRONLY | O_CREAT | (whole ? O_TRUNC : 0), 0644);
+	if (fd < 0) {
+		perror(dest);
+		return 1;
+	}
+	char src_real[PATH_MAX];
+	char dest_real[PATH_MAX];
+	char root[PATH_MAX];
+	if (realpath(source, src_real) == 0 || realpath(dest, dest_real) == 0) {
+		perror(source);
+		return 1;
+	}
+	size_t len = 0;
+	if (find_root(dest_real, root) == 0) {
+		len = strlen(root);
+	}
+	if (len == 0 || strncmp(src_real, root, len) != 0 || src_real[len] != '/') {
+		fprintf(stderr, "clone.nufs: %s and %s aren't on the same mounted volume\n", source, dest);
+		return 1;
+	}
+	snprintf(range.src_path, sizeof(range.src_path), "%s", src_real + len);
+	if (ioctl(fd, NUFS_IOC_CLONE_RANGE, &range) != 0) {
+		perror("clone.nufs");
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,361 @@
+/* Compressing files a cluster at a time.
+ * A compressed run's first block starts with a header giving the size of the compressed
+ * data after it and an id no other compressed run has had. The cache is direct mapped
+ * by the run's first block, and checks the id, so a run stored since in the same blocks
+ * is never mistaken for the one cached. Compressed blocks never change while mapped, so
+ * readers only need the lock of the cache slot they use. */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "backend.h"
+#include "blocks.h"
+#include "compress.h"
+#include "extent.h"
+#include "journal.h"
+#include "lz.h"
+#include "refcount.h"
+
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define CACHE_CLUSTERS 32 // decompressed clusters kept (2MB)
+
+// The start of a compressed run's first block.
+typedef struct cluster_header {
+	uint32_t size; // bytes of compressed data following the header
+	uint32_t _reserved;
+	uint64_t id;
+} cluster_header_t;
+
+// A decompressed cluster in the cache.
+typedef struct cluster {
+	pthread_mutex_t lock;
+	uint32_t pblock; // first block of the compressed run, or 0 if the slot is empty
+	uint64_t id;
+	char *data; // allocated when the slot is first used
+} cluster_t;
+
+int compress_all = 0;
+
+static cluster_t cache[CACHE_CLUSTERS] = {
+	[0 ... CACHE_CLUSTERS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+static uint64_t next_id = 0;
+
+// Check whether the data written to the given file is to be compressed.
+int compress_wanted(inode_t *node) {
+	return S_ISREG(node->mode) && (compress_all || (node->flags & INODE_COMPRESS));
+}
+
+// Return a new id for a compressed run. Ids start from the time, so they don't repeat
+// those of earlier mounts either.
+static uint64_t new_id() {
+	uint64_t zero = 0;
+	__atomic_compare_exchange_n(&next_id, &zero, (uint64_t) time(0) << 32, 0,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	return __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+}
+
+// Note that size bytes were written to the file at offset.
+void compress_note_write(inode_t *node, size_t size, off_t offset) {
+	if (size == 0 || (node->flags & INODE_INLINE) || !compress_wanted(node)) {
+		return;
+	}
+	uint32_t from = offset / CLUSTER_SIZE;
+	uint32_t to = (offset + size - 1) / CLUSTER_SIZE + 1;
+	if (node->compress_to > node->compress_from) {
+		from = node->compress_from < from ? node->compress_from : from;
+		to = node->compress_to > to ? node->compress_to : to;
+	}
+	if (from != node->compress_from || to != node->compress_to) {
+		journal_dirty(node, sizeof(inode_t));
+		node->compress_from = from;
+		node->compress_to = to;
+	}
+}
+
+// Decompress the given compressed run into data, which has room for a cluster.
+// returns 0 on success, -1 if the compressed data can't be read or is corrupt.
+static int decompress_run(extent_t *ext, char *data) {
+	int size = ext->len * BLOCK_SIZE;
+	size_t stored = (size_t) ext->packed * BLOCK_SIZE;
+	cluster_header_t *hdr = malloc(stored);
+	data_io_t io = { (int64_t) ext->pblock * BLOCK_SIZE, hdr, stored };
+	int rv = -1;
+	if (size <= CLUSTER_SIZE && data_read(&io, 1) == 0
+			&& hdr->size <= stored - sizeof(cluster_header_t)) {
+		rv = lz_decompress(hdr + 1, hdr->size, data, size) == size ? 0 : -1;
+	}
+	free(hdr);
+	return rv;
+}
+
+// Copy up to size bytes of the file starting at offset, which is in a compressed run, into buf.
+// returns the number of bytes copied, or -1 if the compressed data is corrupt.
+ssize_t compress_read(inode_t *node, char *buf, size_t size, off_t offset) {
+	extent_t ext;
+	if (extent_find(node, offset / BLOCK_SIZE, &ext) != 0 || !ext.packed) {
+		return -1;
+	}
+	int64_t start = (int64_t) ext.lblock * BLOCK_SIZE;
+	int64_t left = start + (int64_t) ext.len * BLOCK_SIZE - offset;
+	size = (int64_t) size < left ? size : left;
+	cluster_t *cluster = &cache[ext.pblock % CACHE_CLUSTERS];
+	cluster_header_t hdr;
+	data_io_t io = { (int64_t) ext.pblock * BLOCK_SIZE, &hdr, sizeof(hdr) };
+	if (data_read(&io, 1) != 0) {
+		return -1;
+	}
+	pthread_mutex_lock(&cluster->lock);
+	if (cluster->pblock != ext.pblock || cluster->id != hdr.id) {
+		cluster->pblock = 0;
+		if (cluster->data == 0) {
+			cluster->data = malloc(CLUSTER_SIZE);
+		}
+		if (decompress_run(&ext, cluster->data) != 0) {
+			pthread_mutex_unlock(&cluster->lock);
+			return -1;
+		}
+		cluster->pblock = ext.pblock;
+		cluster->id = hdr.id;
+	}
+	memcpy(buf, cluster->data + (offset - start), size);
+	pthread_mutex_unlock(&cluster->lock);
+	return size;
+}
+
+// Free the runs of blocks allocated so far for a cluster.
+static void free_runs(int (*runs)[2], int count) {
+	for (int i = 0; i < count; i++) {
+		free_blocks(runs[i][0], runs[i][1]);
+	}
+}
+
+// Hold an extra reference to each run, so their blocks outlive being unmapped until the
+// runs replacing them are mapped, as inode_unshare does for shared blocks.
+// returns 0 on success, -1 if the disk is full.
+static int hold_runs(int (*runs)[2], int count) {
+	for (int i = 0; i < count; i++) {
+		if (refcount_reserve(runs[i][0], runs[i][1]) != 0) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		refcount_share(runs[i][0], runs[i][1]);
+	}
+	return 0;
+}
+
+// Store the compressed run ext raw again.
+// returns 0 on success, -1 if the disk is full or the compressed data is corrupt.
+static int unpack_run(inode_t *node, extent_t *ext) {
+	char *data = malloc(CLUSTER_SIZE);
+	if (decompress_run(ext, data) != 0) {
+		free(data);
+		return -1;
+	}
+	int runs[CLUSTER_BLOCKS][2];
+	int count = 0;
+	for (int done = 0; done < ext->len; ) {
+		int got;
+		int run = alloc_blocks(ext->pblock + ext->packed, ext->len - done, &got);
+		if (run < 0) {
+			free_runs(runs, count);
+			free(data);
+			return -1;
+		}
+		runs[count][0] = run;
+		runs[count][1] = got;
+		count++;
+		data_io_t io = { (int64_t) run * BLOCK_SIZE, data + (size_t) done * BLOCK_SIZE, (size_t) got * BLOCK_SIZE };
+		// durable before the journal commits the remapping, since the data already was
+		if (data_write(&io, 1) != 0 || data_sync(run, got) != 0) {
+			free_runs(runs, count);
+			free(data);
+			return -1;
+		}
+		done += got;
+	}
+	free(data);
+
+	int packed[1][2] = { { ext->pblock, ext->packed } };
+	if (hold_runs(packed, 1) != 0) {
+		free_runs(runs, count);
+		return -1;
+	}
+	// a whole compressed run is unmapped in one piece, which can't fail
+	extent_remove(node, ext->lblock, ext->len);
+	int lblock = ext->lblock;
+	for (int i = 0; i < count; i++) {
+		if (extent_insert(node, lblock, runs[i][0], runs[i][1]) != 0) {
+			// map the compressed run back in place of the raw blocks mapped so far
+			extent_remove(node, ext->lblock, lblock - ext->lblock);
+			if (extent_insert_packed(node, ext->lblock, ext->pblock, ext->len, ext->packed) != 0) {
+				free_blocks(ext->pblock, ext->packed);
+			}
+			free_runs(runs + i, count - i);
+			return -1;
+		}
+		lblock += runs[i][1];
+	}
+	free_blocks(ext->pblock, ext->packed);
+	return 0;
+}
+
+// Store every compressed run overlapping count blocks starting at lblock raw again.
+// returns 0 on success, -1 if the disk is full or the compressed data is corrupt.
+int compress_unpack(inode_t *node, int lblock, int count) {
+	if (node->flags & INODE_INLINE) {
+		return 0;
+	}
+	int64_t end = (int64_t) lblock + count;
+	while (lblock < end) {
+		int mapped;
+		if (extent_lookup(node, lblock, &mapped) != EXTENT_PACKED) {
+			lblock += mapped < end - lblock ? mapped : end - lblock;
+			continue;
+		}
+		extent_t ext;
+		extent_find(node, lblock, &ext);
+		if (unpack_run(node, &ext) != 0) {
+			return -1;
+		}
+		lblock = ext.lblock + ext.len;
+	}
+	return 0;
+}
+
+// Store the compressed run holding both lblock - 1 and lblock raw again, if there is one.
+// returns 0 on success, -1 if the disk is full or the compressed data is corrupt.
+int compress_split(inode_t *node, int lblock) {
+	extent_t ext;
+	if (lblock <= 0 || (node->flags & INODE_INLINE) || extent_find(node, lblock - 1, &ext) != 0
+			|| !ext.packed || (int64_t) ext.lblock + ext.len <= lblock) {
+		return 0;
+	}
+	return unpack_run(node, &ext);
+}
+
+// Compress the len blocks of the cluster starting at lblock into a compressed run, if
+// they are all mapped raw, aren't shared with a clone, and compress into fewer blocks.
+// data and out are buffers of a cluster each.
+// returns 0 on success (whether or not the cluster was compressed), -1 if the disk is full.
+static int pack_cluster(inode_t *node, int lblock, int len, char *data, char *out) {
+	int runs[CLUSTER_BLOCKS][2];
+	int count = 0;
+	for (int done = 0; done < len; ) {
+		int mapped;
+		int pblock = extent_lookup(node, lblock + done, &mapped);
+		if (pblock < 0) {
+			// a hole, or already compressed
+			return 0;
+		}
+		mapped = mapped < len - done ? mapped : len - done;
+		if (refcount_run(pblock, mapped, 0) < mapped) {
+			// compressing a shared block would take a copy of it
+			return 0;
+		}
+		runs[count][0] = pblock;
+		runs[count][1] = mapped;
+		count++;
+		done += mapped;
+	}
+	data_io_t ios[CLUSTER_BLOCKS];
+	for (int i = 0, done = 0; i < count; done += runs[i][1], i++) {
+		ios[i] = (data_io_t) { (int64_t) runs[i][0] * BLOCK_SIZE, data + (size_t) done * BLOCK_SIZE,
+			(size_t) runs[i][1] * BLOCK_SIZE };
+	}
+	if (data_read(ios, count) != 0) {
+		// left as it is, as though it didn't compress
+		return 0;
+	}
+	cluster_header_t *hdr = (cluster_header_t *) out;
+	int room = (len - 1) * BLOCK_SIZE - (int) sizeof(cluster_header_t);
+	int size = lz_compress(data, len * BLOCK_SIZE, hdr + 1, room);
+	if (size < 0) {
+		// it wouldn't save a block, so it stays raw
+		return 0;
+	}
+	hdr->size = size;
+	hdr->_reserved = 0;
+	hdr->id = new_id();
+	int packed = bytes_to_blocks(sizeof(cluster_header_t) + size);
+	memset(out + sizeof(cluster_header_t) + size, 0, (size_t) packed * BLOCK_SIZE - sizeof(cluster_header_t) - size);
+
+	int got;
+	int run = alloc_blocks(runs[0][0], packed, &got);
+	if (run < 0) {
+		return -1;
+	}
+	if (got < packed) {
+		// too fragmented here to be worth it
+		free_blocks(run, got);
+		return 0;
+	}
+	data_io_t io = { (int64_t) run * BLOCK_SIZE, out, (size_t) packed * BLOCK_SIZE };
+	// the journal doesn't order data before its commits, so the compressed run has to be
+	// durable before the cluster is remapped to it, or a crash could lose data already safe
+	if (data_write(&io, 1) != 0 || data_sync(run, packed) != 0) {
+		free_blocks(run, packed);
+		return 0;
+	}
+	if (hold_runs(runs, count) != 0) {
+		free_blocks(run, packed);
+		return -1;
+	}
+	if (extent_remove(node, lblock, len) != 0
+			|| extent_insert_packed(node, lblock, run, len, packed) != 0) {
+		// map the raw blocks back, which keeps them if that works
+		extent_remove(node, lblock, len);
+		for (int i = 0, at = lblock; i < count; at += runs[i][1], i++) {
+			if (extent_insert(node, at, runs[i][0], runs[i][1]) != 0) {
+				free_blocks(runs[i][0], runs[i][1]);
+			}
+		}
+		free_blocks(run, packed);
+		return -1;
+	}
+	free_runs(runs, count);
+	return 0;
+}
+
+// Compress the clusters of the file written since it was last compressed.
+// returns 0 on success, -1 if the disk is full.
+int compress_file(inode_t *node) {
+	if (node->compress_to <= node->compress_from) {
+		return 0;
+	}
+	int rv = 0;
+	if (!(node->flags & INODE_INLINE) && compress_wanted(node)) {
+		int blocks = bytes_to_blocks(node->size);
+		char *data = malloc(CLUSTER_SIZE);
+		char *out = malloc(CLUSTER_SIZE);
+		for (int64_t c = node->compress_from; c < node->compress_to && rv == 0; c++) {
+			int64_t lblock = c * CLUSTER_BLOCKS;
+			int len = blocks - lblock < CLUSTER_BLOCKS ? blocks - lblock : CLUSTER_BLOCKS;
+			if (len < 2) {
+				// a single block can't be stored in fewer
+				break;
+			}
+			extent_t ext;
+			if (extent_find(node, lblock, &ext) == 0 && ext.packed && ext.lblock == lblock
+					&& ext.len == len) {
+				continue;
+			}
+			// a run compressed before the cluster was full is compressed again along with the rest
+			rv = compress_unpack(node, lblock, len);
+			if (rv == 0) {
+				rv = pack_cluster(node, lblock, len, data, out);
+			}
+		}
+		free(data);
+		free(out);
+	}
+	journal_dirty(node, sizeof(inode_t));
+	node->compress_from = 0;
+	node->compress_to = 0;
+	return rv;
+}
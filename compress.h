@@ -0,0 +1,50 @@
+/* Transparent compression of file data.
+ * Files marked with INODE_COMPRESS (chattr +c), or every file on a volume mounted with
+ * -o compress, are compressed a cluster of CLUSTER_BLOCKS blocks at a time once they are
+ * closed after being written. A cluster whose data compresses into fewer blocks is stored
+ * in those blocks and mapped as a single compressed run of the extent tree (see extent.h);
+ * one that doesn't save a block is left raw. Only the clusters written since the file was
+ * last compressed are looked at, as its inode records.
+ *
+ * Reading a compressed run decompresses it into a small cache, so reading it a piece at a
+ * time decompresses it once. Anything changing part of a compressed run stores it raw
+ * again first, and it is compressed again when the file is next closed. */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+
+#include "inode.h"
+
+#define CLUSTER_BLOCKS 16 // blocks compressed together (64KB)
+
+// Whether every file written is compressed, not just those marked, as with -o compress.
+extern int compress_all;
+
+// Check whether the data written to the given file is to be compressed.
+int compress_wanted(inode_t *node);
+
+// Note that size bytes were written to the file at offset, so their clusters are
+// compressed once it is closed.
+void compress_note_write(inode_t *node, size_t size, off_t offset);
+
+// Compress the clusters of the file written since it was last compressed, where that
+// saves blocks. Returns 0 on success, -1 if the disk is full.
+int compress_file(inode_t *node);
+
+// Copy up to size bytes of the file starting at offset, which is in a compressed run, into
+// buf. Returns the number of bytes copied, which stops at the end of the run, or -1 if the
+// compressed data is corrupt.
+ssize_t compress_read(inode_t *node, char *buf, size_t size, off_t offset);
+
+// Store every compressed run overlapping count blocks starting at lblock raw again, so
+// its blocks can be changed. Returns 0 on success, -1 if the disk is full or the
+// compressed data is corrupt.
+int compress_unpack(inode_t *node, int lblock, int count);
+
+// Store the compressed run holding both lblock - 1 and lblock raw again, if there is one,
+// so a range starting or ending at lblock can be unmapped. Returns as compress_unpack does.
+int compress_split(inode_t *node, int lblock);
+
+#endif
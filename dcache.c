@@ -0,0 +1,125 @@
+/* A set-associative cache of directory entries.
+ * Entries live in a fixed table, so lookups and inserts never allocate.
+ * Sets are guarded by striped locks, so lookups in different sets don't contend. */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "directory.h"
+#include "trace.h"
+
+#define DCACHE_SETS 4096 // must be a power of two
+#define DCACHE_WAYS 4
+#define DCACHE_LOCKS 64 // must be a power of two, at most DCACHE_SETS
+
+typedef struct dentry {
+	uint32_t hash;
+	int parent; // -1 when the slot is empty
+	int inum;   // -1 for a negative entry
+	uint8_t len;
+	char name[DIR_NAME_LENGTH];
+} dentry_t;
+
+typedef struct dset {
+	dentry_t ways[DCACHE_WAYS];
+	int next; // the way to replace next
+} dset_t;
+
+static dset_t dcache[DCACHE_SETS];
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS] = { [0 ... DCACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+// Hash a name of the given length (32-bit FNV-1a).
+uint32_t name_hash(const char *name, int len) {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < len; i++) {
+		hash ^= (uint8_t) name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Return the set a key belongs to.
+static dset_t *set_of(int parent, uint32_t hash) {
+	uint32_t mix = hash ^ ((uint32_t) parent * 2654435761u);
+	return &dcache[mix & (DCACHE_SETS - 1)];
+}
+
+// Return the lock guarding the given set.
+static pthread_mutex_t *lock_of(dset_t *set) {
+	return &dcache_locks[(set - dcache) & (DCACHE_LOCKS - 1)];
+}
+
+// Return the entry in the set matching the key, or null if there is none.
+static dentry_t *find(dset_t *set, int parent, uint32_t hash, const char *name, int len) {
+	for (int i = 0; i < DCACHE_WAYS; i++) {
+		dentry_t *entry = &set->ways[i];
+		if (entry->parent == parent && entry->hash == hash && entry->len == len
+				&& memcmp(entry->name, name, len) == 0) {
+			return entry;
+		}
+	}
+	return 0;
+}
+
+// Look up a name under a directory.
+// returns 1 on a hit, 0 if nothing is cached.
+int dcache_lookup(int parent, const char *name, int len, int *inum) {
+	uint32_t hash = name_hash(name, len);
+	dset_t *set = set_of(parent, hash);
+	pthread_mutex_lock(lock_of(set));
+	dentry_t *entry = find(set, parent, hash, name, len);
+	if (entry != 0) {
+		*inum = entry->inum;
+	}
+	pthread_mutex_unlock(lock_of(set));
+	trace_count(entry != 0 ? STAT_DCACHE_HITS : STAT_DCACHE_MISSES, 1);
+	return entry != 0;
+}
+
+// Remember what a name resolves to under a directory.
+void dcache_insert(int parent, const char *name, int len, int inum) {
+	if (len >= DIR_NAME_LENGTH) {
+		return;
+	}
+	uint32_t hash = name_hash(name, len);
+	dset_t *set = set_of(parent, hash);
+	pthread_mutex_lock(lock_of(set));
+	dentry_t *entry = find(set, parent, hash, name, len);
+	if (entry == 0) {
+		// replace the ways of a set round robin
+		entry = &set->ways[set->next];
+		set->next = (set->next + 1) % DCACHE_WAYS;
+		entry->parent = parent;
+		entry->hash = hash;
+		entry->len = len;
+		memcpy(entry->name, name, len);
+	}
+	entry->inum = inum;
+	pthread_mutex_unlock(lock_of(set));
+}
+
+// Forget every entry under a directory.
+void dcache_purge_dir(int parent) {
+	for (int i = 0; i < DCACHE_SETS; i++) {
+		pthread_mutex_lock(lock_of(&dcache[i]));
+		for (int j = 0; j < DCACHE_WAYS; j++) {
+			if (dcache[i].ways[j].parent == parent) {
+				dcache[i].ways[j].parent = -1;
+			}
+		}
+		pthread_mutex_unlock(lock_of(&dcache[i]));
+	}
+}
+
+// Forget every entry.
+void dcache_clear() {
+	for (int i = 0; i < DCACHE_SETS; i++) {
+		pthread_mutex_lock(lock_of(&dcache[i]));
+		for (int j = 0; j < DCACHE_WAYS; j++) {
+			dcache[i].ways[j].parent = -1;
+		}
+		dcache[i].next = 0;
+		pthread_mutex_unlock(lock_of(&dcache[i]));
+	}
+}
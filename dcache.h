@@ -0,0 +1,24 @@
+/* A cache of directory entries, keyed by parent directory and name. */
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+
+// Hash a name of the given length.
+uint32_t name_hash(const char *name, int len);
+
+// Look up a name of the given length under the directory with inode index parent.
+// Returns 1 and sets inum on a hit (-1 for a cached miss), or 0 if nothing is cached.
+int dcache_lookup(int parent, const char *name, int len, int *inum);
+
+// Remember that name resolves to inum under parent, or that it doesn't exist if inum is -1.
+void dcache_insert(int parent, const char *name, int len, int inum);
+
+// Forget every entry under the directory with inode index parent.
+void dcache_purge_dir(int parent);
+
+// Forget every entry.
+void dcache_clear();
+
+#endif
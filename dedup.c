@@ -0,0 +1,307 @@
+/* Finds blocks holding the same data in the files on a mounted nufs volume, and makes the
+ * files share one copy of each, as if cloned from each other.
+ * Every block is hashed, and a block whose hash was seen before is handed to the
+ * filesystem with NUFS_IOC_DEDUPE_RANGE along with the block seen first, which only
+ * shares them if their data really is the same. Runs of blocks duplicating a run of
+ * blocks seen before are handed over together. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ioctl.h"
+#include "volume.h"
+
+#define BLOCK 4096     // the volume's block size
+#define RUN_MAX 256    // blocks deduplicated at once (1MB)
+#define READ_BLOCKS 256 // blocks read at once
+
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+
+// A block seen first, by its hash.
+typedef struct entry {
+	uint64_t hash;
+	int file; // index into files plus one, or 0 if the slot is empty
+	uint32_t block;
+} entry_t;
+
+// A file scanned: its path from the root of the volume, and its inode.
+typedef struct file {
+	char *path;
+	ino_t ino;
+} file_t;
+
+// Blocks duplicating blocks seen first, waiting to be deduplicated together.
+typedef struct run {
+	int src_file; // index into files, or -1 if the run is empty
+	uint32_t src_block;
+	uint32_t dst_block;
+	int len;
+} run_t;
+
+static file_t *files = 0;
+static int file_count = 0;
+static entry_t *table = 0;
+static size_t table_size = 0; // a power of two
+static size_t table_used = 0;
+static char root[PATH_MAX];
+static size_t root_len = 0;
+static int dry_run = 0;
+static int verbose = 0;
+
+static int64_t scanned = 0;    // blocks hashed
+static int64_t duplicates = 0; // blocks found to have the same hash as one before
+static int64_t deduped = 0;    // bytes of the blocks freed
+
+// Return x rotated left by r bits.
+static uint64_t rotl(uint64_t x, int r) {
+	return x << r | x >> (64 - r);
+}
+
+// Mix eight bytes into one lane of the hash.
+static uint64_t mix(uint64_t acc, uint64_t input) {
+	return rotl(acc + input * PRIME2, 31) * PRIME1;
+}
+
+// Hash a block with XXH64. Its four lanes are independent until the end, so the loop over
+// them runs as fast as the compiler can vectorize it; len must be a multiple of 32.
+static uint64_t hash_block(const uint8_t *data, size_t len) {
+	uint64_t lanes[4] = { PRIME1 + PRIME2, PRIME2, 0, -PRIME1 };
+	for (size_t i = 0; i < len; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			uint64_t word;
+			memcpy(&word, data + i + 8 * l, sizeof(word));
+			lanes[l] = mix(lanes[l], word);
+		}
+	}
+	uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+	for (int l = 0; l < 4; l++) {
+		h = (h ^ mix(0, lanes[l])) * PRIME1 + PRIME4;
+	}
+	h += len;
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+// Check whether a block is all zeros; those are left alone, as a hole would save more.
+static int is_zero(const uint8_t *data) {
+	for (int i = 0; i < BLOCK; i++) {
+		if (data[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Return the slot of the table for the given hash: the block seen first with it, or an
+// empty slot to put it in.
+static entry_t *find_slot(uint64_t hash) {
+	size_t i = hash & (table_size - 1);
+	while (table[i].file != 0 && table[i].hash != hash) {
+		i = (i + 1) & (table_size - 1);
+	}
+	return &table[i];
+}
+
+// Make room in the table for another block, keeping it at most half full.
+static void grow_table() {
+	if (table_used * 2 < table_size) {
+		return;
+	}
+	entry_t *old = table;
+	size_t old_size = table_size;
+	table_size = old_size == 0 ? 1 << 16 : old_size * 2;
+	table = calloc(table_size, sizeof(entry_t));
+	if (table == 0) {
+		perror("dedup.nufs");
+		exit(1);
+	}
+	for (size_t i = 0; i < old_size; i++) {
+		if (old[i].file != 0) {
+			*find_slot(old[i].hash) = old[i];
+		}
+	}
+	free(old);
+}
+
+// Deduplicate len blocks of the file open as fd starting at dst against those of the file
+// with the given index starting at src.
+// returns 1 if they were the same, 0 if not, -1 on fail.
+static int dedupe(int fd, int src_file, uint32_t src, uint32_t dst, int len) {
+	if (dry_run) {
+		return 1;
+	}
+	nufs_dedupe_range_t range;
+	memset(&range, 0, sizeof(range));
+	range.src_offset = (int64_t) src * BLOCK;
+	range.length = (int64_t) len * BLOCK;
+	range.dest_offset = (int64_t) dst * BLOCK;
+	snprintf(range.src_path, sizeof(range.src_path), "%s", files[src_file].path);
+	if (ioctl(fd, NUFS_IOC_DEDUPE_RANGE, &range) != 0) {
+		return -1;
+	}
+	deduped += range.bytes_deduped;
+	return range.status == NUFS_DEDUPE_SAME;
+}
+
+// Deduplicate a run of blocks of the file open as fd, and empty it.
+static void flush_run(int fd, const char *path, run_t *run) {
+	if (run->src_file < 0) {
+		return;
+	}
+	duplicates += run->len;
+	int rv = dedupe(fd, run->src_file, run->src_block, run->dst_block, run->len);
+	if (rv == 0 && run->len > 1) {
+		// a hash matched without the data matching, so the blocks go one at a time
+		for (int i = 0; i < run->len && rv >= 0; i++) {
+			rv = dedupe(fd, run->src_file, run->src_block + i, run->dst_block + i, 1);
+		}
+	}
+	if (rv < 0) {
+		fprintf(stderr, "dedup.nufs: %s: %s\n", path, strerror(errno));
+	} else if (verbose) {
+		printf("%s: %d blocks at %" PRIu32 " like %s at %" PRIu32 "\n", path, run->len,
+			run->dst_block, files[run->src_file].path, run->src_block);
+	}
+	run->src_file = -1;
+}
+
+// Hash the blocks of a file, deduplicating those seen before.
+static void scan_file(const char *path, const struct stat *st) {
+	if (strlen(path + root_len) >= NUFS_CLONE_PATH_MAX) {
+		fprintf(stderr, "dedup.nufs: %s: path too long\n", path);
+		return;
+	}
+	for (int i = 0; st->st_nlink > 1 && i < file_count; i++) {
+		if (files[i].ino == st->st_ino) {
+			// another link to a file already scanned
+			return;
+		}
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return;
+	}
+	if (file_count % 1024 == 0) {
+		files = realloc(files, (file_count + 1024) * sizeof(file_t));
+	}
+	int index = file_count++;
+	files[index].path = strdup(path + root_len);
+	files[index].ino = st->st_ino;
+
+	static uint8_t buf[READ_BLOCKS * BLOCK];
+	run_t run = { .src_file = -1 };
+	uint32_t block = 0;
+	ssize_t got;
+	while ((got = pread(fd, buf, sizeof(buf), (off_t) block * BLOCK)) >= BLOCK) {
+		// a partial block at the end of the file is left alone
+		for (int i = 0; i < got / BLOCK; i++, block++) {
+			uint8_t *data = buf + (size_t) i * BLOCK;
+			if (is_zero(data)) {
+				flush_run(fd, path, &run);
+				continue;
+			}
+			scanned++;
+			grow_table();
+			uint64_t hash = hash_block(data, BLOCK);
+			entry_t *seen = find_slot(hash);
+			if (seen->file == 0) {
+				seen->hash = hash;
+				seen->file = index + 1;
+				seen->block = block;
+				table_used++;
+				flush_run(fd, path, &run);
+				continue;
+			}
+			int src_file = seen->file - 1;
+			// the run grows while both sides go on in step, and stay apart within one file
+			if (run.src_file == src_file && seen->block == run.src_block + run.len
+					&& block == run.dst_block + run.len && run.len < RUN_MAX
+					&& (src_file != index || seen->block < run.dst_block)) {
+				run.len++;
+				continue;
+			}
+			flush_run(fd, path, &run);
+			run.src_file = src_file;
+			run.src_block = seen->block;
+			run.dst_block = block;
+			run.len = 1;
+		}
+	}
+	flush_run(fd, path, &run);
+	close(fd);
+}
+
+// Scan each regular file found on the walk.
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	if (type == FTW_F && S_ISREG(st->st_mode)) {
+		scan_file(path, st);
+	}
+	return 0;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: dedup.nufs [-n] [-v] path...\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "nv")) != -1) {
+		switch (opt) {
+			case 'n':
+				dry_run = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind == argc) {
+		usage();
+	}
+	for (int i = optind; i < argc; i++) {
+		char real[PATH_MAX];
+		if (realpath(argv[i], real) == 0) {
+			perror(argv[i]);
+			return 1;
+		}
+		if (root_len == 0) {
+			if (find_root(real, root) != 0) {
+				fprintf(stderr, "dedup.nufs: %s isn't on a mounted volume\n", argv[i]);
+				return 1;
+			}
+			root_len = strlen(root);
+		}
+		if (strncmp(real, root, root_len) != 0 || (real[root_len] != '/' && real[root_len] != 0)) {
+			fprintf(stderr, "dedup.nufs: %s isn't on the same mounted volume as %s\n", argv[i], root);
+			return 1;
+		}
+		// the walk stays on the volume, as the ioctls only reach files on it
+		nftw(real, visit, 64, FTW_PHYS | FTW_MOUNT);
+	}
+	printf("%d files, %" PRId64 " blocks scanned, %" PRId64 " duplicate blocks, %s%" PRId64
+		" bytes saved\n", file_count, scanned, duplicates, dry_run ? "up to " : "",
+		dry_run ? duplicates * BLOCK : deduped);
+	return 0;
+}
@@ -1,4 +1,7 @@
-/* Directory manipulation functions. */
+/* Directory manipulation functions.
+ * A small directory keeps its first few entries in its inode, then a single block of
+ * entries, either of which is scanned linearly. Once the block fills up, block 0 becomes the root of an index (up to two levels deep) that maps
+ * name hashes to leaf blocks of entries, so lookups only ever scan one leaf. */
 
 #include "directory.h"
 #include "bitmap.h"
@@ -6,27 +9,352 @@
 
 #include <string.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
-// Initialize root directory.
+#include "dcache.h"
+#include "icache.h"
+#include "journal.h"
+
+// Initialize root directory, unless the image already has one.
 void directory_init() {
+	dcache_clear();
+	// root dir corresponds to inode 0
+	if (bitmap_get(get_inode_bitmap(), 0)) {
+		return;
+	}
 	// allocate a root inode
-	int root = alloc_inode();
+	journal_begin();
+	int root = alloc_inode(-1, 040775);
+	assert(root == 0);
 	printf("root: %d\n", root);
 	inode_t *node = get_inode(root);
+	journal_dirty(node, sizeof(inode_t));
 	node->refs = 1;
 	node->mode = 040775; // directory mode
 	node->size = 0;
-	node->block_list = alloc_blist();
+	journal_end();
 	print_inode(node);
 }
 
 // Return the relative path name from the given absolute path.
 const char* get_filename(const char *path) {
-	slist_t* split_path = s_split(path, '/');
-	while (split_path->next) {
-		split_path = split_path->next;
+	const char *slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+#define ENTRIES_PER_BLOCK ((int) (BLOCK_SIZE / sizeof(direntry_t)))
+#define DX_LIMIT ((int) ((BLOCK_SIZE - sizeof(dx_header_t)) / sizeof(dx_entry_t)))
+#define dx_entries(hdr) ((dx_entry_t *) ((dx_header_t *) (hdr) + 1))
+#define COOKIE_MINOR_BITS 16 // readdir offsets count entries sharing a hash in this many bits
+
+// The index nodes followed from the root of an indexed directory down to a leaf.
+typedef struct dx_path {
+	dx_header_t *node[2];
+	int idx[2];
+	int levels;
+	int leaf; // logical block of the leaf
+} dx_path_t;
+
+// Return a pointer to the given logical block of a directory, or null if it has none.
+// The entries of a directory stored inline act as its block 0.
+static void *dir_block(inode_t *dir, int lblock) {
+	if (dir->flags & INODE_INLINE) {
+		return lblock == 0 ? dir->data : 0;
+	}
+	int block = inode_get_block(dir, lblock, 0);
+	return block < 0 ? 0 : get_block_at(block);
+}
+
+// Add a zeroed block to the end of a directory.
+// returns its logical block, or -1 on fail.
+static int add_dir_block(inode_t *dir) {
+	int lblock = bytes_to_blocks(dir->size);
+	if (inode_get_block(dir, lblock, 1) < 0) {
+		return -1;
+	}
+	journal_dirty(dir, sizeof(inode_t));
+	dir->size = (int64_t) (lblock + 1) * BLOCK_SIZE;
+	return lblock;
+}
+
+// Return the number of entry slots in each block of a directory.
+static int slots_of(inode_t *dir) {
+	return dir->flags & INODE_INLINE ? DIR_INLINE_ENTRIES : ENTRIES_PER_BLOCK;
+}
+
+// Return the slot of a block of count entries holding the name, or null if there is none.
+// Only indexed directories are guaranteed to have hashes stored in their entries.
+static direntry_t *block_find(direntry_t *contents, int count, const char *name, int len,
+		uint32_t hash, int use_hash) {
+	for (int i = 0; i < count; i++) {
+		if (contents[i].inum != 0 && (!use_hash || contents[i].hash == hash)
+				&& memcmp(contents[i].name, name, len) == 0 && contents[i].name[len] == 0) {
+			return &contents[i];
+		}
+	}
+	return 0;
+}
+
+// Return a free slot of a block of count entries, or null if it is full.
+static direntry_t *block_free_slot(direntry_t *contents, int count) {
+	for (int i = 0; i < count; i++) {
+		if (contents[i].inum == 0) {
+			return &contents[i];
+		}
+	}
+	return 0;
+}
+
+// Fill in a slot with the given name and inode index.
+static void fill_entry(direntry_t *entry, const char *name, int len, uint32_t hash, int inum) {
+	journal_dirty(entry, sizeof(direntry_t));
+	memset(entry->name, 0, sizeof(entry->name));
+	memcpy(entry->name, name, len);
+	entry->inum = inum;
+	entry->hash = hash;
+}
+
+// Return the index of the last entry of an index node covering hash.
+static int dx_search(dx_header_t *node, uint32_t hash) {
+	dx_entry_t *entries = dx_entries(node);
+	int lo = 1;
+	int hi = node->count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (entries[mid].hash <= hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+// Descend the index of a directory to the leaf covering hash, recording the path.
+// returns the leaf's logical block.
+static int dx_find(inode_t *dir, uint32_t hash, dx_path_t *path) {
+	dx_header_t *node = dir_block(dir, 0);
+	path->levels = 0;
+	while (1) {
+		assert(node->magic == DX_MAGIC && path->levels < 2);
+		int i = dx_search(node, hash);
+		path->node[path->levels] = node;
+		path->idx[path->levels] = i;
+		path->levels++;
+		int lblock = dx_entries(node)[i].lblock;
+		if (node->depth == 0) {
+			path->leaf = lblock;
+			return lblock;
+		}
+		node = dir_block(dir, lblock);
+	}
+}
+
+// Insert an entry at position pos of an index node with room for it.
+static void dx_insert_at(dx_header_t *node, int pos, uint32_t hash, int lblock) {
+	journal_dirty(node, BLOCK_SIZE);
+	dx_entry_t *entries = dx_entries(node);
+	memmove(&entries[pos + 1], &entries[pos], (node->count - pos) * sizeof(dx_entry_t));
+	entries[pos].hash = hash;
+	entries[pos].lblock = lblock;
+	node->count++;
+}
+
+// Set up a block as an empty index node.
+static void dx_init_node(dx_header_t *node, int depth) {
+	journal_dirty(node, BLOCK_SIZE);
+	memset(node, 0, BLOCK_SIZE);
+	node->magic = DX_MAGIC;
+	node->limit = DX_LIMIT;
+	node->depth = depth;
+}
+
+// Make sure the bottom index node of the path has room for another entry,
+// growing the root or splitting the node as needed.
+// returns 0 on success, -1 on fail.
+static int dx_make_room(inode_t *dir, dx_path_t *path) {
+	dx_header_t *node = path->node[path->levels - 1];
+	if (node->count < node->limit) {
+		return 0;
+	}
+
+	dx_header_t *root = path->node[0];
+	if (path->levels == 1) {
+		// the root is full, so its entries move down into a new index node
+		int lblock = add_dir_block(dir);
+		if (lblock < 0) {
+			return -1;
+		}
+		dx_header_t *child = dir_block(dir, lblock);
+		dx_init_node(child, 0);
+		memcpy(dx_entries(child), dx_entries(root), root->count * sizeof(dx_entry_t));
+		child->count = root->count;
+		journal_dirty(root, BLOCK_SIZE);
+		root->count = 1;
+		root->depth = 1;
+		dx_entries(root)[0].hash = 0;
+		dx_entries(root)[0].lblock = lblock;
+		path->node[1] = child;
+		path->idx[1] = path->idx[0];
+		path->idx[0] = 0;
+		path->levels = 2;
+		node = child;
+	}
+
+	// split the full index node, adding its upper half to the root
+	if (root->count >= root->limit) {
+		printf("Directory index is full.");
+		return -1;
+	}
+	int lblock = add_dir_block(dir);
+	if (lblock < 0) {
+		return -1;
+	}
+	dx_header_t *right = dir_block(dir, lblock);
+	dx_init_node(right, 0);
+	int keep = node->count / 2;
+	memcpy(dx_entries(right), &dx_entries(node)[keep], (node->count - keep) * sizeof(dx_entry_t));
+	right->count = node->count - keep;
+	journal_dirty(node, BLOCK_SIZE);
+	node->count = keep;
+	dx_insert_at(root, path->idx[0] + 1, dx_entries(right)[0].hash, lblock);
+	if (path->idx[1] >= keep) {
+		path->node[1] = right;
+		path->idx[1] -= keep;
+		path->idx[0]++;
+	}
+	return 0;
+}
+
+// Order entries by hash.
+static int compare_hash(const void *a, const void *b) {
+	uint32_t x = ((const direntry_t *) a)->hash;
+	uint32_t y = ((const direntry_t *) b)->hash;
+	return x < y ? -1 : x > y;
+}
+
+// Split the full leaf at the end of the path in two by hash, adding the new leaf to the index.
+// returns 0 on success, -1 on fail.
+static int dx_split_leaf(inode_t *dir, dx_path_t *path) {
+	direntry_t sorted[ENTRIES_PER_BLOCK];
+	memcpy(sorted, dir_block(dir, path->leaf), sizeof(sorted));
+	qsort(sorted, ENTRIES_PER_BLOCK, sizeof(direntry_t), compare_hash);
+
+	// split in the middle, but never between two entries with the same hash
+	int mid = ENTRIES_PER_BLOCK / 2;
+	while (mid < ENTRIES_PER_BLOCK && sorted[mid].hash == sorted[mid - 1].hash) {
+		mid++;
+	}
+	if (mid == ENTRIES_PER_BLOCK) {
+		mid = ENTRIES_PER_BLOCK / 2;
+		while (mid > 0 && sorted[mid].hash == sorted[mid - 1].hash) {
+			mid--;
+		}
+	}
+	if (mid == 0) {
+		printf("Too many names with the same hash.");
+		return -1;
+	}
+
+	if (dx_make_room(dir, path) != 0) {
+		return -1;
+	}
+	int lblock = add_dir_block(dir);
+	if (lblock < 0) {
+		return -1;
+	}
+	direntry_t *left = dir_block(dir, path->leaf);
+	direntry_t *right = dir_block(dir, lblock);
+	journal_dirty(left, BLOCK_SIZE);
+	journal_dirty(right, BLOCK_SIZE);
+	memset(left, 0, BLOCK_SIZE);
+	memcpy(left, sorted, mid * sizeof(direntry_t));
+	memcpy(right, &sorted[mid], (ENTRIES_PER_BLOCK - mid) * sizeof(direntry_t));
+	int level = path->levels - 1;
+	dx_insert_at(path->node[level], path->idx[level] + 1, sorted[mid].hash, lblock);
+	return 0;
+}
+
+// Turn a directory whose single block is full into an indexed one:
+// the entries move to a leaf, and block 0 becomes the root of the index.
+// returns 0 on success, -1 on fail.
+static int dx_convert(inode_t *dir) {
+	int lblock = add_dir_block(dir);
+	if (lblock < 0) {
+		return -1;
+	}
+	direntry_t *leaf = dir_block(dir, lblock);
+	dx_header_t *root = dir_block(dir, 0);
+	journal_dirty(leaf, BLOCK_SIZE);
+	memcpy(leaf, root, BLOCK_SIZE);
+	// entries of a linear directory might not have their hash filled in
+	for (int i = 0; i < ENTRIES_PER_BLOCK; i++) {
+		leaf[i].hash = name_hash(leaf[i].name, strlen(leaf[i].name));
+	}
+
+	dx_init_node(root, 0);
+	root->count = 1;
+	dx_entries(root)[0].hash = 0;
+	dx_entries(root)[0].lblock = lblock;
+	journal_dirty(dir, sizeof(inode_t));
+	dir->flags |= INODE_DIR_INDEX;
+	return 0;
+}
+
+// Return the slot of the directory holding the name of the given length, or null if there is none.
+static direntry_t *find_entry(inode_t *dir, const char *name, int len) {
+	if (len >= DIR_NAME_LENGTH) {
+		return 0;
+	}
+	uint32_t hash = name_hash(name, len);
+	if (dir->flags & INODE_DIR_INDEX) {
+		dx_path_t path;
+		return block_find(dir_block(dir, dx_find(dir, hash, &path)), ENTRIES_PER_BLOCK,
+				name, len, hash, 1);
+	}
+
+	// a small directory is a single block, or the inode itself, that is scanned linearly
+	direntry_t *contents = dir_block(dir, 0);
+	if (contents == 0) {
+		return 0;
+	}
+	return block_find(contents, slots_of(dir), name, len, hash, 0);
+}
+
+// Return a free slot for a name with the given hash, making room for it if needed.
+// returns null on fail.
+static direntry_t *find_free_slot(inode_t *dir, uint32_t hash) {
+	if (dir->flags & INODE_INLINE) {
+		// once the inode is full, its entries move to the directory's first block
+		direntry_t *slot = block_free_slot(dir_block(dir, 0), DIR_INLINE_ENTRIES);
+		if (slot != 0 || inode_expand(dir) != 0) {
+			return slot;
+		}
+	}
+	if (!(dir->flags & INODE_DIR_INDEX)) {
+		// the first entry allocates the directory's block
+		if (dir_block(dir, 0) == 0 && add_dir_block(dir) < 0) {
+			return 0;
+		}
+		direntry_t *slot = block_free_slot(dir_block(dir, 0), ENTRIES_PER_BLOCK);
+		if (slot != 0 || dx_convert(dir) != 0) {
+			return slot;
+		}
+	}
+
+	while (1) {
+		dx_path_t path;
+		direntry_t *leaf = dir_block(dir, dx_find(dir, hash, &path));
+		direntry_t *slot = block_free_slot(leaf, ENTRIES_PER_BLOCK);
+		if (slot != 0) {
+			return slot;
+		}
+		// each split halves the leaf the hash falls in, so this settles quickly
+		if (dx_split_leaf(dir, &path) != 0) {
+			return 0;
+		}
 	}
-	return split_path->data;
 }
 
 // Finds and returns inode index of a file, 
@@ -36,100 +364,241 @@ int find_file_in_dir(inode_t *dir, const char *name) {
 	if (strcmp(name, "/") == 0) {
 		return 0;
 	}
+	direntry_t *entry = find_entry(dir, name, strlen(name));
+	return entry ? entry->inum : -1;
+}
 
-	int entries_in_block = BLOCK_SIZE / sizeof(direntry_t);
-	// retrieve contents of directory by obtaining starting block of block list
-	direntry_t* contents = get_block_at(get_blist_at(dir->block_list)->block);
-	for (int i = 0; i < entries_in_block; i++) {
-		if (strcmp(contents[i].name, name) == 0) {
-			return contents[i].inum;
-		}
+// Finds and returns the inode index of the name of the given length within directory dir,
+// going through the dentry cache.
+int directory_lookup(int dir, const char *name, int len) {
+	int inum;
+	if (dcache_lookup(dir, name, len, &inum)) {
+		return inum;
 	}
+	direntry_t *entry = find_entry(get_inode(dir), name, len);
+	inum = entry ? entry->inum : -1;
+	dcache_insert(dir, name, len, inum);
+	return inum;
+}
 
-	return -1;
+// Resolve a path one component at a time, without copying it.
+// When parent is set, stop before the last component.
+static int walk_path(const char *path, int parent) {
+	int inum = 0; // root dir corresponds to inode 0
+	const char *part = path;
+	while (1) {
+		while (*part == '/') {
+			part++;
+		}
+		if (*part == 0) {
+			return inum;
+		}
+		const char *end = part;
+		while (*end != 0 && *end != '/') {
+			end++;
+		}
+		if (parent) {
+			const char *rest = end;
+			while (*rest == '/') {
+				rest++;
+			}
+			if (*rest == 0) {
+				return inum;
+			}
+		}
+		// each directory is only locked while it is searched
+		cinode_t *ci = inode_lock(inum, 0);
+		inum = directory_lookup(inum, part, end - part);
+		inode_unlock(ci);
+		if (inum < 0) {
+			return -1;
+		}
+		part = end;
+	}
 }
 
 // Finds and returns the inode index of the parent of the given path.
 int parent_inode_index(const char *path) {
-	slist_t* list = s_split(path, '/');
-	assert(list != 0);
-	int parent_index = 0; // root dir corresponds to inode 0
-	while (list->next) {
-		parent_index = find_file_in_dir(get_inode(parent_index), list->data);
-		list = list->next;
-	}
-	return parent_index;
+	return walk_path(path, 1);
 }
 
 // Finds and returns the inode index of the given path.
 int find_inode_index(const char *path) {
-	slist_t* list = s_split(path, '/');
-	assert(list != 0);
-	int inode_index = 0; // root dir corresponds to inode 0
-	while (list) {
-		inode_index = find_file_in_dir(get_inode(inode_index), list->data);
-		list = list->next;
-	}
-	return inode_index;
+	return walk_path(path, 0);
 }
 
-// Put a file with the given name and inode index underneath directory dir.
+// Put a file with the given name and inode index underneath the directory with index dir.
 // and return index, or -1 if not succesfully put.
-int directory_put(inode_t *dir, const char *name, int index) {
-	direntry_t* contents = (direntry_t*) get_block_at(get_blist_at(dir->block_list)->block);
-	int num_entries = BLOCK_SIZE / sizeof(direntry_t);
+int directory_put(int dir, const char *name, int index) {
+	int len = strlen(name);
+	if (len >= DIR_NAME_LENGTH) {
+		printf("Unable to place file under directory.");
+		return -1;
+	}
+	uint32_t hash = name_hash(name, len);
+	direntry_t *slot = find_free_slot(get_inode(dir), hash);
+	if (slot == 0) {
+		printf("Unable to place file under directory.");
+		return -1;
+	}
+	// if we found a spot for it, modify necessary params.
+	// the file's own lock isn't held, so its count is updated atomically
 	inode_t* node = get_inode(index);
-	// find the first free entry within the directory block, and place the file there
-	for (int i = 0; i < num_entries; i++) {
-		if(contents[i].inum == 0) {
-			// if we found a spot for it, modify necessary params.
-			node->refs += 1;
-			contents[i].inum = index;
-			strcpy(contents[i].name, name);
-			dir->size+=sizeof(direntry_t);
-			return index;
+	journal_dirty(node, sizeof(inode_t));
+	__atomic_add_fetch(&node->refs, 1, __ATOMIC_SEQ_CST);
+	fill_entry(slot, name, len, hash, index);
+	dcache_insert(dir, name, len, index);
+	return index;
+}
+
+// Drop a link to the inode with the given index, freeing it once nothing links to it.
+static void drop_link(int inode_num) {
+	inode_t *node = get_inode(inode_num);
+	journal_dirty(node, sizeof(inode_t));
+	// once retrieved, decrement ref. count
+	int refs = __atomic_sub_fetch(&node->refs, 1, __ATOMIC_SEQ_CST);
+	// don't free it unless we know no one else references it
+	if (refs < 1) {
+		// wait for anyone still reading or writing it
+		cinode_t *ci = inode_lock(inode_num, 1);
+		if (S_ISDIR(node->mode)) {
+			// its inode index may be reused by another directory
+			dcache_purge_dir(inode_num);
 		}
+		free_inode(inode_num);
+		inode_unlock(ci);
 	}
-	printf("Unable to place file under directory.");
-	return -1;
 }
 
-// Remove the given path from the given directory.
+// Remove the entry with the given name from the directory with index dir.
 // returns free'd inode index corresponding to file, or -1 on fail.
-int directory_delete(inode_t *dir, const char *name) {
-	// retrieve the directory contents by getting the block at specified index
-	direntry_t* contents = (direntry_t*) get_block_at(get_blist_at(dir->block_list)->block);
-    	int num_entries = BLOCK_SIZE / sizeof(direntry_t);
-	int inode_num = find_inode_index(name);
-	const char* filename = get_filename(name);
-	inode_t *node = get_inode(inode_num);
-	// once retrieved, decrement ref. count
-	node->refs--;
-	for (int i = 0; i < num_entries; i++) {
-		if (contents[i].inum == inode_num && strcmp(contents[i].name,filename) == 0) {
-			// don't free it unless we know no one else references it
-			if (node->refs < 1) {
-				free_inode(inode_num);
+int directory_delete(int dir, const char *name) {
+	int len = strlen(name);
+	direntry_t *entry = find_entry(get_inode(dir), name, len);
+	if (entry == 0) {
+		return -1;
+	}
+	int inode_num = entry->inum;
+	journal_dirty(entry, sizeof(direntry_t));
+	entry->inum = 0;
+	memset(entry->name, 0, sizeof(entry->name));
+	dcache_insert(dir, name, len, -1);
+	drop_link(inode_num);
+	return inode_num;
+}
+
+// Point the existing entry with the given name in the directory with index dir at the
+// inode with index inum instead, so the name is never missing, as rename needs.
+// returns the inode index it pointed at before, or -1 on fail.
+int directory_replace(int dir, const char *name, int inum) {
+	int len = strlen(name);
+	direntry_t *entry = find_entry(get_inode(dir), name, len);
+	if (entry == 0) {
+		return -1;
+	}
+	int old = entry->inum;
+	inode_t *node = get_inode(inum);
+	journal_dirty(node, sizeof(inode_t));
+	__atomic_add_fetch(&node->refs, 1, __ATOMIC_SEQ_CST);
+	journal_dirty(entry, sizeof(direntry_t));
+	entry->inum = inum;
+	dcache_insert(dir, name, len, inum);
+	drop_link(old);
+	return old;
+}
+
+// Order entries by hash, then by name, the order readdir lists them in.
+static int compare_cookie(const void *a, const void *b) {
+	const direntry_t *x = a;
+	const direntry_t *y = b;
+	if (x->hash != y->hash) {
+		return x->hash < y->hash ? -1 : 1;
+	}
+	return strcmp(x->name, y->name);
+}
+
+// Call fill on the entries of a block of count slots that come after the given offset in
+// hash order, until it asks to stop. Only indexed directories have their hashes stored.
+// returns nonzero if it stopped.
+static int fill_block(direntry_t *contents, int count, int hashed, int64_t offset,
+		directory_fill_t fill, void *arg) {
+	direntry_t sorted[ENTRIES_PER_BLOCK];
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		if (contents[i].inum != 0) {
+			sorted[n] = contents[i];
+			if (!hashed) {
+				sorted[n].hash = name_hash(sorted[n].name, strlen(sorted[n].name));
 			}
-			contents[i].inum = 0;
-			memset(contents[i].name, 0, sizeof(contents[i].name));
-			return inode_num;
+			n++;
 		}
 	}
-	return -1;
+	qsort(sorted, n, sizeof(direntry_t), compare_cookie);
+	uint32_t hash = offset >> COOKIE_MINOR_BITS;
+	int minor = offset & ((1 << COOKIE_MINOR_BITS) - 1);
+	for (int i = 0, k = 0; i < n; i++) {
+		k = i > 0 && sorted[i].hash == sorted[i - 1].hash ? k + 1 : 1;
+		if (sorted[i].hash < hash || (sorted[i].hash == hash && k <= minor)) {
+			continue;
+		}
+		if (fill(arg, sorted[i].name, sorted[i].inum, (int64_t) sorted[i].hash << COOKIE_MINOR_BITS | k)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Find the hash the leaf after the one at the end of the path starts at.
+// returns 0 if it is the last leaf, 1 otherwise.
+static int dx_next(dx_path_t *path, uint32_t *hash) {
+	for (int level = path->levels - 1; level >= 0; level--) {
+		dx_header_t *node = path->node[level];
+		if (path->idx[level] + 1 < node->count) {
+			*hash = dx_entries(node)[path->idx[level] + 1].hash;
+			return 1;
+		}
+	}
+	return 0;
 }
 
-// Return a list of the directory contents for given path.
-slist_t *directory_list(const char *path) {
-	slist_t* directory_listing = NULL;
-	int num = find_inode_index(path);
-	inode_t* directory = get_inode(num);
-	direntry_t* contents = get_block_at(get_blist_at(directory->block_list)->block);
-	for (int i = 0; i < (directory->size)/sizeof(direntry_t); i++) {
-		if (strcmp(contents[i].name, "") != 0) {
-			// cons it onto the directory listing
-			directory_listing = s_cons(contents[i].name, directory_listing);
+// Walk the entries of the directory with index dir, starting at the given offset,
+// and call fill on each one until it asks to stop.
+// Entries are listed in hash order, and an offset is the hash of the entry to resume
+// after along with how many entries with that hash came before it, so entries moving
+// between blocks as leaves split are neither skipped nor listed twice.
+// returns 0 on success, -1 on fail.
+int directory_iterate(int dir, int64_t offset, directory_fill_t fill, void *arg) {
+	inode_t* directory = get_inode(dir);
+	if (!(directory->flags & INODE_DIR_INDEX)) {
+		direntry_t *contents = dir_block(directory, 0);
+		if (contents != 0) {
+			fill_block(contents, slots_of(directory), 0, offset, fill, arg);
 		}
+		return 0;
 	}
-	return directory_listing;
+	uint32_t hash = offset >> COOKIE_MINOR_BITS;
+	while (1) {
+		dx_path_t path;
+		direntry_t *leaf = dir_block(directory, dx_find(directory, hash, &path));
+		if (fill_block(leaf, ENTRIES_PER_BLOCK, 1, offset, fill, arg)) {
+			return 0;
+		}
+		// leaves hold ascending ranges of hashes, so the walk always moves on
+		if (!dx_next(&path, &hash)) {
+			return 0;
+		}
+	}
+}
+
+// Stop at the first entry.
+static int stop_at_entry(void *arg, const char *name, int inum, int64_t next) {
+	*(int *) arg = 0;
+	return 1;
+}
+
+// Check whether the directory with index dir has no entries.
+int directory_is_empty(int dir) {
+	int empty = 1;
+	directory_iterate(dir, 0, stop_at_entry, &empty);
+	return empty;
 }
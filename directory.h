@@ -7,15 +7,41 @@
 
 #include "blocks.h"
 #include "inode.h"
-#include "slist.h"
 
 typedef struct direntry {
 	char name[DIR_NAME_LENGTH];
 	int inum;
-	char _reserved[12];
+	uint32_t hash; // name_hash of the name, kept to avoid rehashing and comparing names
+	char _reserved[8];
 } direntry_t;
 
-// Initialize the root directory.
+// Entries a small directory holds in its inode before they move to a block.
+#define DIR_INLINE_ENTRIES ((int) (INODE_INLINE_SIZE / sizeof(direntry_t)))
+
+#define DX_MAGIC 0x58440000 // starts with a zero byte, so it can't be mistaken for a name
+
+// Structure of a directory index node:
+// Block 0 of an indexed directory is the root node. Its entries map ranges of name
+// hashes either to leaf blocks of direntries (depth 0) or to index nodes (depth 1).
+typedef struct dx_header {
+	uint32_t magic;
+	uint16_t count; // entries in use
+	uint16_t limit; // entries that fit in the node
+	uint16_t depth;
+	uint16_t _reserved[3];
+} dx_header_t;
+
+// Names hashing to at least hash (and below the next entry's hash) are found under lblock.
+typedef struct dx_entry {
+	uint32_t hash;
+	uint32_t lblock;
+} dx_entry_t;
+
+// Locking: functions taking a directory expect the caller to hold that directory's lock
+// (see icache.h), for writing if they change it. Path lookups lock each directory
+// along the way themselves, so they must be called without holding any.
+
+// Initialize the root directory, unless the image already has one.
 void directory_init();
 
 // Return the relative path name from the given absolute path.
@@ -24,19 +50,35 @@ const char *get_filename(const char *path);
 // Find the inode index of a file, given the directory that contains the file and the name of the file.
 int find_file_in_dir(inode_t *dir, const char *name);
 
+// Find the inode index of the name of the given length within directory dir, using the dentry cache.
+int directory_lookup(int dir, const char *name, int len);
+
 // Find the inode index of the parent of the given path.
 int parent_inode_index(const char *path);
 
 // Find the inode index of the given path.
 int find_inode_index(const char *path);
 
-// Put a file with the given name and inode index underneath directory dir.
-int directory_put(inode_t *dir, const char *name, int inum);
+// Put a file with the given name and inode index underneath the directory with index dir.
+int directory_put(int dir, const char *name, int inum);
+
+// Remove the entry with the given name from the directory with index dir.
+// The file is freed, under its own write lock, once nothing links to it.
+int directory_delete(int dir, const char *name);
+
+// Point the existing entry with the given name in the directory with index dir at the
+// inode with index inum instead, dropping the link to the inode it pointed at.
+int directory_replace(int dir, const char *name, int inum);
+
+// Called by directory_iterate with each entry and the offset to resume after it.
+// Returns nonzero to stop the walk.
+typedef int (*directory_fill_t)(void *arg, const char *name, int inum, int64_t next);
 
-// Remove the given path from the given directory.
-int directory_delete(inode_t *dir, const char *name);
+// Walk the entries of the directory with index dir, starting at the given offset,
+// and call fill on each one until it asks to stop.
+int directory_iterate(int dir, int64_t offset, directory_fill_t fill, void *arg);
 
-// Return a list of the directory contents for given path.
-slist_t *directory_list(const char *path);
+// Check whether the directory with index dir has no entries.
+int directory_is_empty(int dir);
 
 #endif
@@ -0,0 +1,476 @@
+/* An extent tree implementation.
+ * The root of the tree lives in the inode; once it overflows, the extents move into
+ * tree blocks and the root becomes an index over them. */
+
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+
+#define entries_of(hdr) ((extent_t *) ((extent_header_t *) (hdr) + 1))
+
+// A position in the tree: the node at each level and the entry followed within it.
+typedef struct path {
+	extent_header_t *hdr;
+	int idx;
+} path_t;
+
+// Blocks allocated before an insert starts, so a split can never fail halfway.
+typedef struct spare {
+	int blocks[EXTENT_MAX_DEPTH + 1];
+	int count;
+} spare_t;
+
+static int insert_one(inode_t *node, extent_t *ext);
+
+// Return the root of the extent tree of the given inode.
+static extent_header_t *root_of(inode_t *node) {
+	return &node->extent_root;
+}
+
+// Return the node an index entry points at.
+static extent_header_t *child_of(extent_t *index) {
+	return get_block_at(index->pblock);
+}
+
+// Return the index of the last entry of the node starting at or before lblock, or -1 if there is none.
+static int search(extent_header_t *hdr, uint32_t lblock) {
+	extent_t *ents = entries_of(hdr);
+	int lo = 0;
+	int hi = hdr->entries;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (ents[mid].lblock <= lblock) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo - 1;
+}
+
+// Initialize an empty extent tree in the given inode.
+void extent_init(inode_t *node) {
+	extent_header_t *root = root_of(node);
+	journal_dirty(node, sizeof(inode_t));
+	root->magic = EXTENT_MAGIC;
+	root->entries = 0;
+	root->max = INODE_EXTENTS;
+	root->depth = 0;
+}
+
+// Walk from the root down to the leaf that would hold lblock, recording the path.
+// returns the level of the leaf within the path.
+static int find_path(inode_t *node, uint32_t lblock, path_t *path) {
+	extent_header_t *hdr = root_of(node);
+	for (int level = 0; ; level++) {
+		assert(hdr->magic == EXTENT_MAGIC && level <= EXTENT_MAX_DEPTH);
+		path[level].hdr = hdr;
+		path[level].idx = search(hdr, lblock);
+		if (hdr->depth == 0) {
+			return level;
+		}
+		if (path[level].idx < 0) {
+			path[level].idx = 0;
+		}
+		hdr = child_of(&entries_of(hdr)[path[level].idx]);
+	}
+}
+
+// Note that every node along the path is about to change.
+static void dirty_path(inode_t *node, path_t *path, int leaf) {
+	journal_dirty(node, sizeof(inode_t));
+	for (int level = 1; level <= leaf; level++) {
+		journal_dirty(path[level].hdr, BLOCK_SIZE);
+	}
+}
+
+// Advance the path to the first entry of the next leaf.
+// returns 0 if there are no more leaves, 1 otherwise.
+static int next_leaf(path_t *path, int leaf) {
+	int level = leaf - 1;
+	while (level >= 0 && path[level].idx + 1 >= path[level].hdr->entries) {
+		level--;
+	}
+	if (level < 0) {
+		return 0;
+	}
+	path[level].idx++;
+	for (; level < leaf; level++) {
+		path[level + 1].hdr = child_of(&entries_of(path[level].hdr)[path[level].idx]);
+		path[level + 1].idx = 0;
+	}
+	return 1;
+}
+
+// Point the path at the first extent that ends after lblock.
+// returns the level of the leaf holding it, or -1 if there is no such extent.
+static int find_from(inode_t *node, uint32_t lblock, path_t *path) {
+	int leaf = find_path(node, lblock, path);
+	extent_t *ents = entries_of(path[leaf].hdr);
+	int i = path[leaf].idx;
+	if (i >= 0 && lblock < ents[i].lblock + ents[i].len) {
+		return leaf;
+	}
+	path[leaf].idx = i + 1;
+	if (path[leaf].idx < path[leaf].hdr->entries) {
+		return leaf;
+	}
+	return next_leaf(path, leaf) ? leaf : -1;
+}
+
+// Find the physical block backing the given logical block, or -1 if it is unmapped.
+int extent_lookup(inode_t *node, int lblock, int *count) {
+	path_t path[EXTENT_MAX_DEPTH + 1];
+	int leaf = find_path(node, lblock, path);
+	extent_t *ents = entries_of(path[leaf].hdr);
+	int i = path[leaf].idx;
+	if (i >= 0 && lblock < ents[i].lblock + ents[i].len) {
+		if (count) {
+			*count = ents[i].lblock + ents[i].len - lblock;
+		}
+		return ents[i].packed ? EXTENT_PACKED : ents[i].pblock + (lblock - ents[i].lblock);
+	}
+
+	if (count) {
+		// the hole runs up to the next extent, which may be in a later leaf
+		*count = INT_MAX - lblock;
+		leaf = find_from(node, lblock, path);
+		if (leaf >= 0) {
+			*count = entries_of(path[leaf].hdr)[path[leaf].idx].lblock - lblock;
+		}
+	}
+	return -1;
+}
+
+// Copy the extent mapping the given logical block into ext.
+// returns 0 on success, -1 if the block is unmapped.
+int extent_find(inode_t *node, int lblock, extent_t *ext) {
+	path_t path[EXTENT_MAX_DEPTH + 1];
+	int leaf = find_path(node, lblock, path);
+	extent_t *ents = entries_of(path[leaf].hdr);
+	int i = path[leaf].idx;
+	if (i < 0 || lblock >= ents[i].lblock + ents[i].len) {
+		return -1;
+	}
+	*ext = ents[i];
+	return 0;
+}
+
+// Return a good physical block to allocate for the given logical block.
+int extent_goal(inode_t *node, int lblock) {
+	path_t path[EXTENT_MAX_DEPTH + 1];
+	int leaf = find_path(node, lblock, path);
+	int i = path[leaf].idx;
+	if (i < 0) {
+		return inode_goal(node);
+	}
+	extent_t *ext = &entries_of(path[leaf].hdr)[i];
+	if (ext->packed) {
+		// right after the compressed data
+		return ext->pblock + ext->packed;
+	}
+	return ext->pblock + (lblock - ext->lblock);
+}
+
+// Check whether extent b continues extent a both logically and physically.
+static int can_merge(extent_t *a, extent_t *b) {
+	return a->packed == 0 && b->packed == 0 && a->lblock + a->len == b->lblock && a->pblock + a->len == b->pblock
+		&& a->len + b->len <= EXTENT_MAX_LEN;
+}
+
+// Insert entry at position pos of a node with room for it.
+static void insert_at(extent_header_t *hdr, int pos, extent_t *entry) {
+	extent_t *ents = entries_of(hdr);
+	memmove(&ents[pos + 1], &ents[pos], (hdr->entries - pos) * sizeof(extent_t));
+	ents[pos] = *entry;
+	hdr->entries++;
+}
+
+// Take one of the blocks reserved for this insert and set it up as an empty node.
+static int take_spare(spare_t *spare, int depth) {
+	assert(spare->count > 0);
+	int block = spare->blocks[--spare->count];
+	extent_header_t *hdr = get_block_at(block);
+	journal_dirty(hdr, BLOCK_SIZE);
+	hdr->magic = EXTENT_MAGIC;
+	hdr->entries = 0;
+	hdr->max = (BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t);
+	hdr->depth = depth;
+	return block;
+}
+
+// Move the contents of the root into a new block, leaving the root as an index with one entry.
+// returns the new node.
+static extent_header_t *grow_root(inode_t *node, spare_t *spare) {
+	extent_header_t *root = root_of(node);
+	int block = take_spare(spare, root->depth);
+	extent_header_t *child = get_block_at(block);
+	memcpy(entries_of(child), entries_of(root), root->entries * sizeof(extent_t));
+	child->entries = root->entries;
+
+	extent_t *index = entries_of(root);
+	index->lblock = root->entries > 0 ? index->lblock : 0;
+	index->pblock = block;
+	index->len = 0;
+	index->packed = 0;
+	root->entries = 1;
+	root->depth++;
+	return child;
+}
+
+// Split a full node (not the root) while inserting entry at pos.
+// The upper half moves to a new node, which is described by split.
+static void split_insert(extent_header_t *hdr, int pos, extent_t *entry,
+		extent_t *split, spare_t *spare) {
+	int block = take_spare(spare, hdr->depth);
+	extent_header_t *right = get_block_at(block);
+	// appending leaves the left node full, so files written front to back pack densely
+	int keep = pos == hdr->entries ? hdr->entries : hdr->entries / 2;
+	memcpy(entries_of(right), &entries_of(hdr)[keep], (hdr->entries - keep) * sizeof(extent_t));
+	right->entries = hdr->entries - keep;
+	hdr->entries = keep;
+
+	if (right->entries > 0 && pos <= keep) {
+		insert_at(hdr, pos, entry);
+	} else {
+		insert_at(right, pos - keep, entry);
+	}
+	split->lblock = entries_of(right)[0].lblock;
+	split->pblock = block;
+	split->len = 0;
+	split->packed = 0;
+}
+
+// Insert entry at pos of the node at the given level of the path, splitting nodes as needed.
+static void insert_entry(inode_t *node, path_t *path, int level, int pos,
+		extent_t *entry, spare_t *spare) {
+	extent_header_t *hdr = path[level].hdr;
+	if (hdr->entries < hdr->max) {
+		insert_at(hdr, pos, entry);
+	} else if (level == 0) {
+		insert_at(grow_root(node, spare), pos, entry);
+	} else {
+		extent_t split;
+		split_insert(hdr, pos, entry, &split, spare);
+		insert_entry(node, path, level - 1, path[level - 1].idx + 1, &split, spare);
+	}
+}
+
+// Reserve every block that inserting into the leaf of the given path could need,
+// allocating near goal.
+// returns 0 on success, -1 on fail.
+static int reserve_spare(path_t *path, int leaf, int goal, spare_t *spare) {
+	// splits stop at the first node with room, and a full root grows instead of splitting
+	int needed = 0;
+	for (int level = leaf; level >= 0; level--) {
+		if (path[level].hdr->entries < path[level].hdr->max) {
+			break;
+		}
+		if (level == 0 && path[0].hdr->depth == EXTENT_MAX_DEPTH) {
+			return -1;
+		}
+		needed++;
+	}
+
+	spare->count = 0;
+	while (spare->count < needed) {
+		int got;
+		int block = alloc_blocks(goal, 1, &got);
+		if (block < 0) {
+			while (spare->count > 0) {
+				free_block(spare->blocks[--spare->count]);
+			}
+			return -1;
+		}
+		spare->blocks[spare->count++] = block;
+	}
+	return 0;
+}
+
+// Map one extent, merging it with its neighbours when they are contiguous.
+static int insert_one(inode_t *node, extent_t *ext) {
+	path_t path[EXTENT_MAX_DEPTH + 1];
+	int leaf = find_path(node, ext->lblock, path);
+	dirty_path(node, path, leaf);
+	// index keys are lower bounds of their subtrees
+	for (int level = 0; level < leaf; level++) {
+		extent_t *index = &entries_of(path[level].hdr)[path[level].idx];
+		if (index->lblock > ext->lblock) {
+			index->lblock = ext->lblock;
+		}
+	}
+
+	extent_header_t *hdr = path[leaf].hdr;
+	extent_t *ents = entries_of(hdr);
+	int i = path[leaf].idx;
+	if (i >= 0 && can_merge(&ents[i], ext)) {
+		ents[i].len += ext->len;
+		if (i + 1 < hdr->entries && can_merge(&ents[i], &ents[i + 1])) {
+			ents[i].len += ents[i + 1].len;
+			memmove(&ents[i + 1], &ents[i + 2], (hdr->entries - i - 2) * sizeof(extent_t));
+			hdr->entries--;
+		}
+		return 0;
+	}
+	if (i + 1 < hdr->entries && can_merge(ext, &ents[i + 1])) {
+		ents[i + 1].lblock = ext->lblock;
+		ents[i + 1].pblock = ext->pblock;
+		ents[i + 1].len += ext->len;
+		return 0;
+	}
+
+	spare_t spare;
+	// tree blocks go in the inode's group, along with its data
+	if (reserve_spare(path, leaf, inode_goal(node), &spare) != 0) {
+		return -1;
+	}
+	insert_entry(node, path, leaf, i + 1, ext, &spare);
+	assert(spare.count == 0);
+	return 0;
+}
+
+// Map len logical blocks starting at lblock to physical blocks starting at pblock.
+// returns 0 on success, -1 on fail.
+int extent_insert(inode_t *node, int lblock, int pblock, int len) {
+	while (len > 0) {
+		extent_t ext;
+		ext.lblock = lblock;
+		ext.pblock = pblock;
+		ext.len = len < EXTENT_MAX_LEN ? len : EXTENT_MAX_LEN;
+		ext.packed = 0;
+		if (insert_one(node, &ext) != 0) {
+			return -1;
+		}
+		lblock += ext.len;
+		pblock += ext.len;
+		len -= ext.len;
+	}
+	return 0;
+}
+
+// Map len logical blocks starting at lblock as a compressed run stored in packed blocks.
+// returns 0 on success, -1 on fail.
+int extent_insert_packed(inode_t *node, int lblock, int pblock, int len, int packed) {
+	extent_t ext;
+	ext.lblock = lblock;
+	ext.pblock = pblock;
+	ext.len = len;
+	ext.packed = packed;
+	return insert_one(node, &ext);
+}
+
+// Delete the entry at pos of the node at the given level, freeing nodes that become empty.
+static void delete_entry(inode_t *node, path_t *path, int level, int pos) {
+	extent_header_t *hdr = path[level].hdr;
+	extent_t *ents = entries_of(hdr);
+	memmove(&ents[pos], &ents[pos + 1], (hdr->entries - pos - 1) * sizeof(extent_t));
+	hdr->entries--;
+	if (hdr->entries > 0) {
+		return;
+	}
+	if (level == 0) {
+		// the tree is empty again
+		hdr->depth = 0;
+		return;
+	}
+	free_block(entries_of(path[level - 1].hdr)[path[level - 1].idx].pblock);
+	delete_entry(node, path, level - 1, path[level - 1].idx);
+}
+
+// Pull the only child of the root back into the inode while it fits.
+static void shrink_root(inode_t *node) {
+	extent_header_t *root = root_of(node);
+	journal_dirty(node, sizeof(inode_t));
+	while (root->depth > 0 && root->entries == 1) {
+		int block = entries_of(root)[0].pblock;
+		extent_header_t *child = get_block_at(block);
+		if (child->entries > root->max) {
+			break;
+		}
+		memcpy(entries_of(root), entries_of(child), child->entries * sizeof(extent_t));
+		root->entries = child->entries;
+		root->depth = child->depth;
+		free_block(block);
+	}
+}
+
+// Unmap len logical blocks starting at lblock, freeing the physical blocks.
+// returns 0 on success, -1 on fail.
+int extent_remove(inode_t *node, int lblock, int len) {
+	uint64_t start = lblock;
+	uint64_t end = (uint64_t) lblock + len;
+	path_t path[EXTENT_MAX_DEPTH + 1];
+	int leaf;
+	while (start < end && (leaf = find_from(node, start, path)) >= 0) {
+		extent_t *ext = &entries_of(path[leaf].hdr)[path[leaf].idx];
+		uint64_t ext_end = (uint64_t) ext->lblock + ext->len;
+		if (ext->lblock >= end) {
+			break;
+		}
+		dirty_path(node, path, leaf);
+		uint64_t from = start > ext->lblock ? start : ext->lblock;
+		uint64_t to = end < ext_end ? end : ext_end;
+
+		if (ext->packed && (from > ext->lblock || to < ext_end)) {
+			// compressed data can't be cut; the caller stores the run raw first
+			return -1;
+		}
+		if (ext->packed) {
+			free_blocks(ext->pblock, ext->packed);
+			delete_entry(node, path, leaf, path[leaf].idx);
+		} else if (from > ext->lblock && to < ext_end) {
+			// punching out the middle of an extent leaves two of them
+			extent_t tail;
+			tail.lblock = to;
+			tail.pblock = ext->pblock + (to - ext->lblock);
+			tail.len = ext_end - to;
+			tail.packed = 0;
+			uint32_t pblock = ext->pblock + (from - ext->lblock);
+			uint32_t len = ext->len;
+			ext->len = from - ext->lblock;
+			if (insert_one(node, &tail) != 0) {
+				ext->len = len;
+				return -1;
+			}
+			free_blocks(pblock, to - from);
+		} else if (from > ext->lblock) {
+			free_blocks(ext->pblock + (from - ext->lblock), to - from);
+			ext->len = from - ext->lblock;
+		} else if (to < ext_end) {
+			free_blocks(ext->pblock, to - from);
+			ext->pblock += to - from;
+			ext->lblock = to;
+			ext->len -= to - from;
+		} else {
+			free_blocks(ext->pblock, ext->len);
+			delete_entry(node, path, leaf, path[leaf].idx);
+		}
+		start = to;
+	}
+	shrink_root(node);
+	return 0;
+}
+
+// Free every data block and tree block below the given node.
+static void free_node(extent_header_t *hdr) {
+	extent_t *ents = entries_of(hdr);
+	for (int i = 0; i < hdr->entries; i++) {
+		if (hdr->depth == 0) {
+			free_blocks(ents[i].pblock, ents[i].packed ? ents[i].packed : ents[i].len);
+		} else {
+			free_node(child_of(&ents[i]));
+			free_block(ents[i].pblock);
+		}
+	}
+}
+
+// Unmap every block of the inode and free the tree.
+void extent_free_all(inode_t *node) {
+	free_node(root_of(node));
+	extent_init(node);
+}
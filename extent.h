@@ -0,0 +1,72 @@
+/* Mapping the logical blocks of an inode to physical blocks with an extent tree. */
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+
+#define EXTENT_MAGIC 0xe47e
+#define EXTENT_MAX_LEN 32768 // longest run a single extent may describe
+#define EXTENT_MAX_DEPTH 5
+#define EXTENT_PACKED -2 // what extent_lookup returns for a block of a compressed run
+
+// Structure of an extent tree node:
+// A header followed by a sorted array of extents. Leaves (depth 0) hold extents,
+// while index nodes hold entries whose pblock is the child node and whose lblock
+// is the lowest logical block found underneath that child.
+typedef struct extent_header {
+	uint16_t magic;
+	uint16_t entries; // entries in use
+	uint16_t max;     // entries that fit in this node
+	uint16_t depth;   // 0 for leaves
+} extent_header_t;
+
+// A run of len blocks starting at logical block lblock, stored starting at physical block pblock.
+// A compressed run (see compress.h) instead has the data of all len blocks compressed into
+// its first packed blocks, and is only ever mapped or unmapped whole.
+typedef struct extent {
+	uint32_t lblock;
+	uint32_t pblock;
+	uint16_t len;
+	uint16_t packed; // blocks holding the compressed data, or 0 if the run is stored raw
+} extent_t;
+
+// Forward declaration, since inodes embed the root of their extent tree.
+struct inode;
+
+// Initialize an empty extent tree in the given inode.
+void extent_init(struct inode *node);
+
+// Find the physical block backing the given logical block, or -1 if it is unmapped, or
+// EXTENT_PACKED if it is part of a compressed run.
+// If count isn't null, it is set to the number of blocks from lblock on that are
+// contiguously mapped (or, for an unmapped block, that are unmapped, or for a compressed
+// one, that are left in its run).
+int extent_lookup(struct inode *node, int lblock, int *count);
+
+// Copy the extent mapping the given logical block into ext.
+// Returns 0 on success, -1 if the block is unmapped.
+int extent_find(struct inode *node, int lblock, extent_t *ext);
+
+// Map len logical blocks starting at lblock to physical blocks starting at pblock.
+// The logical range must be unmapped. Returns 0 on success, -1 on fail.
+int extent_insert(struct inode *node, int lblock, int pblock, int len);
+
+// Map len logical blocks starting at lblock as a compressed run, whose data is in packed
+// blocks starting at pblock. The logical range must be unmapped. Returns 0 on success,
+// -1 on fail.
+int extent_insert_packed(struct inode *node, int lblock, int pblock, int len, int packed);
+
+// Unmap len logical blocks starting at lblock, freeing the physical blocks.
+// Returns 0 on success, -1 on fail, which includes the range cutting a compressed run.
+int extent_remove(struct inode *node, int lblock, int len);
+
+// Unmap every block of the inode and free the tree.
+void extent_free_all(struct inode *node);
+
+// Return a good physical block to allocate for the given logical block,
+// which is the block right after the data mapped just before it, or the start of the
+// inode's allocation group if there is none.
+int extent_goal(struct inode *node, int lblock);
+
+#endif
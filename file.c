@@ -0,0 +1,564 @@
+/* Reading and writing file data. */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+#include "blocks.h"
+#include "compress.h"
+#include "extent.h"
+#include "file.h"
+#include "journal.h"
+#include "refcount.h"
+#include "writeback.h"
+
+#define PREALLOC_MIN 16   // blocks allocated past the end of a file being appended to, at least
+#define PREALLOC_MAX 2048 // and at most (8MB); in between, as many as the file already has
+#define DEDUPE_CHUNK (64 * 1024) // bytes compared at a time
+
+// Clamp a request of size bytes at offset to the end of the file.
+static size_t clamp_to_size(inode_t *node, size_t size, off_t offset) {
+	if (offset >= node->size) {
+		return 0;
+	}
+	if (size > node->size - offset) {
+		return node->size - offset;
+	}
+	return size;
+}
+
+// Describe where size bytes starting at offset live in the disk image, ignoring the file size.
+// returns the number of runs.
+static int map_range(inode_t *node, size_t size, off_t offset, file_run_t *runs, int max_runs) {
+	if (node->flags & INODE_INLINE) {
+		if (size == 0 || max_runs == 0) {
+			return 0;
+		}
+		runs[0] = (file_run_t) { -1, size, node->data + offset };
+		return 1;
+	}
+	int count = 0;
+	while (size > 0 && count < max_runs) {
+		int lblock = offset / BLOCK_SIZE;
+		int within = offset % BLOCK_SIZE;
+		int blocks;
+		int pblock = extent_lookup(node, lblock, &blocks);
+
+		int64_t span = (int64_t) blocks * BLOCK_SIZE - within;
+		size_t len = span < (int64_t) size ? span : size;
+		int64_t pos = pblock == EXTENT_PACKED ? FILE_PACKED
+			: pblock < 0 ? -1 : (int64_t) pblock * BLOCK_SIZE + within;
+		// holes next to each other merge, as does data contiguous on disk
+		if (count > 0 && ((pos == -1 && runs[count - 1].pos == -1)
+				|| (pos >= 0 && runs[count - 1].pos + (int64_t) runs[count - 1].size == pos))) {
+			runs[count - 1].size += len;
+		} else {
+			runs[count].pos = pos;
+			runs[count].size = len;
+			runs[count].mem = 0;
+			count++;
+		}
+		offset += len;
+		size -= len;
+	}
+	return count;
+}
+
+// Describe where up to size bytes of the file starting at offset live in the disk image.
+// returns the number of runs.
+int file_map(inode_t *node, size_t size, off_t offset, file_run_t *runs, int max_runs) {
+	return map_range(node, clamp_to_size(node, size, offset), offset, runs, max_runs);
+}
+
+// Copy up to size bytes of the file starting at offset into buf.
+// returns the number of bytes read, or -1 if the data can't be read.
+ssize_t file_read(inode_t *node, char *buf, size_t size, off_t offset) {
+	size = clamp_to_size(node, size, offset);
+	size_t done = 0;
+	while (done < size) {
+		// copy only the requested bytes, reading a batch of runs of contiguous blocks at once
+		file_run_t runs[16];
+		data_io_t ios[16];
+		int count = file_map(node, size - done, offset + done, runs, 16);
+		int reads = 0;
+		for (int i = 0; i < count; i++) {
+			if (runs[i].pos == FILE_PACKED) {
+				ssize_t got = compress_read(node, buf + done, runs[i].size, offset + done);
+				if (got < 0) {
+					return -1;
+				}
+				runs[i].size = got;
+			} else if (runs[i].mem != 0) {
+				memcpy(buf + done, runs[i].mem, runs[i].size);
+			} else if (runs[i].pos < 0) {
+				memset(buf + done, 0, runs[i].size);
+			} else {
+				ios[reads++] = (data_io_t) { runs[i].pos, buf + done, runs[i].size };
+			}
+			done += runs[i].size;
+		}
+		if (data_read(ios, reads) != 0) {
+			return -1;
+		}
+	}
+	return done;
+}
+
+// Map every unmapped block touched by a write of size bytes at offset, in contiguous runs.
+// The parts of new blocks that the write won't cover are zeroed, or all of them with fill set.
+// returns 0 on success, -1 if the disk is full.
+static int allocate_range(inode_t *node, size_t size, off_t offset, int fill) {
+	int64_t end = offset + size;
+	int lblock = offset / BLOCK_SIZE;
+	int last = (end - 1) / BLOCK_SIZE;
+	while (lblock <= last) {
+		int count;
+		// compressed data is mapped too
+		if (extent_lookup(node, lblock, &count) != -1) {
+			lblock += count;
+			continue;
+		}
+		if (count > last - lblock + 1) {
+			count = last - lblock + 1;
+		}
+		int got;
+		int run = alloc_blocks(extent_goal(node, lblock), count, &got);
+		if (run < 0) {
+			return -1;
+		}
+		if (extent_insert(node, lblock, run, got) != 0) {
+			free_blocks(run, got);
+			return -1;
+		}
+		if (fill) {
+			zero_blocks(run, got);
+			lblock += got;
+			continue;
+		}
+
+		for (int i = 0; i < got; i++) {
+			int64_t start = (int64_t) (lblock + i) * BLOCK_SIZE;
+			int64_t pos = (int64_t) (run + i) * BLOCK_SIZE;
+			int rv = 0;
+			if (offset > start) {
+				rv |= data_zero(pos, offset - start < BLOCK_SIZE ? offset - start : BLOCK_SIZE);
+			}
+			if (end < start + BLOCK_SIZE) {
+				int from = end > start ? end - start : 0;
+				rv |= data_zero(pos + from, BLOCK_SIZE - from);
+			}
+			if (rv != 0) {
+				return -1;
+			}
+		}
+		lblock += got;
+	}
+	return 0;
+}
+
+// Allocate zeroed blocks past the given new end of a file being appended to, unless some
+// allocated earlier are left. Appending a little at a time then still fills long runs of
+// blocks, rather than taking turns with other files for them. It is only a hint, so
+// nothing is allocated when space is short.
+static void preallocate(inode_t *node, int64_t end) {
+	int lblock = bytes_to_blocks(end);
+	int count;
+	if (extent_lookup(node, lblock, &count) != -1) {
+		return;
+	}
+	int want = lblock < PREALLOC_MIN ? PREALLOC_MIN : lblock < PREALLOC_MAX ? lblock : PREALLOC_MAX;
+	int goal = extent_goal(node, lblock);
+	// leave most of a group's free space to the files that need it
+	group_desc_t *desc = get_group_desc(block_group(goal));
+	int spare = __atomic_load_n(&desc->free_blocks, __ATOMIC_RELAXED) / 16;
+	want = want < count ? want : count;
+	want = want < spare ? want : spare;
+	int got;
+	int run = want > 0 ? alloc_blocks(goal, want, &got) : -1;
+	if (run < 0) {
+		return;
+	}
+	if (extent_insert(node, lblock, run, got) != 0) {
+		free_blocks(run, got);
+		return;
+	}
+	zero_blocks(run, got);
+}
+
+// Get the file ready for a write of size bytes at offset, and describe where that range
+// lives in the disk image as at most max_runs runs.
+// returns the number of runs, or -1 if the disk is full.
+int file_prepare_write(inode_t *node, size_t size, off_t offset, file_run_t *runs, int max_runs) {
+	if (size == 0) {
+		return 0;
+	}
+	if (node->flags & INODE_INLINE) {
+		if (offset + size <= INODE_INLINE_SIZE) {
+			// the gap past the end of the file, if any, is already zeros
+			journal_dirty(node, sizeof(inode_t));
+			return map_range(node, size, offset, runs, max_runs);
+		}
+		if (inode_expand(node) != 0) {
+			return -1;
+		}
+	}
+	// writing past the end of the file leaves a hole in between
+	if (offset > node->size && grow_inode(node, offset) != 0) {
+		return -1;
+	}
+	// compressed data is stored raw, and blocks shared with a clone are copied, before they change
+	int first = offset / BLOCK_SIZE;
+	int blocks = (offset + size - 1) / BLOCK_SIZE - first + 1;
+	if (compress_unpack(node, first, blocks) != 0 || allocate_range(node, size, offset, 0) != 0
+			|| inode_unshare(node, first, blocks) != 0) {
+		return -1;
+	}
+	if (offset + (int64_t) size > node->size) {
+		preallocate(node, offset + size);
+	}
+	return map_range(node, size, offset, runs, max_runs);
+}
+
+// Note that size bytes were written at offset into the given runs: their blocks are dirty,
+// and the file grows if the bytes went past its end.
+void file_end_write(inode_t *node, file_run_t *runs, int count, size_t size, off_t offset) {
+	for (int i = 0; i < count; i++) {
+		if (runs[i].mem != 0) {
+			// inline data was journaled along with the inode
+			continue;
+		}
+		int first = runs[i].pos / BLOCK_SIZE;
+		int last = (runs[i].pos + runs[i].size - 1) / BLOCK_SIZE;
+		writeback_dirty(first, last - first + 1);
+	}
+	compress_note_write(node, size, offset);
+	if (offset + (int64_t) size > node->size) {
+		journal_dirty(node, sizeof(inode_t));
+		node->size = offset + size;
+	}
+}
+
+// Copy size bytes from buf into the file starting at offset, growing it as needed.
+// returns the number of bytes written, or -1 if the disk is full.
+ssize_t file_write(inode_t *node, const char *buf, size_t size, off_t offset) {
+	size_t done = 0;
+	while (done < size) {
+		// the mapping is the same whether the write is done in one piece or in several
+		file_run_t runs[16];
+		int count = file_prepare_write(node, size - done, offset + done, runs, 16);
+		if (count < 0) {
+			return done > 0 ? done : -1;
+		}
+		// the runs in the image are written as one batch
+		data_io_t ios[16];
+		int writes = 0;
+		for (int i = 0, at = done; i < count; at += runs[i].size, i++) {
+			if (runs[i].mem != 0) {
+				memcpy(runs[i].mem, buf + at, runs[i].size);
+			} else {
+				ios[writes++] = (data_io_t) { runs[i].pos, (char *) buf + at, runs[i].size };
+			}
+		}
+		if (data_write(ios, writes) != 0) {
+			return done > 0 ? done : -1;
+		}
+		for (int i = 0; i < count; i++) {
+			file_end_write(node, &runs[i], 1, runs[i].size, offset + done);
+			done += runs[i].size;
+		}
+	}
+	return done;
+}
+
+// Allocate zeroed blocks for every hole in size bytes of the file starting at offset.
+// Unless keep_size is set, the file grows to cover the range.
+// returns 0 on success, -1 if the disk is full.
+int file_allocate(inode_t *node, size_t size, off_t offset, int keep_size) {
+	int64_t end = offset + size;
+	// inline data needs no blocks, as long as the range stays within the inode
+	if ((node->flags & INODE_INLINE) && end > INODE_INLINE_SIZE && inode_expand(node) != 0) {
+		return -1;
+	}
+	if (!(node->flags & INODE_INLINE) && allocate_range(node, size, offset, 1) != 0) {
+		return -1;
+	}
+	if (end > node->size) {
+		journal_dirty(node, sizeof(inode_t));
+		if (!keep_size) {
+			node->size = end;
+		} else if (!(node->flags & INODE_INLINE)) {
+			node->flags |= INODE_PREALLOC;
+		}
+	}
+	return 0;
+}
+
+// Free the blocks allocated past the end of the file while it was appended to.
+// returns 0 on success, -1 on fail.
+int file_trim(inode_t *node) {
+	if (node->flags & (INODE_INLINE | INODE_PREALLOC)) {
+		return 0;
+	}
+	int blocks = bytes_to_blocks(node->size);
+	int count;
+	if (extent_lookup(node, blocks, &count) < 0 && count == INT_MAX - blocks) {
+		// nothing is mapped past the end
+		return 0;
+	}
+	return extent_remove(node, blocks, INT_MAX - blocks);
+}
+
+// Zero the bytes of the file from offset up to end, which lie within a single block.
+// returns 0 on success, -1 if the disk is full.
+static int zero_partial(inode_t *node, off_t offset, int64_t end) {
+	if (compress_unpack(node, offset / BLOCK_SIZE, 1) != 0 || inode_unshare(node, offset / BLOCK_SIZE, 1) != 0) {
+		return -1;
+	}
+	int block = inode_get_block(node, offset / BLOCK_SIZE, 0);
+	if (block >= 0) {
+		if (data_zero((int64_t) block * BLOCK_SIZE + offset % BLOCK_SIZE, end - offset) != 0) {
+			return -1;
+		}
+		writeback_dirty(block, 1);
+	}
+	return 0;
+}
+
+// Turn size bytes of the file starting at offset into a hole, leaving its size alone.
+// returns 0 on success, -1 if the disk is full.
+int file_punch_hole(inode_t *node, size_t size, off_t offset) {
+	int64_t end = offset + size;
+	if (node->flags & INODE_INLINE) {
+		if (offset < node->size) {
+			journal_dirty(node, sizeof(inode_t));
+			memset(node->data + offset, 0, (end < node->size ? end : node->size) - offset);
+		}
+		return 0;
+	}
+	// whole blocks are unmapped and freed, and the parts of blocks at either end zeroed
+	int64_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int64_t last = end / BLOCK_SIZE;
+	if (first < last && (compress_split(node, first) != 0 || compress_split(node, last) != 0
+			|| extent_remove(node, first, last - first) != 0)) {
+		return -1;
+	}
+	if (first > last) {
+		return zero_partial(node, offset, end);
+	}
+	if (offset < first * BLOCK_SIZE && zero_partial(node, offset, first * BLOCK_SIZE) != 0) {
+		return -1;
+	}
+	if (end > last * BLOCK_SIZE && zero_partial(node, last * BLOCK_SIZE, end) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Find the extent of src mapping its logical block lblock, cut short at end, setting
+// blocks to the logical blocks it covers from lblock on.
+// returns 0 if it is mapped, -1 for a hole.
+static int clone_extent(inode_t *src, int lblock, int end, extent_t *ext, int *blocks) {
+	int count;
+	int pblock = extent_lookup(src, lblock, &count);
+	*blocks = count < end - lblock ? count : end - lblock;
+	if (pblock == -1) {
+		return -1;
+	}
+	if (pblock == EXTENT_PACKED) {
+		// shared whole, as the range doesn't end partway through it
+		extent_find(src, lblock, ext);
+		return 0;
+	}
+	ext->lblock = lblock;
+	ext->pblock = pblock;
+	ext->len = *blocks;
+	ext->packed = 0;
+	return 0;
+}
+
+// Make size bytes of dst starting at dst_offset share the blocks of size bytes of src
+// starting at src_offset, replacing what dst had there.
+// returns 0 on success, -1 if the disk is full.
+int file_clone(inode_t *dst, inode_t *src, off_t src_offset, size_t size, off_t dst_offset) {
+	if (src->flags & INODE_INLINE) {
+		// inline data has no blocks to share, and is small enough to copy
+		char data[INODE_INLINE_SIZE];
+		size_t len = file_read(src, data, size, src_offset);
+		return file_write(dst, data, len, dst_offset) == len ? 0 : -1;
+	}
+	if (inode_expand(dst) != 0) {
+		return -1;
+	}
+	int from = src_offset / BLOCK_SIZE;
+	int to = dst_offset / BLOCK_SIZE;
+	int blocks = bytes_to_blocks(size);
+	// compressed runs are shared whole, so neither range may end partway through one
+	if (compress_split(src, from) != 0 || compress_split(src, from + blocks) != 0
+			|| compress_split(dst, to) != 0 || compress_split(dst, to + blocks) != 0) {
+		return -1;
+	}
+	// room for every count comes first, so running out of space changes nothing
+	extent_t ext;
+	for (int i = 0, count; i < blocks; i += count) {
+		if (clone_extent(src, from + i, from + blocks, &ext, &count) == 0
+				&& refcount_reserve(ext.pblock, ext.packed ? ext.packed : ext.len) != 0) {
+			return -1;
+		}
+	}
+	if (extent_remove(dst, to, blocks) != 0) {
+		return -1;
+	}
+	for (int i = 0, count; i < blocks; i += count) {
+		if (clone_extent(src, from + i, from + blocks, &ext, &count) != 0) {
+			continue;
+		}
+		int stored = ext.packed ? ext.packed : ext.len;
+		refcount_share(ext.pblock, stored);
+		int rv = ext.packed ? extent_insert_packed(dst, to + i, ext.pblock, ext.len, ext.packed)
+			: extent_insert(dst, to + i, ext.pblock, ext.len);
+		if (rv != 0) {
+			free_blocks(ext.pblock, stored);
+			return -1;
+		}
+	}
+	if (dst_offset + (int64_t) size > dst->size) {
+		journal_dirty(dst, sizeof(inode_t));
+		dst->size = dst_offset + size;
+	}
+	return 0;
+}
+
+// Return how many of count blocks of dst starting at to are already the blocks of src
+// starting at from, or holes where src has holes too.
+static int same_blocks(inode_t *dst, inode_t *src, int to, int from, int count) {
+	int same = 0;
+	for (int i = 0; i < count; ) {
+		int a, b;
+		int pa = extent_lookup(src, from + i, &a);
+		int pb = extent_lookup(dst, to + i, &b);
+		int n = a < b ? a : b;
+		n = n < count - i ? n : count - i;
+		if (pa == pb && pa != EXTENT_PACKED) {
+			same += n;
+		}
+		i += n;
+	}
+	return same;
+}
+
+// Return how many blocks replacing count blocks of dst starting at to would free: those
+// mapped there that no other file shares. A compressed run the range only covers part of
+// is rewritten rather than freed, so it doesn't count.
+static int owned_blocks(inode_t *dst, int to, int count) {
+	int owned = 0;
+	for (int i = 0, n; i < count; i += n) {
+		int pblock = extent_lookup(dst, to + i, &n);
+		n = n < count - i ? n : count - i;
+		if (pblock == EXTENT_PACKED) {
+			extent_t ext;
+			extent_find(dst, to + i, &ext);
+			if ((int) ext.lblock >= to && (int) (ext.lblock + ext.len) <= to + count
+					&& refcount_run(ext.pblock, ext.packed, 0) == ext.packed) {
+				owned += ext.packed;
+			}
+			continue;
+		}
+		// a run of blocks alternates between ones dst has to itself and shared ones
+		for (int k = 0; pblock >= 0 && k < n; ) {
+			int own = refcount_run(pblock + k, n - k, 0);
+			owned += own;
+			k += own;
+			k += refcount_run(pblock + k, n - k, 1);
+		}
+	}
+	return owned;
+}
+
+// Make size bytes of dst starting at dst_offset share the blocks of src starting at
+// src_offset if they hold the same data, setting deduped to the bytes of the blocks this
+// freed.
+// returns 1 if the data was the same, 0 if not, -1 if the disk is full.
+int file_dedupe(inode_t *dst, inode_t *src, off_t src_offset, size_t size, off_t dst_offset,
+		size_t *deduped) {
+	*deduped = 0;
+	char *a = malloc(DEDUPE_CHUNK);
+	char *b = malloc(DEDUPE_CHUNK);
+	int same = 1;
+	for (size_t done = 0; done < size && same; done += DEDUPE_CHUNK) {
+		size_t len = size - done < DEDUPE_CHUNK ? size - done : DEDUPE_CHUNK;
+		same = file_read(src, a, len, src_offset + done) == (ssize_t) len
+			&& file_read(dst, b, len, dst_offset + done) == (ssize_t) len && memcmp(a, b, len) == 0;
+	}
+	free(a);
+	free(b);
+	if (!same || (src->flags & INODE_INLINE) || (dst->flags & INODE_INLINE)) {
+		// inline data has no blocks to share
+		return same;
+	}
+	int blocks = bytes_to_blocks(size);
+	int differ = blocks - same_blocks(dst, src, dst_offset / BLOCK_SIZE, src_offset / BLOCK_SIZE, blocks);
+	if (differ == 0) {
+		return 1;
+	}
+	int owned = owned_blocks(dst, dst_offset / BLOCK_SIZE, blocks);
+	if (file_clone(dst, src, src_offset, size, dst_offset) != 0) {
+		return -1;
+	}
+	*deduped = (size_t) owned * BLOCK_SIZE;
+	return 1;
+}
+
+// Return the offset of the first data (or with hole set, the first hole) at or after offset.
+// returns -1 if there is none before the end of the file.
+off_t file_seek(inode_t *node, off_t offset, int hole) {
+	if (offset < 0 || offset >= node->size) {
+		return -1;
+	}
+	if (node->flags & INODE_INLINE) {
+		// inline data counts as data throughout, and the end of the file as a hole
+		return hole ? node->size : offset;
+	}
+	int64_t lblock = offset / BLOCK_SIZE;
+	while (lblock * BLOCK_SIZE < node->size) {
+		int count;
+		int mapped = extent_lookup(node, lblock, &count) != -1;
+		if (mapped != hole) {
+			int64_t at = lblock * BLOCK_SIZE;
+			return at > offset ? at : offset;
+		}
+		lblock += count;
+	}
+	// every file has a hole at its end
+	return hole ? node->size : -1;
+}
+
+// Write back the file's dirty data. With wait set, return once it is durable;
+// otherwise only start writing it.
+// returns 0 on success, -1 on fail.
+int file_sync(inode_t *node, int wait) {
+	int rv = 0;
+	// inline data is metadata, so it is made durable by the journal
+	int blocks = node->flags & INODE_INLINE ? 0 : bytes_to_blocks(node->size);
+	// only the blocks the file maps are looked at, so the cost follows its size, not the image's
+	for (int lblock = 0; lblock < blocks; ) {
+		int count;
+		int pblock = extent_lookup(node, lblock, &count);
+		if (count > blocks - lblock) {
+			count = blocks - lblock;
+		}
+		if (pblock >= 0) {
+			rv |= writeback_range(pblock, count, wait);
+		} else if (pblock == EXTENT_PACKED) {
+			extent_t ext;
+			extent_find(node, lblock, &ext);
+			rv |= writeback_range(ext.pblock, ext.packed, wait);
+		}
+		lblock += count;
+	}
+	if (wait) {
+		// blocks the writeback thread took from the file may still be on their way
+		writeback_wait();
+	}
+	return rv;
+}
@@ -0,0 +1,85 @@
+/* Reading and writing file data. */
+
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "inode.h"
+
+#define FILE_PACKED -2
+
+// A run of file data that is contiguous in the disk image.
+// The data of a file stored inline is a single run in memory instead.
+typedef struct file_run {
+	int64_t pos;  // byte offset in the disk image, -1 for a hole that reads as zeros, or
+	              // FILE_PACKED for compressed data, which only file_read can read
+	size_t size;  // bytes
+	char *mem;    // where the run is in the inode, if the data is inline, otherwise null
+} file_run_t;
+
+// Copy up to size bytes of the file starting at offset into buf.
+// Returns the number of bytes read, which is short only at the end of the file, or -1 if
+// the data can't be read.
+ssize_t file_read(inode_t *node, char *buf, size_t size, off_t offset);
+
+// Describe where up to size bytes of the file starting at offset live in the disk image,
+// as at most max_runs runs. Returns the number of runs.
+int file_map(inode_t *node, size_t size, off_t offset, file_run_t *runs, int max_runs);
+
+// Copy size bytes from buf into the file starting at offset, growing it as needed.
+// Returns the number of bytes written, or -1 if the disk is full or the data can't be written.
+ssize_t file_write(inode_t *node, const char *buf, size_t size, off_t offset);
+
+// Get the file ready for a write of size bytes at offset: allocate the blocks it needs, zero
+// what the write won't cover, and describe where the range lives as at most max_runs runs.
+// A write past the end of the file allocates blocks beyond it as well (see file_trim).
+// Data stored inline moves to a block first if the write wouldn't fit in the inode.
+// Returns the number of runs, or -1 if the disk is full.
+int file_prepare_write(inode_t *node, size_t size, off_t offset, file_run_t *runs, int max_runs);
+
+// Note that size bytes were written at offset into the given runs, which file_prepare_write
+// returned: the blocks are marked dirty, and the file grows if the bytes went past its end.
+void file_end_write(inode_t *node, file_run_t *runs, int count, size_t size, off_t offset);
+
+// Allocate zeroed blocks for every hole in size bytes of the file starting at offset, as
+// fallocate does. Unless keep_size is set, the file grows to cover the range.
+// Returns 0 on success, -1 if the disk is full.
+int file_allocate(inode_t *node, size_t size, off_t offset, int keep_size);
+
+// Free the blocks allocated past the end of the file as it was appended to, once it is
+// closed. Blocks allocated there with file_allocate are kept.
+// Returns 0 on success, -1 if the disk is full.
+int file_trim(inode_t *node);
+
+// Turn size bytes of the file starting at offset into a hole that reads as zeros, freeing
+// the blocks it covers. The size of the file doesn't change.
+// Returns 0 on success, -1 if the disk is full.
+int file_punch_hole(inode_t *node, size_t size, off_t offset);
+
+// Make size bytes of dst starting at dst_offset share the blocks of size bytes of src
+// starting at src_offset, as FICLONERANGE does; either file copies a shared block before
+// changing it. The offsets must be multiples of the block size, as must size unless the range
+// ends at the end of src, and the ranges mustn't overlap if the files are the same.
+// Returns 0 on success, -1 if the disk is full.
+int file_clone(inode_t *dst, inode_t *src, off_t src_offset, size_t size, off_t dst_offset);
+
+// Clone size bytes of src starting at src_offset into dst at dst_offset as file_clone does,
+// but only if the two ranges hold the same data, as FIDEDUPERANGE does. Both ranges must lie
+// within their files. deduped is set to the bytes of the blocks this freed: those dst had to
+// itself, leaving out holes and blocks it already shared with src or any other file.
+// Returns 1 if the data was the same, 0 if it wasn't, -1 if the disk is full.
+int file_dedupe(inode_t *dst, inode_t *src, off_t src_offset, size_t size, off_t dst_offset,
+		size_t *deduped);
+
+// Return the offset of the first byte of data at or after offset, or with hole set, of the
+// first byte of a hole, as lseek's SEEK_DATA and SEEK_HOLE do. The end of the file counts
+// as a hole. Returns -1 if offset is at or past the end of the file, or there is no more data.
+off_t file_seek(inode_t *node, off_t offset, int hole);
+
+// Write back the file's dirty data. With wait set, return once it is durable;
+// otherwise only start writing it. Returns 0 on success, -1 on fail.
+int file_sync(inode_t *node, int wait);
+
+#endif
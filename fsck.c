@@ -0,0 +1,905 @@
+/* Checks a nufs image for consistency, and repairs it with -y.
+ *
+ * The journal is replayed first, as on mount. The chunk indexes of the inode table and
+ * of the reference count table are checked before anything else, since every inode is
+ * found through the first. The check then runs in passes, each split across threads an
+ * allocation group at a time:
+ *   1. every inode marked in use has its mode and extent tree (or inline data) checked,
+ *      and the blocks the tree reaches are claimed for it, which finds blocks shared by
+ *      two inodes other than data blocks shared by clones, which are counted instead;
+ *   2. every directory has its index and entries checked, and each entry is counted as
+ *      a link to the inode it names;
+ *   3. after a walk of the namespace from the root (on one thread, as it is cheap once
+ *      the links are known), the block bitmap is compared with the blocks claimed, and
+ *      the reference counts with the extents found mapping each block (files found
+ *      mapping the same data are left sharing it, as clones whose counts were lost);
+ *   4. the inode bitmap, reference counts and group descriptors are compared with what
+ *      was found.
+ * Repairs that change the namespace (freeing inodes with a bad mode, resetting corrupt
+ * extent trees, rebuilding directories, reconnecting orphans under /lost+found) make the
+ * check start over, so the last passes always see the repaired namespace. The block
+ * bitmap is repaired before them, so the blocks they allocate are really free. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "blocks.h"
+#include "compress.h"
+#include "dcache.h"
+#include "directory.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+#include "refcount.h"
+
+#define MAX_ROUNDS 8 // times the check may start over after repairs
+#define LOST_FOUND "lost+found"
+#define NODE_MAX ((int) ((BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t)))
+#define DX_LIMIT ((int) ((BLOCK_SIZE - sizeof(dx_header_t)) / sizeof(dx_entry_t)))
+#define dx_entries(hdr) ((dx_entry_t *) ((dx_header_t *) (hdr) + 1))
+#define extents_of(hdr) ((extent_t *) ((extent_header_t *) (hdr) + 1))
+
+// What was found about each inode.
+#define IN_USE   0x1  // marked in use, with a valid mode
+#define BAD_TREE 0x2  // its extent tree is corrupt
+#define SHARED   0x4  // it claims blocks that an inode with a lower index claims too
+#define REBUILD  0x8  // a directory whose index or entries need rebuilding
+#define REACHED  0x10 // reached from the root
+#define NO_CHUNK 0x20 // its chunk of the inode table isn't allocated, or is bad
+
+// Exit codes, as e2fsck has them.
+#define EXIT_CLEAN 0
+#define EXIT_FIXED 1
+#define EXIT_UNFIXED 4
+#define EXIT_ERROR 8
+
+// A directory entry, as a link from a directory to an inode.
+typedef struct edge {
+	int dir;
+	int inum;
+} edge_t;
+
+// State of one checking thread.
+typedef struct worker {
+	pthread_t thread;
+	void (*fn)(struct worker *w, int group);
+	edge_t *edges; // the links found by the thread in pass 2
+	int edge_count;
+	int edge_cap;
+} worker_t;
+
+static superblock_t *sb;
+static int repair = 0;
+static int thread_count = 1;
+static int next_group;  // the next group for a thread to take
+static int *owner;      // for each block, 2 + the lowest inode claiming it, 1 for the inode table, or 0
+static uint32_t *maps;  // for each block, the extents mapping it as file data
+static uint32_t *tables; // for each chunk of reference counts, its table block if valid, or 0
+static uint8_t *state;  // for each inode, what was found about it
+static int *links;      // for each inode, the entries naming it
+static worker_t *workers;
+static int problems;    // found in this round
+static int fixed;       // over all rounds
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Report a problem.
+static void problem(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	pthread_mutex_lock(&print_lock);
+	vprintf(format, args);
+	printf(repair ? " (fixed)\n" : "\n");
+	problems++;
+	pthread_mutex_unlock(&print_lock);
+	va_end(args);
+}
+
+// Set a flag of an inode, returning the flags it had before.
+static int mark(int inum, int flag) {
+	return __atomic_fetch_or(&state[inum], flag, __ATOMIC_RELAXED);
+}
+
+// Take groups for the given worker until there are none left.
+static void *run_worker(void *arg) {
+	worker_t *w = arg;
+	int count = sb->group_count;
+	for (int g; (g = __atomic_fetch_add(&next_group, 1, __ATOMIC_RELAXED)) < count; ) {
+		w->fn(w, g);
+	}
+	return 0;
+}
+
+// Call fn on every allocation group, spread over the threads.
+static void for_each_group(void (*fn)(worker_t *w, int group)) {
+	next_group = 0;
+	for (int i = 0; i < thread_count; i++) {
+		workers[i].fn = fn;
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	}
+	for (int i = 0; i < thread_count; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+}
+
+// Return the first inode of a group and set end past its last.
+static int group_inodes(int group, int *end) {
+	*end = (group + 1) * sb->inodes_per_group;
+	return group * sb->inodes_per_group;
+}
+
+// Return the first block of a group and set end past its last.
+static int group_blocks(int group, int *end) {
+	int64_t last = (int64_t) (group + 1) * sb->blocks_per_group;
+	*end = last < sb->block_count ? last : sb->block_count;
+	return group * sb->blocks_per_group;
+}
+
+// Check whether count blocks starting at block lie in the data region.
+static int valid_blocks(uint32_t block, uint32_t count) {
+	return block >= sb->data_start && count <= sb->block_count && block <= sb->block_count - count;
+}
+
+// Claim count blocks starting at block for inode inum, as file data if data is set or
+// else as a node of its extent tree. When another inode claims one too, the inode with
+// the higher index is the one marked as sharing it; the inode table's chunks, claimed
+// before any inode, always keep their blocks. Data blocks may be mapped by any number of
+// extents, as clones share them; only the first claim of each is checked.
+static void claim(int inum, int block, int count, int data) {
+	for (int b = block; b < block + count; b++) {
+		if (data && __atomic_fetch_add(&maps[b], 1, __ATOMIC_RELAXED) > 0) {
+			continue;
+		}
+		int prev = __atomic_load_n(&owner[b], __ATOMIC_RELAXED);
+		while ((prev == 0 || inum + 2 < prev)
+				&& !__atomic_compare_exchange_n(&owner[b], &prev, inum + 2, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		}
+		if (prev != 0 && prev != inum + 2) {
+			int loser = prev - 2 > inum ? prev - 2 : inum;
+			int winner = prev - 2 > inum ? inum : prev - 2;
+			if (mark(loser, SHARED) & SHARED) {
+				continue;
+			}
+			if (winner < 0) {
+				problem("inode %d: shares block %d with the inode table", loser, b);
+			} else {
+				problem("inode %d: shares block %d with inode %d", loser, b, winner);
+			}
+		}
+	}
+}
+
+// Check the chunk index of the inode table, claiming the block of each chunk. The
+// inodes of chunks that are missing or bad are marked, so nothing looks at them.
+static void check_inode_map() {
+	uint32_t *map = get_inode_map();
+	int chunks = sb->inode_count / INODE_CHUNK;
+	for (int c = 0; c < chunks; c++) {
+		uint32_t block = map[c];
+		if (block != 0 && !valid_blocks(block, 1)) {
+			problem("inode chunk %d: bad block %u", c, block);
+		} else if (block != 0 && owner[block] != 0) {
+			problem("inode chunk %d: block %u is used by another chunk", c, block);
+		} else if (block != 0) {
+			owner[block] = 1;
+			continue;
+		}
+		memset(&state[c * INODE_CHUNK], NO_CHUNK, INODE_CHUNK);
+	}
+}
+
+// Check the chunk index of the reference count table, claiming the block of each chunk.
+// Chunks whose block is bad are dropped from the index, to be checked as having none.
+static void check_refcount_map() {
+	uint32_t *map = get_refcount_map();
+	int chunks = (sb->block_count + REFCOUNT_CHUNK - 1) / REFCOUNT_CHUNK;
+	if (repair) {
+		journal_begin();
+	}
+	for (int c = 0; c < chunks; c++) {
+		uint32_t block = map[c];
+		tables[c] = 0;
+		if (block != 0 && !valid_blocks(block, 1)) {
+			problem("refcount chunk %d: bad block %u", c, block);
+		} else if (block != 0 && owner[block] != 0) {
+			problem("refcount chunk %d: block %u is used by another chunk", c, block);
+		} else {
+			if (block != 0) {
+				owner[block] = 1;
+				tables[c] = block;
+			}
+			continue;
+		}
+		if (repair) {
+			journal_dirty(&map[c], sizeof(uint32_t));
+			map[c] = 0;
+		}
+	}
+	if (repair) {
+		journal_end();
+	}
+}
+
+// Check an extent tree node of inode inum and everything under it, claiming the blocks
+// it reaches. The node must hold at most max entries at the given depth, and map only
+// logical blocks in [lo, hi).
+// returns 0 if it is valid, -1 if not.
+static int check_node(int inum, extent_header_t *hdr, int max, int depth, int64_t lo, int64_t hi) {
+	if (hdr->magic != EXTENT_MAGIC || hdr->max != max || hdr->entries > max
+			|| hdr->depth != depth) {
+		return -1;
+	}
+	extent_t *ents = extents_of(hdr);
+	for (int i = 0; i < hdr->entries; i++) {
+		if (ents[i].lblock < lo) {
+			return -1;
+		}
+		if (depth == 0) {
+			// a compressed run stores a cluster in fewer blocks than it maps
+			int stored = ents[i].packed ? ents[i].packed : ents[i].len;
+			if (ents[i].len == 0 || ents[i].len > EXTENT_MAX_LEN
+					|| (ents[i].packed && (ents[i].packed >= ents[i].len || ents[i].len > CLUSTER_BLOCKS))
+					|| (int64_t) ents[i].lblock + ents[i].len > hi
+					|| !valid_blocks(ents[i].pblock, stored)) {
+				return -1;
+			}
+			claim(inum, ents[i].pblock, stored, 1);
+			lo = (int64_t) ents[i].lblock + ents[i].len;
+			continue;
+		}
+		int64_t next = i + 1 < hdr->entries ? ents[i + 1].lblock : hi;
+		if (!valid_blocks(ents[i].pblock, 1) || next <= ents[i].lblock || next > hi) {
+			return -1;
+		}
+		claim(inum, ents[i].pblock, 1, 0);
+		if (check_node(inum, get_block_at(ents[i].pblock), NODE_MAX, depth - 1,
+				ents[i].lblock, next) != 0) {
+			return -1;
+		}
+		lo = next;
+	}
+	return 0;
+}
+
+// Pass 1: check the mode and extent tree of every inode of a group marked in use.
+static void check_inodes(worker_t *w, int group) {
+	void *imap = get_inode_bitmap();
+	int end;
+	for (int inum = group_inodes(group, &end); inum < end; inum++) {
+		if (!bitmap_get(imap, inum)) {
+			continue;
+		}
+		if (state[inum] & NO_CHUNK) {
+			problem("inode %d: marked in use, but its chunk of the inode table is missing", inum);
+			continue;
+		}
+		inode_t *node = get_inode(inum);
+		int type = node->mode & S_IFMT;
+		if (type != S_IFREG && type != S_IFDIR) {
+			problem("inode %d: marked in use with mode %o", inum, node->mode);
+			continue;
+		}
+		mark(inum, IN_USE);
+		if (node->flags & INODE_INLINE) {
+			// inline directories aren't indexed, and their size isn't used
+			if (type == S_IFDIR ? (node->flags & INODE_DIR_INDEX) != 0
+					: node->size < 0 || node->size > INODE_INLINE_SIZE) {
+				problem("inode %d: inline data is corrupt", inum);
+				mark(inum, BAD_TREE);
+			}
+			continue;
+		}
+		extent_header_t *root = &node->extent_root;
+		if (root->depth > EXTENT_MAX_DEPTH
+				|| check_node(inum, root, INODE_EXTENTS, root->depth, 0, (int64_t) UINT32_MAX + 1) != 0) {
+			problem("inode %d: extent tree is corrupt", inum);
+			mark(inum, BAD_TREE);
+		}
+	}
+}
+
+// Return a pointer to the given logical block of a directory of size blocks, or null if
+// it is past the end or unmapped. Inline entries act as block 0.
+static void *dir_block(inode_t *dir, int blocks, uint32_t lblock) {
+	if (dir->flags & INODE_INLINE) {
+		return lblock == 0 ? dir->data : 0;
+	}
+	int block = lblock < blocks ? inode_get_block(dir, lblock, 0) : -1;
+	return block < 0 ? 0 : get_block_at(block);
+}
+
+// Check an index node of a directory of size blocks, with the given depth, and the
+// nodes and leaves under it.
+// returns 0 if it is valid, -1 if not.
+static int check_dx_node(inode_t *dir, int blocks, dx_header_t *node, int depth) {
+	if (node == 0 || node->magic != DX_MAGIC || node->depth != depth || node->limit != DX_LIMIT
+			|| node->count == 0 || node->count > node->limit) {
+		return -1;
+	}
+	dx_entry_t *entries = dx_entries(node);
+	for (int i = 0; i < node->count; i++) {
+		if (entries[i].lblock == 0 || (i > 0 && entries[i].hash < entries[i - 1].hash)) {
+			return -1;
+		}
+		void *child = dir_block(dir, blocks, entries[i].lblock);
+		if (depth > 0) {
+			if (check_dx_node(dir, blocks, child, depth - 1) != 0) {
+				return -1;
+			}
+		} else if (child == 0 || ((dx_header_t *) child)->magic == DX_MAGIC) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Check the index of a directory of size blocks.
+// returns 0 if it is valid, -1 if not.
+static int check_index(inode_t *dir, int blocks) {
+	dx_header_t *root = dir_block(dir, blocks, 0);
+	if (root == 0 || root->depth > 1) {
+		return -1;
+	}
+	return check_dx_node(dir, blocks, root, root->depth);
+}
+
+// Check whether the name of an entry is one that could have been created.
+static int valid_name(const char *name) {
+	int len = strnlen(name, DIR_NAME_LENGTH);
+	return len > 0 && len < DIR_NAME_LENGTH && strchr(name, '/') == 0
+		&& strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// Check whether an entry could name the given inode, as far as pass 1 knows.
+static int valid_target(int inum) {
+	return inum > 0 && inum < sb->inode_count && (state[inum] & IN_USE);
+}
+
+// What check_entry needs to know about the directory.
+typedef struct dir_check {
+	worker_t *worker;
+	int inum;
+	inode_t *node;
+	int lookups; // whether lookups through the index can be trusted
+} dir_check_t;
+
+// Check an entry of a directory, and count it as a link if it is valid.
+static int check_entry(void *arg, const char *name, int inum, int64_t next) {
+	dir_check_t *dc = arg;
+	if (!valid_name(name)) {
+		problem("directory %d: entry with a bad name", dc->inum);
+		mark(dc->inum, REBUILD);
+		return 0;
+	}
+	if (!valid_target(inum)) {
+		problem("directory %d: entry %s names bad inode %d", dc->inum, name, inum);
+		mark(dc->inum, REBUILD);
+		return 0;
+	}
+	// a lookup finds the first entry with the name, so this also finds duplicates
+	if (dc->lookups && find_file_in_dir(dc->node, name) != inum) {
+		problem("directory %d: entry %s can't be looked up", dc->inum, name);
+		mark(dc->inum, REBUILD);
+	}
+	worker_t *w = dc->worker;
+	if (w->edge_count == w->edge_cap) {
+		w->edge_cap = w->edge_cap ? w->edge_cap * 2 : 1024;
+		w->edges = realloc(w->edges, w->edge_cap * sizeof(edge_t));
+	}
+	w->edges[w->edge_count++] = (edge_t) { dc->inum, inum };
+	__atomic_add_fetch(&links[inum], 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// Pass 2: check the index and entries of every directory of a group.
+static void check_directories(worker_t *w, int group) {
+	int end;
+	for (int inum = group_inodes(group, &end); inum < end; inum++) {
+		if ((state[inum] & (IN_USE | BAD_TREE | SHARED)) != IN_USE) {
+			continue;
+		}
+		inode_t *node = get_inode(inum);
+		if (!S_ISDIR(node->mode)) {
+			continue;
+		}
+		dir_check_t dc = { w, inum, node, 1 };
+		int blocks = bytes_to_blocks(node->size);
+		if ((node->flags & INODE_DIR_INDEX) && check_index(node, blocks) != 0) {
+			problem("directory %d: index is corrupt", inum);
+			mark(inum, REBUILD);
+			dc.lookups = 0;
+		}
+		directory_iterate(inum, 0, check_entry, &dc);
+	}
+}
+
+// Mark every inode reachable from the root, following the links found in pass 2.
+static void walk_namespace() {
+	int count = sb->inode_count;
+	if (!(state[0] & IN_USE) || !S_ISDIR(get_inode(0)->mode)) {
+		problem("inode 0: the root directory is missing");
+	}
+	// gather each directory's links together
+	int *first = calloc(count + 1, sizeof(int));
+	int total = 0;
+	for (int i = 0; i < thread_count; i++) {
+		for (int e = 0; e < workers[i].edge_count; e++) {
+			first[workers[i].edges[e].dir + 1]++;
+		}
+		total += workers[i].edge_count;
+	}
+	for (int d = 0; d < count; d++) {
+		first[d + 1] += first[d];
+	}
+	int *children = malloc((total + 1) * sizeof(int));
+	int *fill = malloc(count * sizeof(int));
+	memcpy(fill, first, count * sizeof(int));
+	for (int i = 0; i < thread_count; i++) {
+		for (int e = 0; e < workers[i].edge_count; e++) {
+			children[fill[workers[i].edges[e].dir]++] = workers[i].edges[e].inum;
+		}
+	}
+
+	int *queue = fill;
+	int head = 0;
+	int tail = 0;
+	mark(0, REACHED);
+	queue[tail++] = 0;
+	while (head < tail) {
+		int dir = queue[head++];
+		for (int c = first[dir]; c < first[dir + 1]; c++) {
+			if (!(mark(children[c], REACHED) & REACHED)) {
+				queue[tail++] = children[c];
+			}
+		}
+	}
+	free(first);
+	free(children);
+	free(queue);
+}
+
+// Make an inode an empty file or directory, leaving the blocks it had for pass 3 to free.
+static void reset_inode(int inum, int mode) {
+	inode_t *node = get_inode(inum);
+	journal_dirty(node, sizeof(inode_t));
+	node->mode = mode;
+	node->size = 0;
+	node->flags = INODE_INLINE;
+	memset(node->data, 0, INODE_INLINE_SIZE);
+}
+
+// Put an entry in a directory without counting it in the inode's references, which
+// pass 4 checks anyway.
+static void link_quietly(int dir, const char *name, int inum) {
+	if (directory_put(dir, name, inum) >= 0) {
+		get_inode(inum)->refs--;
+	}
+}
+
+// Rewrite a directory from its valid entries, dropping the others and building a new index.
+static void rebuild_directory(int inum) {
+	inode_t *node = get_inode(inum);
+	int is_inline = node->flags & INODE_INLINE;
+	int blocks = is_inline ? 1 : bytes_to_blocks(node->size);
+	int per_block = is_inline ? DIR_INLINE_ENTRIES : BLOCK_SIZE / sizeof(direntry_t);
+	direntry_t *saved = malloc((size_t) blocks * BLOCK_SIZE);
+	int count = 0;
+	for (int lblock = 0; lblock < blocks; lblock++) {
+		direntry_t *contents = dir_block(node, blocks, lblock);
+		if (contents == 0 || ((dx_header_t *) contents)->magic == DX_MAGIC) {
+			continue;
+		}
+		for (int i = 0; i < per_block; i++) {
+			if (contents[i].inum != 0 && valid_name(contents[i].name) && valid_target(contents[i].inum)) {
+				saved[count++] = contents[i];
+			}
+		}
+	}
+	shrink_inode(node, 0);
+	journal_dirty(node, sizeof(inode_t));
+	node->flags &= ~INODE_DIR_INDEX;
+	for (int i = 0; i < count; i++) {
+		// a name seen twice keeps its first entry
+		if (find_file_in_dir(node, saved[i].name) < 0) {
+			link_quietly(inum, saved[i].name, saved[i].inum);
+		}
+	}
+	free(saved);
+}
+
+// Return /lost+found, making it if needed.
+static int lost_found() {
+	inode_t *root = get_inode(0);
+	int inum = find_file_in_dir(root, LOST_FOUND);
+	if (inum >= 0) {
+		return S_ISDIR(get_inode(inum)->mode) ? inum : -1;
+	}
+	inum = alloc_inode(0, 040775);
+	if (inum >= 0) {
+		directory_put(0, LOST_FOUND, inum);
+	}
+	return inum;
+}
+
+// Link an inode that can't be reached into /lost+found, named after its index.
+static void reconnect(int inum) {
+	problem("inode %d: not reachable from the root, moved to /%s", inum, LOST_FOUND);
+	char name[DIR_NAME_LENGTH];
+	snprintf(name, sizeof(name), "#%d", inum);
+	int dir = lost_found();
+	if (dir < 0) {
+		return;
+	}
+	link_quietly(dir, name, inum);
+}
+
+// Make the repairs to the namespace that passes 1 and 2 found to be needed. Orphans are
+// only reconnected once nothing else needs repairing, since the other repairs can
+// orphan more inodes.
+// returns whether any were made.
+static int repair_namespace() {
+	int count = sb->inode_count;
+	void *imap = get_inode_bitmap();
+	int changed = 0;
+	journal_begin();
+	uint32_t *map = get_inode_map();
+	for (int c = 0; c < count / INODE_CHUNK; c++) {
+		if (map[c] != 0 && (state[c * INODE_CHUNK] & NO_CHUNK)) {
+			// the inodes in a bad chunk are lost, and are freed below
+			journal_dirty(&map[c], sizeof(uint32_t));
+			map[c] = 0;
+			changed = 1;
+		}
+	}
+	if (!(state[0] & IN_USE) || !S_ISDIR(get_inode(0)->mode)) {
+		// whatever the root held will turn up in /lost+found
+		pthread_mutex_lock(&get_group(0)->inode_lock);
+		int rv = alloc_inode_chunk(0);
+		pthread_mutex_unlock(&get_group(0)->inode_lock);
+		if (rv != 0) {
+			journal_end();
+			return changed;
+		}
+		bitmap_put(imap, 0, 1);
+		journal_dirty_bits(imap, 0, 1);
+		reset_inode(0, 040775);
+		changed = 1;
+	}
+	for (int inum = 1; inum < count; inum++) {
+		if (bitmap_get(imap, inum) && !(state[inum] & IN_USE)) {
+			// pass 1 found its mode to be bad, or its chunk to be missing
+			if (!(state[inum] & NO_CHUNK)) {
+				inode_t *node = get_inode(inum);
+				journal_dirty(node, sizeof(inode_t));
+				memset(node, 0, sizeof(inode_t));
+			}
+			bitmap_put(imap, inum, 0);
+			journal_dirty_bits(imap, inum, 1);
+			changed = 1;
+		}
+	}
+	for (int inum = 0; inum < count; inum++) {
+		if ((state[inum] & IN_USE) && (state[inum] & (BAD_TREE | SHARED))) {
+			reset_inode(inum, get_inode(inum)->mode);
+			changed = 1;
+		}
+	}
+	for (int inum = 0; inum < count; inum++) {
+		if (state[inum] & REBUILD) {
+			rebuild_directory(inum);
+			changed = 1;
+		}
+	}
+	if (!changed) {
+		// an orphan that other orphans link to is reconnected along with them
+		for (int inum = 1; inum < count; inum++) {
+			if ((state[inum] & (IN_USE | REACHED)) == IN_USE && links[inum] == 0) {
+				reconnect(inum);
+				changed = 1;
+			}
+		}
+	}
+	for (int inum = 1; inum < count && !changed; inum++) {
+		// only cycles of orphans are left, so break one
+		if ((state[inum] & (IN_USE | REACHED)) == IN_USE) {
+			reconnect(inum);
+			changed = 1;
+		}
+	}
+	journal_end();
+	return changed;
+}
+
+// Report the blocks in [start, end) found to be marked wrongly, as a range.
+static void report_blocks(int start, int end, int used) {
+	if (end - start == 1) {
+		problem("block %d: %s", start, used ? "in use but marked free" : "marked in use but unused");
+	} else {
+		problem("blocks %d-%d: %s", start, end - 1,
+			used ? "in use but marked free" : "marked in use but unused");
+	}
+}
+
+// Pass 3: compare a group's part of the block bitmap with the blocks claimed.
+static void check_block_bitmap(worker_t *w, int group) {
+	void *bbm = get_blocks_bitmap();
+	if (repair) {
+		journal_begin();
+	}
+	int end;
+	int first = group_blocks(group, &end);
+	int run = -1;
+	int run_used = 0;
+	for (int b = first; b <= end; b++) {
+		int used = b < end && (b < sb->data_start || owner[b] != 0);
+		int wrong = b < end && used != bitmap_get(bbm, b);
+		if (run >= 0 && (!wrong || used != run_used)) {
+			report_blocks(run, b, run_used);
+			if (repair) {
+				bitmap_put_range(bbm, run, b - run, run_used);
+				journal_dirty_bits(bbm, run, b - run);
+				// keep the descriptor in step, so pass 4 only reports what was wrong with it
+				int data = b - (run > (int) sb->data_start ? run : (int) sb->data_start);
+				if (data > 0) {
+					group_desc_t *desc = get_group_desc(group);
+					journal_dirty(desc, sizeof(group_desc_t));
+					desc->free_blocks += run_used ? -data : data;
+				}
+			}
+			run = -1;
+		}
+		if (wrong && run < 0) {
+			run = b;
+			run_used = used;
+		}
+	}
+	if (repair) {
+		journal_end();
+	}
+}
+
+// Pass 3, after the block bitmap: compare the reference counts of a group's blocks with
+// the extents found mapping them. Groups start on a chunk of the table, so no other
+// thread looks at the chunks of this one.
+static void check_refcounts(worker_t *w, int group) {
+	if (repair) {
+		journal_begin();
+	}
+	int end;
+	int first = group_blocks(group, &end);
+	for (int b = first; b < end; b++) {
+		int c = b / REFCOUNT_CHUNK;
+		uint32_t *counts = tables[c] != 0 ? get_block_at(tables[c]) : 0;
+		uint32_t count = counts != 0 ? counts[b % REFCOUNT_CHUNK] : 0;
+		uint32_t expected = maps[b] > 1 ? maps[b] - 1 : 0;
+		if (count == expected) {
+			continue;
+		}
+		problem("block %d: reference count is %u, should be %u", b, count, expected);
+		if (!repair) {
+			continue;
+		}
+		if (counts == 0) {
+			// the bitmap is right by now, so the table takes a block that is really free
+			if (refcount_reserve(b, 1) != 0) {
+				continue;
+			}
+			tables[c] = get_refcount_map()[c];
+			owner[tables[c]] = 1;
+			counts = get_block_at(tables[c]);
+		}
+		journal_dirty(&counts[b % REFCOUNT_CHUNK], sizeof(uint32_t));
+		counts[b % REFCOUNT_CHUNK] = expected;
+	}
+	if (repair) {
+		journal_end();
+	}
+}
+
+// Pass 4: compare a group's inodes and descriptor with what was found.
+static void check_group(worker_t *w, int group) {
+	void *bbm = get_blocks_bitmap();
+	void *imap = get_inode_bitmap();
+	if (repair) {
+		journal_begin();
+	}
+
+	int end;
+	uint32_t free_inodes = 0;
+	uint32_t dirs = 0;
+	int inum = group_inodes(group, &end);
+	for (; inum < end; inum++) {
+		if (!bitmap_get(imap, inum)) {
+			free_inodes++;
+			continue;
+		}
+		if (!(state[inum] & IN_USE)) {
+			// pass 1 reported its mode or its chunk
+			continue;
+		}
+		inode_t *node = get_inode(inum);
+		dirs += S_ISDIR(node->mode) != 0;
+		if (!(state[inum] & REACHED)) {
+			problem("inode %d: not reachable from the root", inum);
+			continue;
+		}
+		// the root is linked by the volume itself
+		int expected = links[inum] + (inum == 0);
+		if (node->refs != expected) {
+			problem("inode %d: ref count is %d, should be %d", inum, node->refs, expected);
+			if (repair) {
+				journal_dirty(node, sizeof(inode_t));
+				node->refs = expected;
+			}
+		}
+	}
+
+	group_desc_t *desc = get_group_desc(group);
+	int data_end;
+	int data_start = group_first_block(group);
+	group_blocks(group, &data_end);
+	uint32_t free_blocks = data_start < data_end ? data_end - data_start : 0;
+	for (int b = data_start; b < data_end; b++) {
+		free_blocks -= bitmap_get(bbm, b);
+	}
+	if (desc->free_blocks != free_blocks || desc->free_inodes != free_inodes || desc->dirs != dirs) {
+		problem("group %d: counts %u free blocks, %u free inodes, %u directories, should be %u, %u, %u",
+			group, desc->free_blocks, desc->free_inodes, desc->dirs, free_blocks, free_inodes, dirs);
+		if (repair) {
+			journal_dirty(desc, sizeof(group_desc_t));
+			desc->free_blocks = free_blocks;
+			desc->free_inodes = free_inodes;
+			desc->dirs = dirs;
+		}
+	}
+	if (repair) {
+		journal_end();
+	}
+}
+
+// Forget what the last round found.
+static void reset_state() {
+	memset(owner, 0, (size_t) sb->block_count * sizeof(int));
+	memset(maps, 0, (size_t) sb->block_count * sizeof(uint32_t));
+	memset(state, 0, sb->inode_count);
+	memset(links, 0, (size_t) sb->inode_count * sizeof(int));
+	for (int i = 0; i < thread_count; i++) {
+		workers[i].edge_count = 0;
+	}
+	problems = 0;
+}
+
+// Print the geometry of the volume and the state of each allocation group.
+static void print_summary() {
+	printf("%u blocks of %u bytes, %u inodes, version %u\n",
+		sb->block_count, sb->block_size, sb->inode_count, sb->version);
+	printf("group descriptors at %u (%u blocks), block bitmap at %u (%u), inode bitmap at %u (%u)\n",
+		sb->group_desc_start, sb->group_desc_blocks, sb->block_bitmap_start,
+		sb->block_bitmap_blocks, sb->inode_bitmap_start, sb->inode_bitmap_blocks);
+	printf("inode chunk index at %u (%u blocks), refcount index at %u (%u)\n",
+		sb->inode_map_start, sb->inode_map_blocks, sb->refcount_map_start, sb->refcount_map_blocks);
+	printf("journal at %u (%u blocks), data from %u\n",
+		sb->journal_start, sb->journal_blocks, sb->data_start);
+	printf("%5s %12s %12s %12s\n", "group", "free blocks", "free inodes", "directories");
+	for (int g = 0; g < sb->group_count; g++) {
+		group_desc_t *desc = get_group_desc(g);
+		printf("%5d %12u %12u %12u\n", g, desc->free_blocks, desc->free_inodes, desc->dirs);
+	}
+}
+
+static void usage() {
+	fprintf(stderr, "usage: fsck.nufs [-n|-y] [-j threads] [-s] image\n");
+	exit(EXIT_ERROR);
+}
+
+int main(int argc, char *argv[]) {
+	int summary = 0;
+	int opt;
+	thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "nyj:s")) != -1) {
+		switch (opt) {
+			case 'n':
+				repair = 0;
+				break;
+			case 'y':
+				repair = 1;
+				break;
+			case 'j':
+				thread_count = atoi(optarg);
+				break;
+			case 's':
+				summary = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1 || thread_count < 1) {
+		usage();
+	}
+	const char *image = argv[optind];
+	if (access(image, R_OK | W_OK) != 0) {
+		perror(image);
+		return EXIT_ERROR;
+	}
+	if (blocks_init(image) != 0) {
+		return EXIT_ERROR;
+	}
+	sb = get_superblock();
+	if (summary) {
+		print_summary();
+	}
+	dcache_clear();
+
+	if (thread_count > sb->group_count) {
+		thread_count = sb->group_count;
+	}
+	workers = calloc(thread_count, sizeof(worker_t));
+	owner = malloc((size_t) sb->block_count * sizeof(int));
+	maps = malloc((size_t) sb->block_count * sizeof(uint32_t));
+	tables = malloc((size_t) (sb->block_count + REFCOUNT_CHUNK - 1) / REFCOUNT_CHUNK * sizeof(uint32_t));
+	state = malloc(sb->inode_count);
+	links = malloc((size_t) sb->inode_count * sizeof(int));
+
+	for (int round = 1; ; round++) {
+		reset_state();
+		check_inode_map();
+		check_refcount_map();
+		for_each_group(check_inodes);
+		for_each_group(check_directories);
+		walk_namespace();
+		for_each_group(check_block_bitmap);
+		for_each_group(check_refcounts);
+		if (!repair || round == MAX_ROUNDS || !repair_namespace()) {
+			break;
+		}
+		fixed += problems;
+	}
+	for_each_group(check_group);
+	fixed += repair ? problems : 0;
+
+	int files = 0;
+	int dirs = 0;
+	for (int inum = 0; inum < sb->inode_count; inum++) {
+		if (!(state[inum] & IN_USE)) {
+			continue;
+		}
+		if (S_ISDIR(get_inode(inum)->mode)) {
+			dirs++;
+		} else {
+			files++;
+		}
+	}
+	int used = 0;
+	for (int g = 0; g < sb->group_count; g++) {
+		int end;
+		int first = group_first_block(g);
+		group_blocks(g, &end);
+		used += (first < end ? end - first : 0) - get_group_desc(g)->free_blocks;
+	}
+	printf("%s: %d files, %d directories, %d of %u data blocks used\n",
+		image, files, dirs, used, sb->block_count - sb->data_start);
+
+	for (int i = 0; i < thread_count; i++) {
+		free(workers[i].edges);
+	}
+	free(workers);
+	free(owner);
+	free(maps);
+	free(tables);
+	free(state);
+	free(links);
+	blocks_free();
+	if (fixed > 0) {
+		return EXIT_FIXED;
+	}
+	return problems > 0 ? EXIT_UNFIXED : EXIT_CLEAN;
+}
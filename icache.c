@@ -0,0 +1,91 @@
+/* In-core inodes, kept in a hash table while any thread is using them. */
+
+#include <stdlib.h>
+
+#include "icache.h"
+
+#define ICACHE_BUCKETS 1024 // must be a power of two
+
+static cinode_t *icache[ICACHE_BUCKETS];
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Return the in-core inode for the given inode index, creating it if needed.
+cinode_t *iget(int inum) {
+	cinode_t **bucket = &icache[inum & (ICACHE_BUCKETS - 1)];
+	pthread_mutex_lock(&icache_lock);
+	cinode_t *ci = *bucket;
+	while (ci != 0 && ci->inum != inum) {
+		ci = ci->next;
+	}
+	if (ci == 0) {
+		ci = malloc(sizeof(cinode_t));
+		ci->inum = inum;
+		ci->users = 0;
+		pthread_rwlock_init(&ci->lock, NULL);
+		ci->next = *bucket;
+		*bucket = ci;
+	}
+	ci->users++;
+	pthread_mutex_unlock(&icache_lock);
+	return ci;
+}
+
+// Drop a reference taken by iget, freeing the in-core inode once nobody uses it.
+void iput(cinode_t *ci) {
+	pthread_mutex_lock(&icache_lock);
+	if (--ci->users == 0) {
+		cinode_t **link = &icache[ci->inum & (ICACHE_BUCKETS - 1)];
+		while (*link != ci) {
+			link = &(*link)->next;
+		}
+		*link = ci->next;
+		pthread_rwlock_destroy(&ci->lock);
+		free(ci);
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+// Lock the inode with the given index for reading or writing.
+cinode_t *inode_lock(int inum, int write) {
+	cinode_t *ci = iget(inum);
+	if (write) {
+		pthread_rwlock_wrlock(&ci->lock);
+	} else {
+		pthread_rwlock_rdlock(&ci->lock);
+	}
+	return ci;
+}
+
+// Lock two inodes for writing. Nothing is held while waiting for either lock, so this can't
+// deadlock against callers that lock a directory and then its child.
+void inode_lock_pair(int inum_a, int inum_b, cinode_t **a, cinode_t **b) {
+	*a = iget(inum_a);
+	if (inum_a == inum_b) {
+		pthread_rwlock_wrlock(&(*a)->lock);
+		*b = 0;
+		return;
+	}
+	*b = iget(inum_b);
+	cinode_t *first = *a;
+	cinode_t *second = *b;
+	while (1) {
+		pthread_rwlock_wrlock(&first->lock);
+		if (pthread_rwlock_trywrlock(&second->lock) == 0) {
+			return;
+		}
+		// back off, then wait for the busy one first
+		pthread_rwlock_unlock(&first->lock);
+		cinode_t *tmp = first;
+		first = second;
+		second = tmp;
+	}
+}
+
+// Unlock an inode locked by inode_lock and drop its reference.
+void inode_unlock(cinode_t *ci) {
+	if (ci == 0) {
+		return;
+	}
+	pthread_rwlock_unlock(&ci->lock);
+	iput(ci);
+}
@@ -0,0 +1,32 @@
+/* In-core inodes: state kept in memory for inodes that are in use, such as their locks. */
+
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <pthread.h>
+
+typedef struct cinode {
+	int inum;
+	int users; // references from threads currently using the inode
+	pthread_rwlock_t lock; // guards the inode, its blocks, and (for directories) its entries
+	struct cinode *next;
+} cinode_t;
+
+// Return the in-core inode for the given inode index, creating it if needed.
+cinode_t *iget(int inum);
+
+// Drop a reference taken by iget.
+void iput(cinode_t *ci);
+
+// Lock the inode with the given index, for writing if write is set, otherwise for reading.
+// Returns the in-core inode to pass to inode_unlock.
+cinode_t *inode_lock(int inum, int write);
+
+// Lock two inodes for writing, backing off rather than waiting while holding either.
+// The second lock is skipped (and null returned in b) when both are the same inode.
+void inode_lock_pair(int inum_a, int inum_b, cinode_t **a, cinode_t **b);
+
+// Unlock an inode locked by inode_lock and drop its reference. Does nothing for null.
+void inode_unlock(cinode_t *ci);
+
+#endif
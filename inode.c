@@ -1,83 +1,380 @@
 /* Inode manipulation routines. */
 
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "backend.h"
 #include "bitmap.h"
+#include "compress.h"
 #include "inode.h" 
 #include "blocks.h"
+#include "journal.h"
+#include "refcount.h"
+#include "trace.h"
+#include "writeback.h"
 
 // Print out metadata about the file represented by the given inode.
 void print_inode(inode_t *node) {
 	printf("ref count %d\n", node->refs);
 	printf("mode: %d\n", node->mode);
-	printf("size (bytes): %d\n", node->size);
-	printf("block pointer initial position: %d\n", node->block_list);
+	printf("size (bytes): %ld\n", node->size);
+	if (node->flags & INODE_INLINE) {
+		printf("data stored inline\n");
+	} else {
+		printf("extent tree: %d entries, depth %d\n", node->extent_root.entries, node->extent_root.depth);
+	}
 }
 
+// What the inodes of chunks that aren't allocated read as.
+static const char empty_chunk[INODE_CHUNK * INODE_SIZE];
+
 // Return the inode at the given index.
 inode_t *get_inode(int index) {
-	return get_inode_table() + (index * sizeof(inode_t));
+	uint32_t block = get_inode_map()[index / INODE_CHUNK];
+	void *chunk = block != 0 ? get_block_at(block) : (void *) empty_chunk;
+	return chunk + (size_t) (index % INODE_CHUNK) * INODE_SIZE;
+}
+
+// Allocate the chunk of the inode table holding the given inode, if it has none.
+// returns 0 on success, -1 if the disk is full.
+int alloc_inode_chunk(int index) {
+	uint32_t *entry = &get_inode_map()[index / INODE_CHUNK];
+	if (*entry != 0) {
+		return 0;
+	}
+	int got;
+	int block = alloc_blocks(group_first_block(inode_group(index)), 1, &got);
+	if (block < 0) {
+		return -1;
+	}
+	void *chunk = get_block_at(block);
+	journal_dirty(chunk, BLOCK_SIZE);
+	memset(chunk, 0, BLOCK_SIZE);
+	journal_dirty(entry, sizeof(uint32_t));
+	*entry = block;
+	group_t *grp = get_group(inode_group(index));
+	int chunk_end = (index / INODE_CHUNK + 1) * INODE_CHUNK;
+	if (grp->inode_frontier < chunk_end) {
+		grp->inode_frontier = chunk_end;
+	}
+	return 0;
+}
+
+// Pick the allocation group for a new inode under directory parent.
+// Files go in their directory's group, so a directory's files stay close together.
+// Directories spread out to the group with the fewest directories among those with
+// at least the average free space, so different directories fill different groups.
+static int pick_group(int parent, int mode) {
+	if (parent < 0) {
+		return 0;
+	}
+	int home = inode_group(parent);
+	if (!S_ISDIR(mode)) {
+		return home;
+	}
+	int group_count = get_superblock()->group_count;
+	int64_t total = 0;
+	for (int g = 0; g < group_count; g++) {
+		total += __atomic_load_n(&get_group_desc(g)->free_blocks, __ATOMIC_RELAXED);
+	}
+	int64_t average = total / group_count;
+	int best = home;
+	uint32_t best_dirs = UINT32_MAX;
+	for (int i = 0; i < group_count; i++) {
+		int g = (home + i) % group_count;
+		group_desc_t *desc = get_group_desc(g);
+		uint32_t dirs = __atomic_load_n(&desc->dirs, __ATOMIC_RELAXED);
+		if (__atomic_load_n(&desc->free_inodes, __ATOMIC_RELAXED) > 0
+				&& __atomic_load_n(&desc->free_blocks, __ATOMIC_RELAXED) >= average
+				&& dirs < best_dirs) {
+			best = g;
+			best_dirs = dirs;
+		}
+	}
+	return best;
 }
 
-// Allocate an inode and return its index, or -1 if unable to allocate the inode.
-int alloc_inode() {
+// Allocate a free inode from the given group.
+// returns its index, or -1 if the group is full.
+static int group_alloc_inode(int group) {
+	group_desc_t *desc = get_group_desc(group);
+	if (__atomic_load_n(&desc->free_inodes, __ATOMIC_RELAXED) == 0) {
+		return -1;
+	}
 	void* i_map = get_inode_bitmap();
-	for (int i = 0; i < INODE_COUNT; i++) {
-		if (bitmap_get(i_map, i) == 0) {
-			bitmap_put(i_map, i, 1);
-			printf("+ alloc_inode() -> %d\n", i);
-			return i;
+	int per_group = get_superblock()->inodes_per_group;
+	int first = group * per_group;
+	int end = first + per_group;
+	group_t *grp = get_group(group);
+	pthread_mutex_lock(&grp->inode_lock);
+	int frontier = grp->inode_frontier;
+	int i = -1;
+	// every inode past the frontier is free, so this says whether any before it are
+	if (__atomic_load_n(&desc->free_inodes, __ATOMIC_RELAXED) > end - frontier) {
+		// next fit among the allocated chunks, starting after the last inode allocated
+		int start = grp->inode_hint >= first && grp->inode_hint < frontier ? grp->inode_hint : first;
+		i = bitmap_find_zero(i_map, start, frontier);
+		if (i < 0) {
+			i = bitmap_find_zero(i_map, first, start);
 		}
+	} else if (frontier < end) {
+		// they are all in use, so the table grows by a chunk
+		i = frontier;
+	}
+	if (i >= 0 && alloc_inode_chunk(i) != 0) {
+		i = -1;
+	}
+	if (i >= 0) {
+		bitmap_put(i_map, i, 1);
+		journal_dirty_bits(i_map, i, 1);
+		grp->inode_hint = i + 1;
+		__atomic_sub_fetch(&desc->free_inodes, 1, __ATOMIC_RELAXED);
+		journal_dirty(desc, sizeof(group_desc_t));
+	}
+	pthread_mutex_unlock(&grp->inode_lock);
+	return i;
+}
+
+// Allocate an inode with the given mode for a new object under directory parent
+// (-1 for the root), and return its index, or -1 if unable to allocate the inode.
+int alloc_inode(int parent, int mode) {
+	int group_count = get_superblock()->group_count;
+	int home = pick_group(parent, mode);
+	int i = -1;
+	for (int g = 0; i < 0 && g < group_count; g++) {
+		i = group_alloc_inode((home + g) % group_count);
+	}
+	if (i < 0) {
+		printf("Unable to allocate inode");
+		return -1;
+	}
+	if (S_ISDIR(mode)) {
+		__atomic_add_fetch(&get_group_desc(inode_group(i))->dirs, 1, __ATOMIC_RELAXED);
 	}
-	printf("Unable to allocate inode");
-	return -1;
+	// start out empty, with the data inline until it outgrows the inode
+	inode_t *node = get_inode(i);
+	journal_dirty(node, sizeof(inode_t));
+	memset(node, 0, sizeof(inode_t));
+	node->mode = mode;
+	node->flags = INODE_INLINE;
+	trace_count(STAT_INODES_ALLOCATED, 1);
+	return i;
 }
 
 // Free the inode at the given index.
 void free_inode(int index) {
 	inode_t *inode = get_inode(index);
 	void* i_map = get_inode_bitmap();
-	// find which blocks we need to free
-	blist_t* blocks_to_free = get_blist_at(inode->block_list);
-	while (blocks_to_free != 0) {
-		free_block(blocks_to_free->block);
-		blocks_to_free->block = 0;
-		if (blocks_to_free->next == 0) {
-			break;
-		}
-		blocks_to_free = get_blist_at(blocks_to_free->next);
+	journal_dirty(inode, sizeof(inode_t));
+	// free all the blocks connected
+	if (!(inode->flags & INODE_INLINE)) {
+		extent_free_all(inode);
+	}
+	int group = inode_group(index);
+	group_desc_t *desc = get_group_desc(group);
+	if (S_ISDIR(inode->mode)) {
+		__atomic_sub_fetch(&desc->dirs, 1, __ATOMIC_RELAXED);
 	}
+	inode->refs--; // decrement reference counter, before the inode can be reallocated
+	pthread_mutex_lock(&get_group(group)->inode_lock);
 	bitmap_put(i_map, index, 0); // set inode to free
-	inode->refs--; // decrement reference counter
+	journal_dirty_bits(i_map, index, 1);
+	__atomic_add_fetch(&desc->free_inodes, 1, __ATOMIC_RELAXED);
+	journal_dirty(desc, sizeof(group_desc_t));
+	pthread_mutex_unlock(&get_group(group)->inode_lock);
+	trace_count(STAT_INODES_FREED, 1);
 }
 
-// Grow the given inode to the given size in bytes.
-// returns 0 on success.
-int grow_inode(inode_t *node, int size) {
-	blist_t *blocks = get_blist_at(node->block_list);
-	int i = 1;
-	while (i * BLOCK_SIZE < size) {
-		if (blocks->next == 0) {
-			blocks->next = alloc_blist();
+// Return the block to allocate near when the inode has no data to follow:
+// the start of the inode's own allocation group.
+int inode_goal(inode_t *node) {
+	int chunk = ((void *) node - get_block_at(0)) / BLOCK_SIZE;
+	return group_first_block(block_group(chunk));
+}
+
+// Return the physical block holding the given block of the inode.
+// returns -1 if it is unmapped and can't (or shouldn't) be allocated.
+int inode_get_block(inode_t *node, int lblock, int alloc) {
+	if (node->flags & INODE_INLINE) {
+		return -1;
+	}
+	int block = extent_lookup(node, lblock, NULL);
+	if (block >= 0 || !alloc) {
+		return block;
+	}
+	int got;
+	// placing the block right after the previous one keeps the file in one extent
+	block = alloc_blocks(extent_goal(node, lblock), 1, &got);
+	if (block < 0) {
+		return -1;
+	}
+	if (extent_insert(node, lblock, block, 1) != 0) {
+		free_block(block);
+		return -1;
+	}
+	// only directories map blocks this way, so the new block is metadata
+	journal_dirty(get_block_at(block), BLOCK_SIZE);
+	memset(get_block_at(block), 0, BLOCK_SIZE);
+	return block;
+}
+
+// Move the data of an inode stored inline out to a block.
+// returns 0 on success, -1 if the disk is full.
+int inode_expand(inode_t *node) {
+	if (!(node->flags & INODE_INLINE)) {
+		return 0;
+	}
+	int is_dir = S_ISDIR(node->mode);
+	int block = -1;
+	// a directory only expands to make room for more entries, so it always needs the block
+	if (is_dir || node->size > 0) {
+		int got;
+		block = alloc_blocks(inode_goal(node), 1, &got);
+		if (block < 0) {
+			return -1;
+		}
+	}
+	char data[INODE_INLINE_SIZE];
+	memcpy(data, node->data, INODE_INLINE_SIZE);
+	journal_dirty(node, sizeof(inode_t));
+	node->flags &= ~INODE_INLINE;
+	extent_init(node);
+	if (block < 0) {
+		return 0;
+	}
+	// an empty root always has room, so this can't fail
+	extent_insert(node, 0, block, 1);
+	if (is_dir) {
+		void *contents = get_block_at(block);
+		journal_dirty(contents, BLOCK_SIZE);
+		memset(contents, 0, BLOCK_SIZE);
+		memcpy(contents, data, INODE_INLINE_SIZE);
+		node->size = BLOCK_SIZE;
+	} else {
+		char contents[BLOCK_SIZE];
+		memcpy(contents, data, node->size);
+		memset(contents + node->size, 0, BLOCK_SIZE - node->size);
+		data_io_t io = { (int64_t) block * BLOCK_SIZE, contents, BLOCK_SIZE };
+		// the inline data was journaled, so its new home must be durable before the
+		// journal commits the mapping to it
+		if (data_write(&io, 1) != 0 || data_sync(block, 1) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Give the inode its own copy of the blocks it shares with other files among count blocks
+// starting at lblock, so they can be changed.
+// returns 0 on success, -1 if the disk is full.
+int inode_unshare(inode_t *node, int lblock, int count) {
+	if (node->flags & INODE_INLINE) {
+		return 0;
+	}
+	int64_t end = (int64_t) lblock + count;
+	while (lblock < end) {
+		int mapped;
+		int pblock = extent_lookup(node, lblock, &mapped);
+		int n = mapped < end - lblock ? mapped : end - lblock;
+		if (pblock < 0) {
+			lblock += n;
+			continue;
+		}
+		int plain = refcount_run(pblock, n, 0);
+		if (plain > 0) {
+			lblock += plain;
+			continue;
+		}
+		n = refcount_run(pblock, n, 1);
+		int got;
+		int copy = alloc_blocks(extent_goal(node, lblock), n, &got);
+		if (copy < 0) {
+			return -1;
+		}
+		// the copy must be durable before the journal commits the remapping, as the shared
+		// blocks already were
+		if (data_copy(copy, pblock, got) != 0 || data_sync(copy, got) != 0) {
+			free_blocks(copy, got);
+			return -1;
 		}
-		blocks = get_blist_at(blocks->next);
-		i++;
+		// an extra reference keeps the shared blocks while they are unmapped, even if the
+		// other files drop theirs meanwhile
+		refcount_share(pblock, got);
+		if (extent_remove(node, lblock, got) != 0) {
+			free_blocks(pblock, got);
+			free_blocks(copy, got);
+			return -1;
+		}
+		if (extent_insert(node, lblock, copy, got) != 0) {
+			// mapped back, the shared blocks rejoin the extent they were cut from
+			if (extent_insert(node, lblock, pblock, got) != 0) {
+				free_blocks(pblock, got);
+			}
+			free_blocks(copy, got);
+			return -1;
+		}
+		free_blocks(pblock, got);
+		lblock += got;
+	}
+	return 0;
+}
+
+// Grow the given inode to the given size in bytes.
+// The new blocks are left unmapped, as a hole that reads as zeros until it is written.
+// returns 0 on success, -1 on fail.
+int grow_inode(inode_t *node, int64_t size) {
+	if ((node->flags & INODE_INLINE) && size > INODE_INLINE_SIZE && inode_expand(node) != 0) {
+		return -1;
 	}
+	// the bytes past the old size are already zeros, in the inode or in its last block
+	journal_dirty(node, sizeof(inode_t));
 	node->size = size;
 	return 0;
 }
 
 // Shrink the given inode to the given size.
-// returns 0 on success.
-int shrink_inode(inode_t *node, int size) {
-	blist_t *blocks = get_blist_at(node->block_list);
-        int i = 1;
-        while (i * (node->size) > size) {
-                if (blocks->next != 0) {
-			free_block(blocks->next);
-                }
-                blocks = get_blist_at(blocks->next);
-		node->size -= BLOCK_SIZE;
-                i++;
-        }
-        node->size = size;
-        return 0;
+// returns 0 on success, -1 on fail.
+int shrink_inode(inode_t *node, int64_t size) {
+	if (node->flags & INODE_INLINE) {
+		journal_dirty(node, sizeof(inode_t));
+		memset(node->data + size, 0, INODE_INLINE_SIZE - size);
+		node->size = size;
+		return 0;
+	}
+	int blocks = bytes_to_blocks(size);
+	// blocks allocated past the end of the file go too
+	int rv = compress_split(node, blocks);
+	if (rv == 0) {
+		rv = extent_remove(node, blocks, INT_MAX - blocks);
+	}
+	if (rv != 0) {
+		return rv;
+	}
+	if (size == 0 && node->extent_root.entries == 0) {
+		// a file truncated to be rewritten starts out small again
+		journal_dirty(node, sizeof(inode_t));
+		memset(node->data, 0, INODE_INLINE_SIZE);
+		node->flags = (node->flags & ~INODE_PREALLOC) | INODE_INLINE;
+		node->size = 0;
+		return 0;
+	}
+	// clear the rest of the last block, so growing the file again exposes zeros
+	int tail = size % BLOCK_SIZE;
+	if (tail && (compress_unpack(node, size / BLOCK_SIZE, 1) != 0
+			|| inode_unshare(node, size / BLOCK_SIZE, 1) != 0)) {
+		return -1;
+	}
+	int block = tail ? inode_get_block(node, size / BLOCK_SIZE, 0) : -1;
+	if (block >= 0) {
+		if (data_zero((int64_t) block * BLOCK_SIZE + tail, BLOCK_SIZE - tail) != 0) {
+			return -1;
+		}
+		writeback_dirty(block, 1);
+	}
+	journal_dirty(node, sizeof(inode_t));
+	node->flags &= ~INODE_PREALLOC;
+	node->size = size;
+	return 0;
 }
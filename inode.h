@@ -3,32 +3,93 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <stdint.h>
+
 #include "blocks.h"
-#include "blist.h"
+#include "extent.h"
+
+#define INODE_SIZE 256 // bytes each inode takes in the inode table
+#define INODE_CHUNK 16  // inodes in each chunk of the inode table, a block's worth
+#define INODE_INLINE_SIZE 224 // bytes of data an inode can hold itself, in place of its extent tree
+// extents that fit inline in the inode before the tree needs blocks
+#define INODE_EXTENTS ((INODE_INLINE_SIZE - (int) sizeof(extent_header_t)) / (int) sizeof(extent_t))
+
+// Inode flags.
+#define INODE_DIR_INDEX 0x1 // the directory's entries are reached through a hashed index
+#define INODE_INLINE 0x2    // the data is stored in the inode itself rather than in blocks
+#define INODE_PREALLOC 0x4  // blocks past the end were allocated with fallocate, so they are kept
+#define INODE_COMPRESS 0x8  // the data is compressed once written (see compress.h)
 
+// An inode starts out with its data inline, which small files and directories never outgrow.
+// Once the data doesn't fit, it moves to a block and the same space holds the extent tree.
 typedef struct inode {
 	int refs;  // reference count
 	int mode;  // permission & type
-	int size;  // bytes
-	int block_list; // blocks connected
+	int64_t size;  // bytes
+	uint32_t flags;
+	uint32_t compress_from; // clusters [from, to) were written since the file was last compressed
+	uint32_t compress_to;
+	uint32_t _reserved;
+	union {
+		struct {
+			extent_header_t extent_root; // root of the tree mapping the blocks connected
+			extent_t extents[INODE_EXTENTS]; // entries of the root node
+		};
+		char data[INODE_INLINE_SIZE]; // the data itself, with INODE_INLINE; zero past the size
+	};
 } inode_t;
 
 // Prints out metadata about the file represented by a given inode.
 void print_inode(inode_t *node);
 
+// The inode table isn't laid out up front: it is allocated a chunk at a time as inodes
+// are, and a chunk index in the superblock's metadata maps each chunk to its block.
+// Each group allocates its chunks in order, so inodes past its frontier (see group_t)
+// have no chunk yet. A chunk is kept once allocated, even after its inodes are freed.
+
 // Return the inode at the given index.
+// Reading or changing an inode and its blocks requires its lock from icache.h.
+// The inodes of a chunk that isn't allocated read as zeros, and must not be changed.
 inode_t *get_inode(int index);
 
-// Allocate an inode and return its index, or -1 if unable to allocate the inode.
-int alloc_inode();
+// Allocate the chunk of the inode table holding the given inode, if it has none, near
+// the start of the inode's group. The caller must hold the group's inode lock.
+// Returns 0 on success, -1 if the disk is full.
+int alloc_inode_chunk(int index);
+
+// Allocate an inode with the given mode for a new object under directory parent
+// (-1 for the root), and return its index, or -1 if unable to allocate the inode.
+// Files are placed in their directory's allocation group, and directories in a lightly used group.
+int alloc_inode(int parent, int mode);
 
-// Free the inode at the given index.
+// Free the inode at the given index. The caller must hold its write lock (see icache.h).
 void free_inode(int index);
 
-// Grow the given inode to the given size in bytes.
-int grow_inode(inode_t *node, int size);
+// Return the block to allocate near when the inode has no data to follow:
+// the start of the allocation group holding the inode's chunk, normally its own group.
+int inode_goal(inode_t *node);
+
+// Return the physical block holding the given block of the inode.
+// If it is unmapped, a zeroed block is allocated when alloc is set, otherwise -1 is returned.
+// Allocated blocks are treated as metadata, since only directories map blocks this way.
+// An inode with its data inline has no blocks, so this returns -1 for it.
+int inode_get_block(inode_t *node, int lblock, int alloc);
+
+// Move the data of an inode stored inline out to a block, so it can map blocks instead.
+// A directory's inline entries always move, filling the start of its first block.
+// Returns 0 on success (or if the data isn't inline), -1 if the disk is full.
+int inode_expand(inode_t *node);
+
+// Give the inode its own copy of any of count blocks starting at lblock that it shares with
+// other files (see refcount.h), before they are changed.
+// Returns 0 on success, -1 if the disk is full.
+int inode_unshare(inode_t *node, int lblock, int count);
+
+// Grow the given inode to the given size in bytes, without allocating blocks for it:
+// the file gets a hole at its end. Returns 0 on success, -1 if the disk is full.
+int grow_inode(inode_t *node, int64_t size);
 
-// Shrink the given inode to the given size.
-int shrink_inode(inode_t *node, int size);
+// Shrink the given inode to the given size. Shrinking it to nothing stores it inline again.
+int shrink_inode(inode_t *node, int64_t size);
 
 #endif
@@ -0,0 +1,52 @@
+/* The ioctls nufs answers on its files, for programs using them to include. */
+
+#ifndef IOCTL_H
+#define IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// FUSE 2.9 doesn't pass lseek on to the filesystem, so lseek sees a file as all data.
+// These do what SEEK_DATA and SEEK_HOLE would: the argument is the offset to search from,
+// and is replaced with the offset found. They fail with ENXIO where lseek would.
+#define NUFS_IOC_SEEK_DATA _IOWR('N', 1, int64_t)
+#define NUFS_IOC_SEEK_HOLE _IOWR('N', 2, int64_t)
+
+#define NUFS_CLONE_PATH_MAX 1024
+
+// The argument of NUFS_IOC_CLONE_RANGE. A file descriptor means nothing to the filesystem's
+// own process, so the source is named by its path from the root of the mount instead.
+typedef struct nufs_clone_range {
+	int64_t src_offset;
+	int64_t src_length; // 0 for everything up to the end of the source
+	int64_t dest_offset;
+	char src_path[NUFS_CLONE_PATH_MAX];
+} nufs_clone_range_t;
+
+// Make a range of the file the ioctl is made on share the blocks of a range of the source,
+// as FICLONERANGE does (FICLONE and FICLONERANGE themselves never reach a FUSE filesystem).
+// Whichever file changes a shared block first gets a copy of its own.
+// The offsets must be multiples of 4096, as must the length unless the range ends at the
+// end of the source and the destination range reaches the end of the destination.
+#define NUFS_IOC_CLONE_RANGE _IOW('N', 3, nufs_clone_range_t)
+
+#define NUFS_DEDUPE_SAME 0
+#define NUFS_DEDUPE_DIFFERS 1
+
+// The argument of NUFS_IOC_DEDUPE_RANGE, with the source named as for NUFS_IOC_CLONE_RANGE.
+typedef struct nufs_dedupe_range {
+	int64_t src_offset;
+	int64_t length;
+	int64_t dest_offset;
+	int64_t bytes_deduped; // set to the bytes of the blocks freed, which the destination had to itself
+	int32_t status; // set to NUFS_DEDUPE_SAME or NUFS_DEDUPE_DIFFERS
+	int32_t _reserved;
+	char src_path[NUFS_CLONE_PATH_MAX];
+} nufs_dedupe_range_t;
+
+// Clone a range of the source into the file the ioctl is made on as NUFS_IOC_CLONE_RANGE
+// does, but only if the two ranges hold the same data, as FIDEDUPERANGE does. Both ranges
+// must lie within their files, and the offsets and length are as for NUFS_IOC_CLONE_RANGE.
+#define NUFS_IOC_DEDUPE_RANGE _IOWR('N', 4, nufs_dedupe_range_t)
+
+#endif
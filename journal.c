@@ -0,0 +1,598 @@
+/* The metadata journal.
+ * The journal region is a circular log of transactions. A transaction's blocks are written
+ * home right after it commits, and those writes become durable at the next flush, so only
+ * the last couple of transactions ever need replaying. */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "journal.h"
+#include "trace.h"
+
+static pthread_rwlock_t txn_lock; // held for reading by operations, for writing while a commit snapshots
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER; // guards the running transaction
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; // one commit at a time
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER; // wakes up the commit thread
+static pthread_t thread;
+static int running = 0;
+
+// the running transaction
+static uint8_t *dirty_bits = 0; // blocks changed by the running transaction
+static int *dirty = 0; // the blocks, in the order they were first changed
+static int dirty_count = 0;
+static int dirty_cap = 0;
+static journal_revoke_t *revokes = 0;
+static int revoke_count = 0;
+static int revoke_cap = 0;
+static uint8_t *revoked_bits = 0; // blocks freed since the last commit's snapshot
+static int64_t freeing = 0; // blocks freed that no durable commit has made free yet
+
+// the last commit, whose private copies can be dropped once it is written home
+static int *written = 0;
+static int written_count = 0;
+
+static uint64_t next_seq = 1;
+static uint64_t durable_seq = 0; // last transaction fully written home and flushed
+static uint64_t home_seq = 0;    // last transaction written home, maybe not flushed yet
+static int log_pos = 0;   // where the next transaction goes, relative to the journal
+static int last_pos = 0;  // where the last transaction is
+static int last_len = 0;
+
+static uint32_t crc_table[256];
+
+// Check a bit of a bitmap that other threads may be setting.
+static int test_bit(uint8_t *bits, int index) {
+	return (__atomic_load_n(&bits[index / 8], __ATOMIC_RELAXED) >> (index % 8)) & 1;
+}
+
+// Set or clear a bit of a bitmap that other threads may be checking.
+static void put_bit(uint8_t *bits, int index, int value) {
+	if (value) {
+		__atomic_fetch_or(&bits[index / 8], 1 << (index % 8), __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_and(&bits[index / 8], ~(1 << (index % 8)), __ATOMIC_RELAXED);
+	}
+}
+
+// Clear count bits starting at index of a bitmap that other threads may be checking.
+static void clear_bits(uint8_t *bits, int index, int count) {
+	int end = index + count;
+	while (index < end && index % 64 != 0) {
+		put_bit(bits, index++, 0);
+	}
+	for (; index + 64 <= end; index += 64) {
+		__atomic_store_n((uint64_t *) bits + index / 64, 0, __ATOMIC_RELAXED);
+	}
+	while (index < end) {
+		put_bit(bits, index++, 0);
+	}
+}
+
+// Fill in the table for crc32.
+static void crc_init() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		crc_table[i] = c;
+	}
+}
+
+// Continue a crc32 over len more bytes.
+static uint32_t crc_update(uint32_t crc, const void *data, size_t len) {
+	const uint8_t *p = data;
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) {
+		crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+// Return the number of descriptor blocks needed for the given numbers of entries.
+static int desc_blocks_for(int count, int revoke_count) {
+	size_t bytes = sizeof(journal_header_t) + (size_t) count * sizeof(uint32_t)
+		+ (size_t) revoke_count * sizeof(journal_revoke_t);
+	return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// A transaction read back from the journal.
+typedef struct found {
+	int pos;
+	journal_header_t hdr;
+} found_t;
+
+// Check whether a valid transaction starts at pos of the journal read into log.
+// returns its length in blocks, or 0 if there is none.
+static int check_txn(uint8_t *log, int blocks, int pos) {
+	journal_header_t *hdr = (journal_header_t *) (log + (size_t) pos * BLOCK_SIZE);
+	if (hdr->magic != JOURNAL_MAGIC || hdr->desc_blocks == 0
+			|| hdr->desc_blocks != desc_blocks_for(hdr->count, hdr->revokes)) {
+		return 0;
+	}
+	int len = hdr->desc_blocks + hdr->count;
+	if (len > blocks - pos) {
+		return 0;
+	}
+	uint32_t crc = hdr->crc;
+	hdr->crc = 0;
+	uint32_t actual = crc_update(0, hdr, (size_t) len * BLOCK_SIZE);
+	hdr->crc = crc;
+	return actual == crc ? len : 0;
+}
+
+// Check whether a later transaction freed the given block.
+static int revoked_after(uint8_t *log, found_t *txns, int count, int i, uint32_t block) {
+	for (int j = i + 1; j < count; j++) {
+		journal_header_t *hdr = (journal_header_t *) (log + (size_t) txns[j].pos * BLOCK_SIZE);
+		journal_revoke_t *rv = (journal_revoke_t *) ((uint32_t *) (hdr + 1) + hdr->count);
+		for (int k = 0; k < hdr->revokes; k++) {
+			if (block >= rv[k].start && block - rv[k].start < rv[k].count) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Order transactions by sequence number.
+static int compare_seq(const void *a, const void *b) {
+	uint64_t x = ((const found_t *) a)->hdr.seq;
+	uint64_t y = ((const found_t *) b)->hdr.seq;
+	return x < y ? -1 : x > y;
+}
+
+// Replay the committed transactions in the journal of an image that isn't mapped yet.
+// returns 0 on success, -1 on fail.
+int journal_replay(int fd, superblock_t *sb) {
+	crc_init();
+	int blocks = sb->journal_blocks;
+	size_t size = (size_t) blocks * BLOCK_SIZE;
+	uint8_t *log = malloc(size);
+	if (pread(fd, log, size, (off_t) sb->journal_start * BLOCK_SIZE) != size) {
+		free(log);
+		return -1;
+	}
+
+	// find every intact transaction
+	found_t *txns = malloc(blocks * sizeof(found_t));
+	int count = 0;
+	for (int pos = 0; pos < blocks; ) {
+		int len = check_txn(log, blocks, pos);
+		if (len == 0) {
+			pos++;
+			continue;
+		}
+		txns[count].pos = pos;
+		txns[count].hdr = *(journal_header_t *) (log + (size_t) pos * BLOCK_SIZE);
+		count++;
+		pos += len;
+	}
+	qsort(txns, count, sizeof(found_t), compare_seq);
+
+	// the newest transaction says which of the ones before it are already home
+	int first = count;
+	if (count > 0) {
+		journal_header_t *newest = &txns[count - 1].hdr;
+		first = count - 1;
+		while (first > 0 && txns[first - 1].hdr.seq > newest->checkpoint
+				&& txns[first - 1].hdr.seq == txns[first].hdr.seq - 1) {
+			first--;
+		}
+		if (txns[first].hdr.seq <= newest->checkpoint) {
+			first++;
+		}
+		next_seq = newest->seq + 1;
+		durable_seq = newest->seq;
+		home_seq = newest->seq;
+		last_pos = txns[count - 1].pos;
+		last_len = newest->desc_blocks + newest->count;
+		log_pos = last_pos + last_len;
+	}
+
+	int replayed = 0;
+	for (int i = first; i < count; i++) {
+		journal_header_t *hdr = (journal_header_t *) (log + (size_t) txns[i].pos * BLOCK_SIZE);
+		uint32_t *homes = (uint32_t *) (hdr + 1);
+		uint8_t *data = (uint8_t *) hdr + (size_t) hdr->desc_blocks * BLOCK_SIZE;
+		for (int k = 0; k < hdr->count; k++) {
+			if (homes[k] >= sb->block_count || revoked_after(log, txns + first, count - first, i - first, homes[k])) {
+				continue;
+			}
+			if (pwrite(fd, data + (size_t) k * BLOCK_SIZE, BLOCK_SIZE,
+					(off_t) homes[k] * BLOCK_SIZE) != BLOCK_SIZE) {
+				free(txns);
+				free(log);
+				return -1;
+			}
+		}
+		replayed += hdr->count > 0;
+	}
+	if (replayed > 0) {
+		trace_count(STAT_JOURNAL_REPLAYS, replayed);
+		fdatasync(fd);
+	}
+	free(txns);
+	free(log);
+	return 0;
+}
+
+// Set up the journal for the mapped image.
+void journal_init() {
+	superblock_t *sb = get_superblock();
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	// a waiting commit holds off new operations, so it can't be starved
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&txn_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	dirty_bits = calloc((sb->block_count + 63) / 64, 8);
+	revoked_bits = calloc((sb->block_count + 63) / 64, 8);
+	dirty_count = 0;
+	revoke_count = 0;
+	written_count = 0;
+}
+
+// Clear the bits of the blocks a transaction freed in its copies of the block bitmap. The
+// mapping keeps them set until the transaction is durable, so nothing reuses them sooner.
+static void clear_freed(uint8_t *data, int *homes, int count, journal_revoke_t *rv, int rv_count) {
+	superblock_t *sb = get_superblock();
+	int per_block = BLOCK_SIZE * 8;
+	int *copy_of = malloc(sb->block_bitmap_blocks * sizeof(int));
+	for (int i = 0; i < sb->block_bitmap_blocks; i++) {
+		copy_of[i] = -1;
+	}
+	for (int i = 0; i < count; i++) {
+		if (homes[i] >= sb->block_bitmap_start && homes[i] - sb->block_bitmap_start < sb->block_bitmap_blocks) {
+			copy_of[homes[i] - sb->block_bitmap_start] = i;
+		}
+	}
+	for (int i = 0; i < rv_count; i++) {
+		int64_t end = (int64_t) rv[i].start + rv[i].count;
+		for (int64_t b = rv[i].start; b < end; ) {
+			int k = b / per_block;
+			int64_t stop = (int64_t) (k + 1) * per_block < end ? (int64_t) (k + 1) * per_block : end;
+			// freeing a block always changes its part of the bitmap, so the copy is there
+			assert(copy_of[k] >= 0);
+			bitmap_put_range(data + (size_t) copy_of[k] * BLOCK_SIZE, b % per_block, stop - b, 0);
+			b = stop;
+		}
+	}
+	free(copy_of);
+}
+
+// Copy the running transaction and start a new one.
+// The caller holds txn_lock for writing, so no operation is halfway done.
+// returns the number of blocks copied into data.
+static int snapshot(uint8_t **data, int **homes, journal_revoke_t **rv, int *rv_count) {
+	pthread_mutex_lock(&state_lock);
+	// the private copies of the last commit are home now, unless they changed again
+	for (int i = 0; i < written_count; i++) {
+		if (!test_bit(dirty_bits, written[i])) {
+			madvise(get_block_at(written[i]), BLOCK_SIZE, MADV_DONTNEED);
+		}
+	}
+
+	int count = 0;
+	*data = malloc((size_t) dirty_count * BLOCK_SIZE + 1);
+	*homes = malloc(dirty_count * sizeof(int) + 1);
+	for (int i = 0; i < dirty_count; i++) {
+		int block = dirty[i];
+		// freed blocks were cleared, and blocks changed again after a free appear twice
+		if (!test_bit(dirty_bits, block)) {
+			continue;
+		}
+		put_bit(dirty_bits, block, 0);
+		memcpy(*data + (size_t) count * BLOCK_SIZE, get_block_at(block), BLOCK_SIZE);
+		(*homes)[count++] = block;
+	}
+	__atomic_store_n(&dirty_count, 0, __ATOMIC_RELAXED);
+	clear_freed(*data, *homes, count, revokes, revoke_count);
+
+	*rv = revokes;
+	*rv_count = revoke_count;
+	for (int i = 0; i < revoke_count; i++) {
+		bitmap_put_range(revoked_bits, revokes[i].start, revokes[i].count, 0);
+	}
+	revokes = 0;
+	revoke_count = 0;
+	revoke_cap = 0;
+	pthread_mutex_unlock(&state_lock);
+	return count;
+}
+
+// Write a transaction to the journal and flush it.
+// returns 0 on success, -1 if it doesn't fit in the journal.
+static int write_log(uint64_t seq, uint8_t *data, int *homes, int count,
+		journal_revoke_t *rv, int rv_count) {
+	superblock_t *sb = get_superblock();
+	int fd = get_blocks_fd();
+	int desc_blocks = desc_blocks_for(count, rv_count);
+	int len = desc_blocks + count;
+	if (len > sb->journal_blocks) {
+		return -1;
+	}
+	int pos = log_pos + len <= sb->journal_blocks ? log_pos : 0;
+	if (pos < last_pos + last_len && last_pos < pos + len && home_seq > durable_seq) {
+		// about to overwrite the last transaction, so make sure its blocks are home first
+		fdatasync(fd);
+		durable_seq = home_seq;
+	}
+
+	size_t desc_size = (size_t) desc_blocks * BLOCK_SIZE;
+	uint8_t *desc = calloc(1, desc_size);
+	journal_header_t *hdr = (journal_header_t *) desc;
+	hdr->magic = JOURNAL_MAGIC;
+	hdr->seq = seq;
+	hdr->checkpoint = durable_seq;
+	hdr->desc_blocks = desc_blocks;
+	hdr->count = count;
+	hdr->revokes = rv_count;
+	uint32_t *tags = (uint32_t *) (hdr + 1);
+	for (int i = 0; i < count; i++) {
+		tags[i] = homes[i];
+	}
+	memcpy(tags + count, rv, rv_count * sizeof(journal_revoke_t));
+	uint32_t crc = crc_update(0, desc, desc_size);
+	hdr->crc = crc_update(crc, data, (size_t) count * BLOCK_SIZE);
+
+	off_t at = (off_t) (sb->journal_start + pos) * BLOCK_SIZE;
+	int rv_write = pwrite(fd, desc, desc_size, at) == desc_size
+		&& pwrite(fd, data, (size_t) count * BLOCK_SIZE, at + desc_size) == (size_t) count * BLOCK_SIZE;
+	free(desc);
+	assert(rv_write);
+	// one flush makes the transaction durable, along with the home writes of the one before
+	fdatasync(fd);
+	durable_seq = home_seq;
+	last_pos = pos;
+	last_len = len;
+	log_pos = pos + len;
+	return 0;
+}
+
+// Make the blocks a durable transaction freed available again.
+static void reuse_freed(journal_revoke_t *rv, int rv_count) {
+	for (int i = 0; i < rv_count; i++) {
+		reuse_blocks(rv[i].start, rv[i].count);
+		__atomic_sub_fetch(&freeing, rv[i].count, __ATOMIC_RELAXED);
+	}
+}
+
+// Write the blocks of a committed transaction home, except any freed (and maybe reused)
+// since the snapshot.
+static void write_home(uint8_t *data, int *homes, int count) {
+	int fd = get_blocks_fd();
+	pthread_mutex_lock(&state_lock);
+	for (int i = 0; i < count; i++) {
+		if (!bitmap_get(revoked_bits, homes[i])) {
+			ssize_t n = pwrite(fd, data + (size_t) i * BLOCK_SIZE, BLOCK_SIZE, (off_t) homes[i] * BLOCK_SIZE);
+			assert(n == BLOCK_SIZE);
+		}
+	}
+	pthread_mutex_unlock(&state_lock);
+}
+
+// Commit a transaction too big for the journal as a series of transactions of up to half
+// of it, each written home before the next can overwrite it. Each piece is atomic, but a
+// crash part way through leaves only the pieces before it.
+static void commit_pieces(uint8_t *data, int *homes, int count, journal_revoke_t *rv, int rv_count) {
+	int limit = get_superblock()->journal_blocks / 2;
+	// the frees are spread over the pieces, so nothing older may be left to replay over them
+	fdatasync(get_blocks_fd());
+	durable_seq = home_seq;
+	int done = 0;
+	int rv_done = 0;
+	while (done < count || rv_done < rv_count) {
+		int n = count - done < limit - 1 ? count - done : limit - 1;
+		while (desc_blocks_for(n, 0) + n > limit) {
+			n--;
+		}
+		// the room left in the descriptor takes as many of the frees as fit
+		size_t room = (size_t) (limit - n) * BLOCK_SIZE - sizeof(journal_header_t) - n * sizeof(uint32_t);
+		int r = rv_count - rv_done;
+		if ((size_t) r > room / sizeof(journal_revoke_t)) {
+			r = room / sizeof(journal_revoke_t);
+		}
+		uint64_t seq = next_seq++;
+		write_log(seq, data + (size_t) done * BLOCK_SIZE, homes + done, n, rv + rv_done, r);
+		write_home(data + (size_t) done * BLOCK_SIZE, homes + done, n);
+		home_seq = seq;
+		done += n;
+		rv_done += r;
+	}
+}
+
+// Commit the running transaction and wait until it is durable.
+void journal_commit() {
+	pthread_mutex_lock(&commit_lock);
+	pthread_rwlock_wrlock(&txn_lock);
+	uint8_t *data;
+	int *homes;
+	journal_revoke_t *rv;
+	int rv_count;
+	int count = snapshot(&data, &homes, &rv, &rv_count);
+	pthread_rwlock_unlock(&txn_lock);
+	// operations carry on in the next transaction from here
+
+	if (count == 0 && rv_count == 0) {
+		free(data);
+		free(homes);
+		free(rv);
+		pthread_mutex_unlock(&commit_lock);
+		return;
+	}
+	trace_count(STAT_JOURNAL_COMMITS, 1);
+	trace_count(STAT_JOURNAL_BLOCKS, count);
+	if (desc_blocks_for(count, rv_count) + count <= get_superblock()->journal_blocks) {
+		uint64_t seq = next_seq++;
+		write_log(seq, data, homes, count, rv, rv_count);
+		reuse_freed(rv, rv_count);
+		write_home(data, homes, count);
+		home_seq = seq;
+	} else {
+		// transactions are committed once they fill half the journal, so only a single
+		// operation changing more than the rest of it gets here
+		trace_count(STAT_JOURNAL_SPLITS, 1);
+		commit_pieces(data, homes, count, rv, rv_count);
+		reuse_freed(rv, rv_count);
+	}
+	free(written);
+	written = homes;
+	written_count = count;
+	free(data);
+	free(rv);
+	pthread_mutex_unlock(&commit_lock);
+}
+
+// Commit every JOURNAL_COMMIT_INTERVAL seconds, or sooner when woken.
+static void *commit_thread(void *arg) {
+	pthread_mutex_lock(&state_lock);
+	while (running) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += JOURNAL_COMMIT_INTERVAL;
+		pthread_cond_timedwait(&wake, &state_lock, &until);
+		pthread_mutex_unlock(&state_lock);
+		journal_commit();
+		pthread_mutex_lock(&state_lock);
+	}
+	pthread_mutex_unlock(&state_lock);
+	return 0;
+}
+
+// Start the thread that commits transactions periodically.
+void journal_start_thread() {
+	running = 1;
+	pthread_create(&thread, NULL, commit_thread, NULL);
+}
+
+// Commit everything and stop the commit thread.
+void journal_close() {
+	pthread_mutex_lock(&state_lock);
+	int was_running = running;
+	running = 0;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&state_lock);
+	if (was_running) {
+		pthread_join(thread, NULL);
+	}
+	journal_commit();
+	// with the last transaction home, an empty one marks the journal as clean
+	fdatasync(get_blocks_fd());
+	durable_seq = home_seq;
+	write_log(next_seq++, 0, 0, 0, 0, 0);
+	pthread_rwlock_destroy(&txn_lock);
+	free(dirty_bits);
+	free(revoked_bits);
+	free(dirty);
+	free(revokes);
+	free(written);
+	dirty = 0;
+	dirty_cap = 0;
+	written = 0;
+}
+
+// Check whether the running transaction has filled half the journal, and should be
+// committed before it grows any further.
+static int transaction_full() {
+	return __atomic_load_n(&dirty_count, __ATOMIC_RELAXED) > get_superblock()->journal_blocks / 2;
+}
+
+// Check whether blocks waiting for a commit to be free again are half of the free space or
+// more, so operations could run out of room before the commit thread comes around.
+static int frees_pressing() {
+	int64_t pending = __atomic_load_n(&freeing, __ATOMIC_RELAXED);
+	return pending > 0 && pending * 2 >= free_block_count();
+}
+
+// Start an operation that changes metadata.
+void journal_begin() {
+	// keep transactions well within the journal, so they rarely have to be split, and
+	// don't leave much of the free space tied up in them
+	if (transaction_full() || frees_pressing()) {
+		journal_commit();
+	}
+	pthread_rwlock_rdlock(&txn_lock);
+}
+
+// End an operation started with journal_begin.
+void journal_end() {
+	pthread_rwlock_unlock(&txn_lock);
+	// operations running alongside the one that filled the transaction mustn't keep adding
+	// to it, so whichever ends first commits it
+	if (transaction_full()) {
+		journal_commit();
+	}
+}
+
+// Note that the operation is changing blocks first through last.
+static void dirty_blocks(int first, int last) {
+	for (int block = first; block <= last; block++) {
+		// most blocks are already part of the transaction, so check before locking
+		if (test_bit(dirty_bits, block)) {
+			continue;
+		}
+		pthread_mutex_lock(&state_lock);
+		if (!test_bit(dirty_bits, block)) {
+			put_bit(dirty_bits, block, 1);
+			if (dirty_count == dirty_cap) {
+				dirty_cap = dirty_cap ? dirty_cap * 2 : 256;
+				dirty = realloc(dirty, dirty_cap * sizeof(int));
+			}
+			dirty[dirty_count] = block;
+			__atomic_store_n(&dirty_count, dirty_count + 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&state_lock);
+	}
+}
+
+// Note that the operation is changing len bytes of metadata at addr.
+void journal_dirty(const void *addr, size_t len) {
+	size_t offset = (const uint8_t *) addr - (const uint8_t *) get_block_at(0);
+	dirty_blocks(offset / BLOCK_SIZE, (offset + len - 1) / BLOCK_SIZE);
+}
+
+// Note that the operation is changing count bits of a bitmap starting at index.
+void journal_dirty_bits(void *bitmap, int index, int count) {
+	journal_dirty((uint8_t *) bitmap + index / 8, (index + count - 1) / 8 - index / 8 + 1);
+}
+
+// Note that count blocks starting at index are being freed.
+void journal_revoke(int index, int count) {
+	pthread_mutex_lock(&state_lock);
+	if (revoke_count > 0 && revokes[revoke_count - 1].start + revokes[revoke_count - 1].count == index) {
+		revokes[revoke_count - 1].count += count;
+	} else {
+		if (revoke_count == revoke_cap) {
+			revoke_cap = revoke_cap ? revoke_cap * 2 : 64;
+			revokes = realloc(revokes, revoke_cap * sizeof(journal_revoke_t));
+		}
+		revokes[revoke_count].start = index;
+		revokes[revoke_count].count = count;
+		revoke_count++;
+	}
+	bitmap_put_range(revoked_bits, index, count, 1);
+	__atomic_add_fetch(&freeing, count, __ATOMIC_RELAXED);
+	// whatever the blocks held no longer needs to be written anywhere
+	clear_bits(dirty_bits, index, count);
+	pthread_mutex_unlock(&state_lock);
+	madvise(get_block_at(index), (size_t) count * BLOCK_SIZE, MADV_DONTNEED);
+}
+
+// Commit the running transaction if blocks freed are waiting for a commit to be free again,
+// for an operation that ran out of space.
+// returns 1 if there were any, 0 otherwise.
+int journal_commit_frees() {
+	if (__atomic_load_n(&freeing, __ATOMIC_RELAXED) == 0) {
+		return 0;
+	}
+	journal_commit();
+	return 1;
+}
@@ -0,0 +1,82 @@
+/* A write-ahead journal for metadata.
+ *
+ * Metadata (the regions before data_start, directory blocks and extent tree blocks) is
+ * changed in a private mapping of the image, so changes only reach the image once they
+ * are committed. Every operation that changes metadata runs inside journal_begin and
+ * journal_end and declares the bytes it changes with journal_dirty. Operations join the
+ * running transaction, and a background thread commits it every few seconds: one write
+ * of the changed blocks to the journal and one flush cover every operation in it. Then
+ * the blocks are written to their home locations. After a crash, committed transactions
+ * are replayed on the next mount. */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define JOURNAL_COMMIT_INTERVAL 5 // seconds between commits
+
+// Structure of the descriptor that starts each transaction in the journal:
+// the header is followed by the home block of each logged block, then by the
+// ranges of blocks freed by the transaction, spread over desc_blocks blocks.
+// The logged blocks come right after the descriptor.
+typedef struct journal_header {
+	uint32_t magic;
+	uint32_t crc;        // of the descriptor and the logged blocks, with this field zero
+	uint64_t seq;
+	uint64_t checkpoint; // every transaction up to this one is fully written home
+	uint32_t desc_blocks;
+	uint32_t count;      // logged blocks
+	uint32_t revokes;    // freed ranges
+	uint32_t _reserved;
+} journal_header_t;
+
+// A range of freed blocks. Earlier copies of these blocks are never replayed,
+// since the blocks may have been reused for file data.
+typedef struct journal_revoke {
+	uint32_t start;
+	uint32_t count;
+} journal_revoke_t;
+
+// Replay the committed transactions in the journal of an image that isn't mapped yet.
+// returns 0 on success, -1 on fail.
+int journal_replay(int fd, superblock_t *sb);
+
+// Set up the journal for the mapped image.
+void journal_init();
+
+// Start the thread that commits transactions periodically.
+void journal_start_thread();
+
+// Commit everything and stop the commit thread.
+void journal_close();
+
+// Start an operation that changes metadata. Operations can't nest.
+void journal_begin();
+
+// End an operation started with journal_begin.
+void journal_end();
+
+// Note that the operation is changing len bytes of metadata at addr.
+void journal_dirty(const void *addr, size_t len);
+
+// Note that the operation is changing count bits of a bitmap starting at index.
+void journal_dirty_bits(void *bitmap, int index, int count);
+
+// Note that count blocks starting at index are being freed. They only become free to
+// allocate once the transaction commits.
+void journal_revoke(int index, int count);
+
+// Commit the running transaction and wait until it is durable.
+void journal_commit();
+
+// Commit the running transaction if blocks freed are waiting for a commit to be free again,
+// for an operation that ran out of space to retry.
+// Returns 1 if there were any, 0 otherwise.
+int journal_commit_frees();
+
+#endif
@@ -0,0 +1,176 @@
+/* The LZ codec of lz.h.
+ * Matches are found through a hash table of the last place each four bytes were seen, and
+ * the step between places tried grows the longer nothing matches, so data that doesn't
+ * compress is given up on quickly. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define HASH_BITS 12
+
+// Read four bytes at p, however aligned.
+static uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Return the slot of the hash table for four bytes.
+static int hash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write the part of a length that doesn't fit in its token.
+// returns where the output continues, or null if there is no room.
+static uint8_t *put_length(uint8_t *op, uint8_t *end, int len) {
+	for (len -= 15; ; len -= 255) {
+		if (op >= end) {
+			return 0;
+		}
+		*op++ = len < 255 ? len : 255;
+		if (len < 255) {
+			return op;
+		}
+	}
+}
+
+// Read the part of a length that didn't fit in its token onto len.
+// returns where the input continues, or null if it ends first.
+static const uint8_t *get_length(const uint8_t *ip, const uint8_t *end, int *len) {
+	for (;;) {
+		if (ip >= end) {
+			return 0;
+		}
+		int byte = *ip++;
+		*len += byte;
+		if (byte < 255) {
+			return ip;
+		}
+	}
+}
+
+// Write a sequence: the literals, then a match of len bytes offset back, if len isn't 0.
+// returns where the output continues, or null if there is no room.
+static uint8_t *put_sequence(uint8_t *op, uint8_t *end, const uint8_t *literals, int count,
+		int offset, int len) {
+	if (op >= end) {
+		return 0;
+	}
+	int extra = len - LZ_MIN_MATCH;
+	uint8_t *token = op++;
+	*token = (count < 15 ? count : 15) << 4 | (len > 0 ? (extra < 15 ? extra : 15) : 0);
+	if (count >= 15 && (op = put_length(op, end, count)) == 0) {
+		return 0;
+	}
+	if (count > end - op) {
+		return 0;
+	}
+	memcpy(op, literals, count);
+	op += count;
+	if (len == 0) {
+		return op;
+	}
+	if (end - op < 2) {
+		return 0;
+	}
+	*op++ = offset;
+	*op++ = offset >> 8;
+	if (extra >= 15) {
+		op = put_length(op, end, extra);
+	}
+	return op;
+}
+
+// Compress size bytes of src into dst, which has room for capacity bytes.
+// returns the compressed size, or -1 if it doesn't fit.
+int lz_compress(const void *src, int size, void *dst, int capacity) {
+	const uint8_t *in = src;
+	uint8_t *op = dst;
+	uint8_t *end = op + capacity;
+	uint16_t table[1 << HASH_BITS];
+	memset(table, 0, sizeof(table));
+	if (size > LZ_MAX_INPUT) {
+		return -1;
+	}
+	int anchor = 0;
+	int pos = 0;
+	while (pos + LZ_MIN_MATCH <= size) {
+		uint32_t seq = read32(in + pos);
+		int h = hash(seq);
+		int ref = table[h];
+		table[h] = pos;
+		if (ref >= pos || read32(in + ref) != seq) {
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
+		while (pos > anchor && ref > 0 && in[pos - 1] == in[ref - 1]) {
+			pos--;
+			ref--;
+		}
+		int len = LZ_MIN_MATCH;
+		while (pos + len < size && in[pos + len] == in[ref + len]) {
+			len++;
+		}
+		op = put_sequence(op, end, in + anchor, pos - anchor, pos - ref, len);
+		if (op == 0) {
+			return -1;
+		}
+		pos += len;
+		anchor = pos;
+	}
+	op = put_sequence(op, end, in + anchor, size - anchor, 0, 0);
+	return op == 0 ? -1 : op - (uint8_t *) dst;
+}
+
+// Decompress size bytes of src into dst, which has room for capacity bytes.
+// returns the decompressed size, or -1 if the data is corrupt or doesn't fit.
+int lz_decompress(const void *src, int size, void *dst, int capacity) {
+	const uint8_t *ip = src;
+	const uint8_t *in_end = ip + size;
+	uint8_t *op = dst;
+	uint8_t *end = op + capacity;
+	for (;;) {
+		if (ip >= in_end) {
+			return -1;
+		}
+		int token = *ip++;
+		int count = token >> 4;
+		if (count == 15 && (ip = get_length(ip, in_end, &count)) == 0) {
+			return -1;
+		}
+		if (count > in_end - ip || count > end - op) {
+			return -1;
+		}
+		memcpy(op, ip, count);
+		op += count;
+		ip += count;
+		if (ip == in_end) {
+			// the last sequence has no match
+			return op - (uint8_t *) dst;
+		}
+		if (in_end - ip < 2) {
+			return -1;
+		}
+		int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		int len = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15 && (ip = get_length(ip, in_end, &len)) == 0) {
+			return -1;
+		}
+		if (offset == 0 || offset > op - (uint8_t *) dst || len > end - op) {
+			return -1;
+		}
+		// the match may overlap the bytes it produces, repeating them
+		const uint8_t *from = op - offset;
+		if (offset >= len) {
+			memcpy(op, from, len);
+			op += len;
+		} else {
+			for (int i = 0; i < len; i++) {
+				*op++ = from[i];
+			}
+		}
+	}
+}
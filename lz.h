@@ -0,0 +1,21 @@
+/* A small LZ77 codec in the style of LZ4, fast enough to run on every cluster of a file.
+ * The output is a series of sequences, each a token byte (literal count in the high four
+ * bits, match length less LZ_MIN_MATCH in the low four, 15 in either meaning more follows
+ * in bytes of 255 and a last byte below it), the literals, and a two byte little endian
+ * offset back to the match. The last sequence has literals only. */
+
+#ifndef LZ_H
+#define LZ_H
+
+#define LZ_MAX_INPUT 65536 // the most bytes compressed at once, so offsets fit in two bytes
+#define LZ_MIN_MATCH 4
+
+// Compress size bytes of src into dst, which has room for capacity bytes.
+// Returns the compressed size, or -1 if it doesn't fit, as for data that doesn't compress.
+int lz_compress(const void *src, int size, void *dst, int capacity);
+
+// Decompress size bytes of src into dst, which has room for capacity bytes.
+// Returns the decompressed size, or -1 if the data is corrupt or doesn't fit.
+int lz_decompress(const void *src, int size, void *dst, int capacity);
+
+#endif
@@ -0,0 +1,71 @@
+/* Formats a disk image with an empty nufs volume. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "blocks.h"
+#include "directory.h"
+
+// Parse a size such as 4096, 64M or 2G into a number of bytes.
+// returns -1 on fail.
+static int64_t parse_size(const char *text) {
+	char *end;
+	int64_t size = strtoll(text, &end, 10);
+	switch (*end) {
+		case 'T': case 't': size *= 1024;
+		case 'G': case 'g': size *= 1024;
+		case 'M': case 'm': size *= 1024;
+		case 'K': case 'k': size *= 1024; end++;
+		default: break;
+	}
+	if (*end != 0 || size <= 0) {
+		return -1;
+	}
+	return size;
+}
+
+static void usage() {
+	fprintf(stderr, "usage: mkfs.nufs [-s size[K|M|G|T]] [-i inodes] image\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	int64_t size = NUFS_DEFAULT_SIZE;
+	int inodes = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:i:")) != -1) {
+		switch (opt) {
+			case 's':
+				size = parse_size(optarg);
+				break;
+			case 'i':
+				inodes = atoi(optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (optind != argc - 1 || size < 0 || inodes < 0) {
+		usage();
+	}
+	const char *image = argv[optind];
+
+	if (blocks_format(image, size, inodes) != 0) {
+		fprintf(stderr, "mkfs.nufs: unable to format %s\n", image);
+		return 1;
+	}
+	// create the root directory
+	if (blocks_init(image) != 0) {
+		return 1;
+	}
+	directory_init();
+
+	superblock_t *sb = get_superblock();
+	printf("%s: %u blocks of %u bytes, %u inodes, data starts at block %u\n",
+			image, sb->block_count, sb->block_size, sb->inode_count, sb->data_start);
+	printf("%u allocation groups of %u blocks and %u inodes\n",
+			sb->group_count, sb->blocks_per_group, sb->inodes_per_group);
+	blocks_free();
+	return 0;
+}
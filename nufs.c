@@ -3,7 +3,11 @@
 #include <assert.h>
 #include <bsd/string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -11,98 +15,272 @@
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
+#include <stddef.h>
+#include "compress.h"
 #include "directory.h"
+#include "file.h"
+#include "icache.h"
+#include "ioctl.h"
 #include "inode.h"
+#include "journal.h"
+#include "writeback.h"
+#include "trace.h"
+#include "backend.h"
 #include "blocks.h"
-#include "slist.h"
+#include "cache.h"
 #include "bitmap.h" 
 
+// The attribute flag ioctls of lsattr and chattr, as linux/fs.h has them; that header
+// can't be included along with blocks.h, whose BLOCK_SIZE it defines differently.
+#define FS_IOC_GETFLAGS _IOR('f', 1, long)
+#define FS_IOC_SETFLAGS _IOW('f', 2, long)
+#define FS_COMPR_FL 0x00000004
+
+#define STATS_DIR "/.nufs" // virtual directory reporting on the running filesystem
+
+// The read-only virtual files under STATS_DIR, each rendered when it is opened.
+static const struct {
+	const char *name;
+	char *(*render)(size_t *size);
+} virtual_files[] = {
+	{ "stats", trace_stats },
+	{ "trace", trace_events },
+};
+#define VIRTUAL_FILES ((int) (sizeof(virtual_files) / sizeof(virtual_files[0])))
+
+// What an open virtual file reads as, rendered when it was opened.
+typedef struct snapshot {
+	char *data;
+	size_t size;
+} snapshot_t;
+
+// What an open file or directory is.
+typedef enum handle_kind {
+	HANDLE_INODE,   // a file or directory of the image
+	HANDLE_VIRTUAL, // one of the virtual files
+	HANDLE_STATS,   // STATS_DIR itself
+} handle_kind_t;
+
+// What an open file or directory keeps in fi->fh, so operations on it needn't look its
+// path up again. FUSE hides files unlinked while open rather than removing them, so the
+// inode stays the file's until it is released.
+typedef struct handle {
+	handle_kind_t kind;
+	int inum; // for HANDLE_INODE
+	snapshot_t snap; // for HANDLE_VIRTUAL
+} handle_t;
+
+// Return the index of the virtual file at the given path, or -1 if there is none.
+static int find_virtual(const char *path) {
+	size_t len = strlen(STATS_DIR);
+	if (strncmp(path, STATS_DIR "/", len + 1) != 0) {
+		return -1;
+	}
+	for (int i = 0; i < VIRTUAL_FILES; i++) {
+		if (strcmp(path + len + 1, virtual_files[i].name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Check whether the path is STATS_DIR or one of the files in it.
+static int is_virtual(const char *path) {
+	return strcmp(path, STATS_DIR) == 0 || find_virtual(path) >= 0;
+}
+
+// Return the handle of an open file or directory, or null if FUSE passed none.
+static handle_t *get_handle(struct fuse_file_info *fi) {
+	return fi != 0 ? (handle_t *) (uintptr_t) fi->fh : 0;
+}
+
+// Check whether an operation is on an open virtual file or STATS_DIR.
+static int is_virtual_handle(struct fuse_file_info *fi) {
+	handle_t *h = get_handle(fi);
+	return h != 0 && h->kind != HANDLE_INODE;
+}
+
+// Return the index of the inode an operation is on: the one its handle was opened as, or
+// the one at its path if it has no handle. FUSE only passes no path along with a handle.
+// returns -1 if there is none.
+static int handle_inode(const char *path, struct fuse_file_info *fi) {
+	handle_t *h = get_handle(fi);
+	if (h != 0) {
+		return h->kind == HANDLE_INODE ? h->inum : -1;
+	}
+	return path != 0 ? find_inode_index(path) : -1;
+}
 
 // Checks if a file exists.
 // Returns -ENOENT on fail, 0 otherwise.
 int nufs_access(const char *path, int mask) {
 	int rv = 0;
+	if (is_virtual(path)) {
+		return rv;
+	}
 	int exists = find_inode_index(path);
 	if (exists < 0) {
 		return -ENOENT;
 	}
-	printf("access(%s, %04o) -> %d\n", path, mask, rv);
 	return rv;
 }
 
+// Fills in the attributes of the object with the given inode index.
+static void nufs_stat(int inode_index, struct stat *st) {
+	inode_t* node = get_inode(inode_index);
+	// clean stats struct
+	memset(st, 0, sizeof(struct stat));
+	st->st_ino = inode_index;
+	st->st_mode = node->mode;
+	st->st_nlink = node->refs;
+	st->st_size = node->size;
+	st->st_uid = getuid();
+}
+
+// Fills in the attributes of a virtual file, or with file unset, of STATS_DIR.
+static void virtual_stat(int file, struct stat *st) {
+	// virtual files report a size of 0 and are read with direct I/O, so FUSE reads to the end
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = file ? 0100444 : 040555;
+	st->st_nlink = 1;
+	st->st_uid = getuid();
+}
+
 // Gets an object's attributes (type, permissions, size, etc).
 // Returns -ENOENT if object doesn't exist, 0 otherwise.
 int nufs_getattr(const char *path, struct stat *st) {
 	int rv = 0;
+	if (is_virtual(path)) {
+		virtual_stat(find_virtual(path) >= 0, st);
+		return rv;
+	}
 	int inode_index = find_inode_index(path);
 	if (inode_index < 0) {
 		return -ENOENT;
 	}
-	inode_t* node = get_inode(inode_index);
-	// clean stats struct
-	memset(st, 0, sizeof(struct stat));
-	st->st_mode = node->mode;
-	st->st_size = node->size;
-	st->st_uid = getuid();
-	printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode,
-			st->st_size);
+	cinode_t *ci = inode_lock(inode_index, 0);
+	nufs_stat(inode_index, st);
+	inode_unlock(ci);
 	return rv;
 }
 
+// Gets an open object's attributes, as nufs_getattr does.
+// Returns -ENOENT if object doesn't exist, 0 otherwise.
+int nufs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+	handle_t *h = get_handle(fi);
+	if (h == 0) {
+		return path != 0 ? nufs_getattr(path, st) : -ENOENT;
+	}
+	if (h->kind != HANDLE_INODE) {
+		virtual_stat(h->kind == HANDLE_VIRTUAL, st);
+		return 0;
+	}
+	int inode_index = h->inum;
+	if (inode_index < 0) {
+		return -ENOENT;
+	}
+	cinode_t *ci = inode_lock(inode_index, 0);
+	nufs_stat(inode_index, st);
+	inode_unlock(ci);
+	return 0;
+}
+
+// Where nufs_readdir is placing entries.
+typedef struct readdir_buf {
+	void *buf;
+	fuse_fill_dir_t filler;
+} readdir_buf_t;
+
+// Places one directory entry, with its own attributes, into the buffer.
+// returns nonzero once the buffer is full.
+static int readdir_fill(void *arg, const char *name, int inum, int64_t next) {
+	readdir_buf_t *rb = arg;
+	struct stat st;
+	// the entry's own inode isn't locked: the attributes are only a hint to the kernel
+	nufs_stat(inum, &st);
+	return rb->filler(rb->buf, name, &st, next);
+}
+
 // Lists the contents of a directory, returning w/ 0 on successful listing.
+// Entries are placed starting at the given offset, until FUSE's buffer fills up.
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 					off_t offset, struct fuse_file_info *fi) {
-	struct stat st;
 	int rv = 0;
-	// call directory to get list of contents
-	slist_t* list = directory_list(path);
-	rv = nufs_getattr(path, &st);
-	// continue placing entries into the buffer 
-	while (list) {
-		if (strcmp(list->data, "") != 0) {
-			filler(buf, list->data, &st, 0);
+	handle_t *h = get_handle(fi);
+	if (h != 0 ? h->kind == HANDLE_STATS : strcmp(path, STATS_DIR) == 0) {
+		for (int i = 0; i < VIRTUAL_FILES; i++) {
+			filler(buf, virtual_files[i].name, NULL, 0);
 		}
-		list = list->next;
+		return rv;
+	}
+	int inode_index = handle_inode(path, fi);
+	if (inode_index < 0) {
+		return -ENOENT;
 	}
-	printf("readdir(%s) -> %d\n", path, rv);
+	readdir_buf_t rb = { buf, filler };
+	cinode_t *ci = inode_lock(inode_index, 0);
+	rv = directory_iterate(inode_index, offset, readdir_fill, &rb);
+	inode_unlock(ci);
 	return rv;
 }
 
 // Makes a filesystem object such as a file or directory.
-// returns -1 on fail, 0 otherwise.
-int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
+// returns the index of its inode, or -ENOENT, -EEXIST or -1 on fail.
+static int make_node(const char *path, mode_t mode) {
 	int rv = -1; 
+	int dir_num = parent_inode_index(path);
+	if (dir_num < 0) {
+		return -ENOENT;
+	}
+	if (is_virtual(path)) {
+		return -EEXIST;
+	}
+	const char *name = get_filename(path);
+	journal_begin();
+	cinode_t *dir = inode_lock(dir_num, 1);
+	// another thread may have made it since the kernel looked
+	if (directory_lookup(dir_num, name, strlen(name)) >= 0) {
+		inode_unlock(dir);
+		journal_end();
+		return -EEXIST;
+	}
 
 	// allocate the new inode
-	int inum_new = alloc_inode();
+	// placed in the directory's group, or for a new directory, a lightly used one
+	int inum_new = alloc_inode(dir_num, mode);
 	// return -1 if we couldn't properly allocate
 	if (inum_new < 0) {
+		inode_unlock(dir);
+		journal_end();
 		return rv;
 	}
 
 	inode_t* inode_new = get_inode(inum_new);
 	// populate the metadata
-	inode_new->refs = 1;
+	journal_dirty(inode_new, sizeof(inode_t));
+	inode_new->refs = 0; // directory_put counts the link
 	inode_new->mode = mode;
 	inode_new->size = 0;
-	inode_new->block_list = alloc_blist();
-	assert(inode_new->block_list > 0); 
 
-	const char *name = get_filename(path);
 	// place the new file under parent
-	int dir_num = parent_inode_index(path);
-	inode_t *directory = get_inode(dir_num);
-	directory_put(directory, name, inum_new);
-	rv = 0;
-	printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+	directory_put(dir_num, name, inum_new);
+	inode_unlock(dir);
+	journal_end();
+	rv = inum_new;
 	return rv;
 }
 
+// Makes a filesystem object such as a file or directory.
+// returns -1 on fail, 0 otherwise.
+int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
+	int rv = make_node(path, mode);
+	return rv < 0 ? rv : 0;
+}
+
 // Makes a directory.
 // returns -1 on fail, 0 otherwise.
 int nufs_mkdir(const char *path, mode_t mode) {
 	int rv = nufs_mknod(path, mode | 040000, 0);
-	printf("mkdir(%s) -> %d\n", path, rv);
 	return rv;
 }
 
@@ -111,12 +289,15 @@ int nufs_mkdir(const char *path, mode_t mode) {
 int nufs_unlink(const char *path) {
 	int rv = -1;
 	int predecessor = parent_inode_index(path);
-	assert(predecessor > -1);
-	inode_t* directory = get_inode(predecessor);
+	if (predecessor < 0) {
+		return -ENOENT;
+	}
 	// once we found the directory, remove file from there
-	directory_delete(directory, path);
-	rv = 0;
-	printf("unlink(%s) -> %d\n", path, rv);
+	journal_begin();
+	cinode_t *dir = inode_lock(predecessor, 1);
+	rv = directory_delete(predecessor, get_filename(path)) < 0 ? -ENOENT : 0;
+	inode_unlock(dir);
+	journal_end();
 	return rv;
 }
 
@@ -127,13 +308,15 @@ int nufs_link(const char *from, const char *to) {
 	int inode_num = find_inode_index(from);
 	int directory_num = parent_inode_index(to);
 	// ensure these exist
-	assert(inode_num > -1);
-	assert(directory_num > -1);
+	if (inode_num < 0 || directory_num < 0) {
+		return -ENOENT;
+	}
 
-	inode_t *directory = get_inode(directory_num);
-	directory_put(directory, get_filename(to), inode_num);
-	rv = 0;
-	printf("link(%s => %s) -> %d\n", from, to, rv);
+	journal_begin();
+	cinode_t *dir = inode_lock(directory_num, 1);
+	rv = directory_put(directory_num, get_filename(to), inode_num) < 0 ? -1 : 0;
+	inode_unlock(dir);
+	journal_end();
 	return rv;
 }
 
@@ -141,16 +324,27 @@ int nufs_link(const char *from, const char *to) {
 // returns -1 on fail, 0 otherwise. 
 int nufs_rmdir(const char *path) {
 	int rv = -1;
+	int dir_num = parent_inode_index(path);
 	int inode_num = find_inode_index(path);
+	if (dir_num < 0 || inode_num < 0) {
+		return -ENOENT;
+	}
 	inode_t *node = get_inode(inode_num);
 	if (node->mode != 040775) {
 		return rv;
 	}
+	// parents are always locked before their children
+	journal_begin();
+	cinode_t *dir = inode_lock(dir_num, 1);
+	cinode_t *child = inode_lock(inode_num, 0);
+	int empty = directory_is_empty(inode_num);
+	inode_unlock(child);
 	// If the directory is empty, then we can unlink it
-	if (directory_list(path) == NULL) {
-		rv = nufs_unlink(path);
+	if (empty) {
+		rv = directory_delete(dir_num, get_filename(path)) < 0 ? -ENOENT : 0;
 	}
-	printf("rmdir(%s) -> %d\n", path, rv);
+	inode_unlock(dir);
+	journal_end();
 	return rv;
 }
 
@@ -158,167 +352,812 @@ int nufs_rmdir(const char *path) {
 // returns -1 on fail, 0 otherwise.
 int nufs_rename(const char *from, const char *to) {
 	int rv = -1; 
-	// first, make sure the file eists
-	int file_idx = find_inode_index(from);
-	assert(file_idx > -1);
-	rv = nufs_link(from, to);
-	assert(rv > -1);
+	int from_dir = parent_inode_index(from);
+	int to_dir = parent_inode_index(to);
+	if (from_dir < 0 || to_dir < 0) {
+		return -ENOENT;
+	}
+	const char *from_name = get_filename(from);
+	const char *to_name = get_filename(to);
 
-	rv = nufs_unlink(from);
-	printf("rename(%s => %s) -> %d\n", from, to, rv);
+	// both directories stay locked, so nobody sees the file in both places or in neither
+	cinode_t *a, *b;
+	journal_begin();
+	inode_lock_pair(from_dir, to_dir, &a, &b);
+	// first, make sure the file eists
+	int file_idx = directory_lookup(from_dir, from_name, strlen(from_name));
+	int target = directory_lookup(to_dir, to_name, strlen(to_name));
+	if (file_idx < 0) {
+		rv = -ENOENT;
+	} else if (file_idx == target) {
+		// both names already link the same file
+		rv = 0;
+	} else if (target >= 0) {
+		// renaming over an existing file replaces it in place, but only with its own kind,
+		// and a directory only if it is empty
+		int is_dir = S_ISDIR(get_inode(file_idx)->mode);
+		int over_dir = S_ISDIR(get_inode(target)->mode);
+		if (is_dir != over_dir) {
+			rv = is_dir ? -ENOTDIR : -EISDIR;
+		} else {
+			int empty = 1;
+			if (over_dir) {
+				cinode_t *child = inode_lock(target, 0);
+				empty = directory_is_empty(target);
+				inode_unlock(child);
+			}
+			rv = !empty ? -ENOTEMPTY : directory_replace(to_dir, to_name, file_idx) < 0 ? -1 : 0;
+		}
+	} else {
+		rv = directory_put(to_dir, to_name, file_idx) < 0 ? -1 : 0;
+	}
+	if (rv == 0 && file_idx != target) {
+		directory_delete(from_dir, from_name);
+	}
+	inode_unlock(b);
+	inode_unlock(a);
+	journal_end();
 	return rv;
 }
 
 // Changes permissions on a file.
 int nufs_chmod(const char *path, mode_t mode) {
 	int rv = 0;
-	printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
 	return rv;
 }
 
-// Limits files to a certain size.
+// Grows or shrinks the file with the given inode index to size.
 // returns -1 on fail, 0 otherwise.
-int nufs_truncate(const char *path, off_t size) {
+static int truncate_inode(int inode_num, off_t size) {
 	int rv = -1;
-	int inode_num = find_inode_index(path);
 	if (inode_num < 0) {
 		return rv;
 	} 
 	// determine whether we need to grow or shrink 
+	journal_begin();
+	cinode_t *ci = inode_lock(inode_num, 1);
 	inode_t *node = get_inode(inode_num);
 	if (size >= node->size) {
 		rv = grow_inode(node, size);
 	} else {
 		rv = shrink_inode(node, size);
 	}
-	printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+	inode_unlock(ci);
+	journal_end();
 	return rv;
 }
 
-// This is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
-// You can just check whether the file is accessible.
+// Limits files to a certain size.
+// returns -1 on fail, 0 otherwise.
+int nufs_truncate(const char *path, off_t size) {
+	return truncate_inode(find_inode_index(path), size);
+}
+
+// Limits an open file to a certain size.
+// returns -1 on fail, 0 otherwise.
+int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	return truncate_inode(handle_inode(path, fi), size);
+}
+
+// Opens a file or directory, resolving its path once into a handle kept in fh for the
+// operations on it that follow. Virtual files have their contents rendered now instead.
+// returns -ENOENT if it doesn't exist, -EACCES for virtual files opened for writing.
+static int open_handle(const char *path, struct fuse_file_info *fi) {
+	handle_t *h = calloc(1, sizeof(handle_t));
+	int virt = find_virtual(path);
+	if (virt >= 0) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+			free(h);
+			return -EACCES;
+		}
+		h->kind = HANDLE_VIRTUAL;
+		h->snap.data = virtual_files[virt].render(&h->snap.size);
+		fi->direct_io = 1;
+	} else if (strcmp(path, STATS_DIR) == 0) {
+		h->kind = HANDLE_STATS;
+	} else {
+		h->kind = HANDLE_INODE;
+		h->inum = find_inode_index(path);
+		if (h->inum < 0) {
+			free(h);
+			return -ENOENT;
+		}
+	}
+	fi->fh = (uintptr_t) h;
+	return 0;
+}
+
+// Opens a file.
+// returns -ENOENT if it doesn't exist, -EACCES for virtual files opened for writing.
 int nufs_open(const char *path, struct fuse_file_info *fi) {
+	return open_handle(path, fi);
+}
+
+// Opens a directory, so reading it needn't look its path up again.
+// returns -ENOENT if it doesn't exist.
+int nufs_opendir(const char *path, struct fuse_file_info *fi) {
+	return open_handle(path, fi);
+}
+
+// Makes a file and opens it, with its new inode as the handle.
+// returns -1 on fail, 0 otherwise.
+int nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	int inum = make_node(path, mode);
+	if (inum < 0) {
+		return inum;
+	}
+	handle_t *h = calloc(1, sizeof(handle_t));
+	h->kind = HANDLE_INODE;
+	h->inum = inum;
+	fi->fh = (uintptr_t) h;
+	return 0;
+}
+
+// Frees what an open directory kept.
+int nufs_releasedir(const char *path, struct fuse_file_info *fi) {
+	free(get_handle(fi));
+	fi->fh = 0;
+	return 0;
+}
+
+// Frees what an open file kept, once it is closed for good. A file that was open for
+// writing gives back the blocks allocated past its end as it was appended to, and has
+// what was written compressed if it is to be.
+int nufs_release(const char *path, struct fuse_file_info *fi) {
 	int rv = 0;
-	printf("open(%s) -> %d\n", path, rv);
+	handle_t *h = get_handle(fi);
+	int num = h != 0 && (fi->flags & O_ACCMODE) != O_RDONLY ? handle_inode(path, fi) : -1;
+	if (h != 0) {
+		free(h->snap.data);
+		free(h);
+		fi->fh = 0;
+	}
+	if (num >= 0) {
+		journal_begin();
+		cinode_t *ci = inode_lock(num, 1);
+		file_trim(get_inode(num));
+		compress_file(get_inode(num));
+		inode_unlock(ci);
+		journal_end();
+	}
 	return rv;
 }
 
+// Copies up to size bytes at offset of an open virtual file into buf.
+// returns the number of bytes copied.
+static int read_snapshot(snapshot_t *snap, char *buf, size_t size, off_t offset) {
+	if (offset >= snap->size) {
+		return 0;
+	}
+	size_t len = size < snap->size - offset ? size : snap->size - offset;
+	memcpy(buf, snap->data + offset, len);
+	return len;
+}
+
 // Reads data from a file.
-// returns -1 on fail, or size on success.
+// returns -1 on fail, or the number of bytes read on success.
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
 				struct fuse_file_info *fi) {
 	int rv = -1;
-	int num = find_inode_index(path);
+	if (is_virtual_handle(fi)) {
+		return read_snapshot(&get_handle(fi)->snap, buf, size, offset);
+	}
+	int num = handle_inode(path, fi);
 	if (num < 0) {
 		return rv;
 	}
-	printf("reading from inode:%d\n", num);
 	inode_t* node = get_inode(num);
-	// returns 0 if offset at or beyond file
-	if (offset >= node->size) {
+	// copies only the requested range, and returns 0 if offset at or beyond file
+	cinode_t *ci = inode_lock(num, 0);
+	rv = file_read(node, buf, size, offset);
+	inode_unlock(ci);
+	if (rv < 0) {
+		return -EIO;
+	}
+	trace_count(STAT_BYTES_READ, rv);
+	return rv;
+}
+
+// Reads data from a file without copying it: the returned buffers point at
+// the file's runs within the disk image, so FUSE can splice them to the kernel.
+// Engines that FUSE can't splice from read the runs into memory instead.
+// returns -ENOENT on fail, 0 on success.
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+				off_t offset, struct fuse_file_info *fi) {
+	if (is_virtual_handle(fi)) {
+		// FUSE frees mem once the reply is sent
+		struct fuse_bufvec *bv = malloc(sizeof(struct fuse_bufvec));
+		*bv = FUSE_BUFVEC_INIT(size);
+		bv->buf[0].mem = malloc(size);
+		bv->buf[0].size = read_snapshot(&get_handle(fi)->snap, bv->buf[0].mem, size, offset);
+		*bufp = bv;
 		return 0;
 	}
-	
-	blist_t* blocks = get_blist_at(node->block_list);
-	int i = 0;
-	while (blocks != 0) {
-		void* block = get_block_at(blocks->block);
-		// copy from block into the buffer
-		memcpy(((void*) buf) + (i * BLOCK_SIZE), block, BLOCK_SIZE);
-		if (blocks->next == 0) {
-			break;
-		}
-		blocks = get_blist_at(blocks->next);
-		i++;
+	int num = handle_inode(path, fi);
+	if (num < 0) {
+		return -ENOENT;
 	}
+	inode_t* node = get_inode(num);
 
-	rv = size;
-	printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
-	return rv;
+	// each block of the range starts at most one new run
+	int max_runs = size / BLOCK_SIZE + 2;
+	file_run_t *runs = malloc(max_runs * sizeof(file_run_t));
+	// FUSE reads the runs after we return, so like any read racing a truncate,
+	// the lock only makes the mapping itself consistent
+	cinode_t *ci = inode_lock(num, 0);
+	int count = file_map(node, size, offset, runs, max_runs);
+	if (count > 0 && runs[0].mem != 0) {
+		// inline data lives in the inode, which may change as soon as it is unlocked
+		char *copy = malloc(runs[0].size);
+		memcpy(copy, runs[0].mem, runs[0].size);
+		runs[0].mem = copy;
+	}
+	int rv = 0;
+	off_t at = offset;
+	for (int i = 0; i < count; i++) {
+		if (runs[i].pos == FILE_PACKED) {
+			// compressed data has no run in the image to splice, so it is decompressed now
+			runs[i].mem = malloc(runs[i].size);
+			if (file_read(node, runs[i].mem, runs[i].size, at) < 0) {
+				rv = -EIO;
+			}
+		}
+		at += runs[i].size;
+	}
+	inode_unlock(ci);
+	if (rv != 0) {
+		for (int i = 0; i < count; i++) {
+			free(runs[i].mem);
+		}
+		free(runs);
+		return rv;
+	}
+	struct fuse_bufvec *bv =
+		malloc(sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+	*bv = FUSE_BUFVEC_INIT(0);
+	bv->count = count;
+	// runs FUSE can't splice from the image are read by the engine, all in one batch
+	data_io_t *ios = malloc(count * sizeof(data_io_t));
+	int reads = 0;
+	for (int i = 0; i < count; i++) {
+		struct fuse_buf *fb = &bv->buf[i];
+		memset(fb, 0, sizeof(struct fuse_buf));
+		fb->size = runs[i].size;
+		trace_count(STAT_BYTES_READ, runs[i].size);
+		if (runs[i].mem != 0) {
+			// inline and compressed data were copied while the inode was locked
+			fb->mem = runs[i].mem;
+		} else if (runs[i].pos < 0) {
+			// holes read as zeros; FUSE frees mem once the reply is sent
+			fb->mem = calloc(1, runs[i].size);
+		} else if (!backend_splice()) {
+			fb->mem = malloc(runs[i].size);
+			ios[reads++] = (data_io_t) { runs[i].pos, fb->mem, runs[i].size };
+		} else {
+			fb->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			fb->fd = get_blocks_fd();
+			fb->pos = runs[i].pos;
+		}
+	}
+	free(runs);
+	rv = data_read(ios, reads);
+	free(ios);
+	if (rv != 0) {
+		for (int i = 0; i < count; i++) {
+			free(bv->buf[i].mem);
+		}
+		free(bv);
+		return -EIO;
+	}
+	*bufp = bv;
+	return 0;
 }
 
 // Writes data to a file.
-// returns -1 on fail, or size on success.
+// returns -1 on fail, or the number of bytes written on success.
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
 				struct fuse_file_info *fi) {
 	int rv = -1;
-	int num = find_inode_index(path);
+	int num = handle_inode(path, fi);
 	if (num < 0) {
 		return rv;
 	}
 	inode_t* node = get_inode(num);
-	printf("write to inode: %d\n", num);
-	node->size = size;
-	// handle multiple block cases with offset
-	grow_inode(node, offset + size);
-
-	blist_t* blocks = get_blist_at(node->block_list);
-	int offset_blocks = offset / BLOCK_SIZE;
-	printf("offset: %ld, offset_blocks: %d\n", offset, offset_blocks);
-	int i = 0;
-	while (blocks != 0) {
-		void* block = get_block_at(blocks->block);
-		// copy from buffer into the block 
-		if (i == offset_blocks) {
-			memcpy(block, buf, BLOCK_SIZE);
+	// handles writes spanning blocks or starting mid-block, growing the file as needed
+	int retried = 0;
+	do {
+		journal_begin();
+		cinode_t *ci = inode_lock(num, 1);
+		rv = file_write(node, buf, size, offset);
+		inode_unlock(ci);
+		journal_end();
+		// blocks freed lately only become free once committed, so it may fit after that
+	} while (rv < 0 && !retried++ && journal_commit_frees());
+	writeback_throttle();
+	if (rv < 0) {
+		rv = -ENOSPC;
+	} else {
+		trace_count(STAT_BYTES_WRITTEN, rv);
+	}
+	return rv;
+}
+
+// Writes data to a file straight from FUSE's buffers: the blocks are allocated first,
+// then the data is copied (or spliced from the FUSE pipe) into the disk image file, or
+// through memory to the engine if FUSE can't splice to it.
+// returns -ENOSPC or -EIO on fail, or the number of bytes written on success.
+int nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+				struct fuse_file_info *fi) {
+	int num = handle_inode(path, fi);
+	if (num < 0) {
+		return -ENOENT;
+	}
+	inode_t* node = get_inode(num);
+	size_t size = fuse_buf_size(buf);
+
+	int max_runs = size / BLOCK_SIZE + 2;
+	file_run_t *runs = malloc(max_runs * sizeof(file_run_t));
+	// held until the size is updated, so concurrent writers can't interleave mappings
+	cinode_t *ci;
+	int count;
+	int retried = 0;
+	do {
+		journal_begin();
+		ci = inode_lock(num, 1);
+		count = file_prepare_write(node, size, offset, runs, max_runs);
+		if (count < 0) {
+			inode_unlock(ci);
+			journal_end();
+		}
+		// blocks freed lately only become free once committed, so it may fit after that
+	} while (count < 0 && !retried++ && journal_commit_frees());
+	if (count < 0) {
+		free(runs);
+		return -ENOSPC;
+	}
+	struct fuse_bufvec *dst =
+		malloc(sizeof(struct fuse_bufvec) + count * sizeof(struct fuse_buf));
+	*dst = FUSE_BUFVEC_INIT(0);
+	dst->count = count;
+	// for engines FUSE can't splice to the image, the data lands in memory, and the engine
+	// writes it out as one batch
+	char *data = backend_splice() ? 0 : malloc(size);
+	data_io_t *ios = malloc(count * sizeof(data_io_t));
+	int writes = 0;
+	for (int i = 0, at = 0; i < count; at += runs[i].size, i++) {
+		struct fuse_buf *fb = &dst->buf[i];
+		memset(fb, 0, sizeof(struct fuse_buf));
+		fb->size = runs[i].size;
+		if (runs[i].mem != 0) {
+			// inline data is copied straight into the inode
+			fb->mem = runs[i].mem;
+		} else if (data != 0) {
+			fb->mem = data + at;
+			ios[writes++] = (data_io_t) { runs[i].pos, fb->mem, runs[i].size };
+		} else {
+			fb->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			fb->fd = get_blocks_fd();
+			fb->pos = runs[i].pos;
 		}
-		if (blocks->next == 0) {
+	}
+
+	ssize_t rv = fuse_buf_copy(dst, buf, 0);
+	free(dst);
+	for (int i = 0; i < writes; i++) {
+		// only what FUSE copied is written
+		ssize_t at = (char *) ios[i].buf - data;
+		if (rv <= at) {
+			writes = i;
 			break;
 		}
-		blocks = get_blist_at(blocks->next);
-		i++;
+		if (rv - at < (ssize_t) ios[i].size) {
+			ios[i].size = rv - at;
+		}
+	}
+	if (rv > 0 && data_write(ios, writes) != 0) {
+		rv = -EIO;
 	}
-	rv = size;
-	printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+	free(ios);
+	free(data);
+	if (rv > 0) {
+		file_end_write(node, runs, count, rv, offset);
+		trace_count(STAT_BYTES_WRITTEN, rv);
+	}
+	free(runs);
+	inode_unlock(ci);
+	journal_end();
+	writeback_throttle();
 	return rv;
 }
 
 // Updates the timestamps on a file or directory.
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
 	int rv = 0;
-	printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", path, ts[0].tv_sec,
-			ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
 	return rv;
 }
 
-// Extended operations.
-int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
-				unsigned int flags, void *data) {
+// Starts writing back a file's data when it is closed, without waiting for it.
+// returns -ENOENT on fail, 0 otherwise.
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+	if (is_virtual_handle(fi)) {
+		// a virtual file has nothing to write
+		return 0;
+	}
+	int num = handle_inode(path, fi);
+	if (num < 0) {
+		return -ENOENT;
+	}
+	cinode_t *ci = inode_lock(num, 0);
+	int rv = file_sync(get_inode(num), 0) < 0 ? -EIO : 0;
+	inode_unlock(ci);
+	return rv;
+}
+
+// Makes a file's data durable, then its size and block mappings by committing the journal.
+// returns -ENOENT or -EIO on fail, 0 otherwise.
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	if (is_virtual_handle(fi)) {
+		return 0;
+	}
+	int num = handle_inode(path, fi);
+	if (num < 0) {
+		return -ENOENT;
+	}
+	// data goes first, so the committed metadata never points at blocks that weren't written
+	cinode_t *ci = inode_lock(num, 0);
+	int rv = file_sync(get_inode(num), 1) < 0 ? -EIO : 0;
+	inode_unlock(ci);
+	journal_commit();
+	return rv;
+}
+
+// Makes a directory's entries durable by committing the journal.
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
 	int rv = 0;
-	printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+	journal_commit();
+	return rv;
+}
+
+// Allocates blocks for a range of a file, or with FALLOC_FL_PUNCH_HOLE, frees them.
+// returns -EOPNOTSUPP for other modes, -ENOSPC if the disk is full, 0 otherwise.
+int nufs_fallocate(const char *path, int mode, off_t offset, off_t len,
+				struct fuse_file_info *fi) {
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+		return -EOPNOTSUPP;
+	}
+	if (offset < 0 || len <= 0) {
+		return -EINVAL;
+	}
+	// logical block numbers are ints
+	if (offset + len > (off_t) INT_MAX * BLOCK_SIZE) {
+		return -EFBIG;
+	}
+	int num = handle_inode(path, fi);
+	if (num < 0) {
+		return -ENOENT;
+	}
+	int rv;
+	int retried = 0;
+	do {
+		journal_begin();
+		cinode_t *ci = inode_lock(num, 1);
+		inode_t *node = get_inode(num);
+		if (mode & FALLOC_FL_PUNCH_HOLE) {
+			rv = file_punch_hole(node, len, offset);
+		} else {
+			rv = file_allocate(node, len, offset, mode & FALLOC_FL_KEEP_SIZE);
+		}
+		inode_unlock(ci);
+		journal_end();
+	} while (rv < 0 && !retried++ && journal_commit_frees());
+	return rv < 0 ? -ENOSPC : 0;
+}
+
+// Finds the next data or hole in a file for NUFS_IOC_SEEK_DATA or NUFS_IOC_SEEK_HOLE,
+// replacing the offset in data with it.
+// returns -ENXIO if there is none, 0 otherwise.
+static int ioctl_seek(int num, int64_t *data, int hole) {
+	cinode_t *ci = inode_lock(num, 0);
+	off_t found = file_seek(get_inode(num), *data, hole);
+	inode_unlock(ci);
+	if (found < 0) {
+		return -ENXIO;
+	}
+	*data = found;
+	return 0;
+}
+
+// Gets the attribute flags of a file for FS_IOC_GETFLAGS, or sets them for
+// FS_IOC_SETFLAGS, as lsattr and chattr do. Compression is the only one there is.
+// returns -EOPNOTSUPP if other flags are set, 0 otherwise.
+static int ioctl_flags(int num, int *flags, int set) {
+	if (set && (*flags & ~FS_COMPR_FL)) {
+		return -EOPNOTSUPP;
+	}
+	journal_begin();
+	cinode_t *ci = inode_lock(num, set);
+	inode_t *node = get_inode(num);
+	if (set) {
+		// data already written stays as it is until it is next written
+		journal_dirty(node, sizeof(inode_t));
+		node->flags = *flags ? node->flags | INODE_COMPRESS : node->flags & ~INODE_COMPRESS;
+	} else {
+		*flags = node->flags & INODE_COMPRESS ? FS_COMPR_FL : 0;
+	}
+	inode_unlock(ci);
+	journal_end();
+	return 0;
+}
+
+// Checks the ranges of a clone or dedupe of len bytes of from at src_offset to at
+// dest_offset, where same says whether the files are the same.
+// returns -EINVAL if the ranges are unsuitable, -EFBIG if the destination would be too big,
+// 0 otherwise.
+static int check_clone(inode_t *to, inode_t *from, int same, int64_t src_offset, int64_t len,
+		int64_t dest_offset) {
+	// only a range ending at the end of both files may end partway through a block
+	int whole = len % BLOCK_SIZE == 0
+		|| (src_offset + len == from->size && dest_offset + len >= to->size);
+	if (!S_ISREG(to->mode) || !S_ISREG(from->mode)) {
+		return -EINVAL;
+	} else if (len < 0 || src_offset + len > from->size || src_offset % BLOCK_SIZE
+			|| dest_offset % BLOCK_SIZE || !whole) {
+		return -EINVAL;
+	} else if (same && src_offset < dest_offset + len && dest_offset < src_offset + len) {
+		return -EINVAL;
+	} else if (dest_offset + len > (off_t) INT_MAX * BLOCK_SIZE) {
+		return -EFBIG;
+	}
+	return 0;
+}
+
+// Makes a range of one file share the blocks of another for NUFS_IOC_CLONE_RANGE.
+// returns -EINVAL if the ranges are unsuitable, -ENOSPC if the disk is full, 0 otherwise.
+static int ioctl_clone(int dst, nufs_clone_range_t *range) {
+	range->src_path[NUFS_CLONE_PATH_MAX - 1] = 0;
+	int src = find_inode_index(range->src_path);
+	if (src < 0) {
+		return -ENOENT;
+	}
+	if (range->src_offset < 0 || range->src_length < 0 || range->dest_offset < 0) {
+		return -EINVAL;
+	}
+	cinode_t *a, *b;
+	journal_begin();
+	inode_lock_pair(dst, src, &a, &b);
+	inode_t *to = get_inode(dst);
+	inode_t *from = get_inode(src);
+	int64_t len = range->src_length != 0 ? range->src_length : from->size - range->src_offset;
+	int rv = check_clone(to, from, src == dst, range->src_offset, len, range->dest_offset);
+	if (rv == 0 && len > 0 && file_clone(to, from, range->src_offset, len, range->dest_offset) != 0) {
+		rv = -ENOSPC;
+	}
+	inode_unlock(b);
+	inode_unlock(a);
+	journal_end();
 	return rv;
 }
 
+// Makes a range of one file share the blocks of another if they hold the same data, for
+// NUFS_IOC_DEDUPE_RANGE.
+// returns -EINVAL if the ranges are unsuitable, -ENOSPC if the disk is full, 0 otherwise.
+static int ioctl_dedupe(int dst, nufs_dedupe_range_t *range) {
+	range->src_path[NUFS_CLONE_PATH_MAX - 1] = 0;
+	int src = find_inode_index(range->src_path);
+	if (src < 0) {
+		return -ENOENT;
+	}
+	if (range->src_offset < 0 || range->length < 0 || range->dest_offset < 0) {
+		return -EINVAL;
+	}
+	cinode_t *a, *b;
+	journal_begin();
+	inode_lock_pair(dst, src, &a, &b);
+	inode_t *to = get_inode(dst);
+	inode_t *from = get_inode(src);
+	int64_t len = range->length;
+	int rv = check_clone(to, from, src == dst, range->src_offset, len, range->dest_offset);
+	if (rv == 0 && range->dest_offset + len > to->size) {
+		rv = -EINVAL;
+	}
+	size_t deduped = 0;
+	int same = 1;
+	if (rv == 0 && len > 0) {
+		same = file_dedupe(to, from, range->src_offset, len, range->dest_offset, &deduped);
+		rv = same < 0 ? -ENOSPC : 0;
+	}
+	inode_unlock(b);
+	inode_unlock(a);
+	journal_end();
+	range->status = same > 0 ? NUFS_DEDUPE_SAME : NUFS_DEDUPE_DIFFERS;
+	range->bytes_deduped = deduped;
+	return rv;
+}
+
+// Extended operations, as defined in ioctl.h.
+int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+				unsigned int flags, void *data) {
+	if (is_virtual_handle(fi) || (flags & FUSE_IOCTL_COMPAT)) {
+		return -ENOTTY;
+	}
+	int num = handle_inode(path, fi);
+	if (num < 0) {
+		return -ENOENT;
+	}
+	switch ((unsigned int) cmd) {
+	case NUFS_IOC_SEEK_DATA:
+		return ioctl_seek(num, data, 0);
+	case NUFS_IOC_SEEK_HOLE:
+		return ioctl_seek(num, data, 1);
+	case NUFS_IOC_CLONE_RANGE:
+		return ioctl_clone(num, data);
+	case NUFS_IOC_DEDUPE_RANGE:
+		return ioctl_dedupe(num, data);
+	case FS_IOC_GETFLAGS:
+		return ioctl_flags(num, data, 0);
+	case FS_IOC_SETFLAGS:
+		return ioctl_flags(num, data, 1);
+	}
+	return -ENOTTY;
+}
+
+// Sets up the connection: ask for large writes, and for data to be spliced
+// between the FUSE device and the disk image rather than copied.
+void *nufs_init(struct fuse_conn_info *conn) {
+	conn->want |= FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ
+		| FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+	// started here rather than in main, since fuse_main daemonizes by forking
+	journal_start_thread();
+	writeback_start_thread();
+	return NULL;
+}
+
+#if NUFS_TRACE
+// Define traced_<name>, which times nufs_<name> as op, along with the size and offset asked for.
+#define TRACED(name, op, size, offset, params, args) \
+	static int traced_##name params { \
+		uint64_t start = trace_begin(); \
+		int rv = nufs_##name args; \
+		trace_end(op, start, rv, size, offset); \
+		return rv; \
+	}
+
+TRACED(access, OP_ACCESS, 0, 0, (const char *path, int mask), (path, mask))
+TRACED(getattr, OP_GETATTR, 0, 0, (const char *path, struct stat *st), (path, st))
+TRACED(fgetattr, OP_FGETATTR, 0, 0, (const char *path, struct stat *st, struct fuse_file_info *fi),
+		(path, st, fi))
+TRACED(opendir, OP_OPENDIR, 0, 0, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(releasedir, OP_RELEASEDIR, 0, 0, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(readdir, OP_READDIR, 0, offset, (const char *path, void *buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+TRACED(mknod, OP_MKNOD, 0, 0, (const char *path, mode_t mode, dev_t rdev), (path, mode, rdev))
+TRACED(create, OP_CREATE, 0, 0, (const char *path, mode_t mode, struct fuse_file_info *fi),
+		(path, mode, fi))
+TRACED(mkdir, OP_MKDIR, 0, 0, (const char *path, mode_t mode), (path, mode))
+TRACED(link, OP_LINK, 0, 0, (const char *from, const char *to), (from, to))
+TRACED(unlink, OP_UNLINK, 0, 0, (const char *path), (path))
+TRACED(rmdir, OP_RMDIR, 0, 0, (const char *path), (path))
+TRACED(rename, OP_RENAME, 0, 0, (const char *from, const char *to), (from, to))
+TRACED(chmod, OP_CHMOD, 0, 0, (const char *path, mode_t mode), (path, mode))
+TRACED(truncate, OP_TRUNCATE, size, 0, (const char *path, off_t size), (path, size))
+TRACED(ftruncate, OP_FTRUNCATE, size, 0, (const char *path, off_t size, struct fuse_file_info *fi),
+		(path, size, fi))
+TRACED(open, OP_OPEN, 0, 0, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(release, OP_RELEASE, 0, 0, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(read, OP_READ, size, offset, (const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi), (path, buf, size, offset, fi))
+TRACED(read_buf, OP_READ_BUF, size, offset, (const char *path, struct fuse_bufvec **bufp,
+		size_t size, off_t offset, struct fuse_file_info *fi), (path, bufp, size, offset, fi))
+TRACED(write, OP_WRITE, size, offset, (const char *path, const char *buf, size_t size,
+		off_t offset, struct fuse_file_info *fi), (path, buf, size, offset, fi))
+TRACED(write_buf, OP_WRITE_BUF, fuse_buf_size(buf), offset, (const char *path,
+		struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi), (path, buf, offset, fi))
+TRACED(flush, OP_FLUSH, 0, 0, (const char *path, struct fuse_file_info *fi), (path, fi))
+TRACED(fsync, OP_FSYNC, 0, 0, (const char *path, int datasync, struct fuse_file_info *fi),
+		(path, datasync, fi))
+TRACED(fsyncdir, OP_FSYNCDIR, 0, 0, (const char *path, int datasync, struct fuse_file_info *fi),
+		(path, datasync, fi))
+TRACED(utimens, OP_UTIMENS, 0, 0, (const char *path, const struct timespec ts[2]), (path, ts))
+TRACED(fallocate, OP_FALLOCATE, len, offset, (const char *path, int mode, off_t offset,
+		off_t len, struct fuse_file_info *fi), (path, mode, offset, len, fi))
+TRACED(ioctl, OP_IOCTL, 0, 0, (const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+		unsigned int flags, void *data), (path, cmd, arg, fi, flags, data))
+
+#define OP(name) traced_##name
+#else
+#define OP(name) nufs_##name
+#endif
+
 // Initializing operations.
 void nufs_init_ops(struct fuse_operations *ops) {
 	memset(ops, 0, sizeof(struct fuse_operations));
-	ops->access = nufs_access;
-	ops->getattr = nufs_getattr;
-	ops->readdir = nufs_readdir;
-	ops->mknod = nufs_mknod;
-	ops->mkdir = nufs_mkdir;
-	ops->link = nufs_link;
-	ops->unlink = nufs_unlink;
-	ops->rmdir = nufs_rmdir;
-	ops->rename = nufs_rename;
-	ops->chmod = nufs_chmod;
-	ops->truncate = nufs_truncate;
-	ops->open = nufs_open;
-	ops->read = nufs_read;
-	ops->write = nufs_write;
-	ops->utimens = nufs_utimens;
-	ops->ioctl = nufs_ioctl;
+	ops->init = nufs_init;
+	ops->access = OP(access);
+	ops->getattr = OP(getattr);
+	ops->fgetattr = OP(fgetattr);
+	ops->opendir = OP(opendir);
+	ops->readdir = OP(readdir);
+	ops->releasedir = OP(releasedir);
+	ops->mknod = OP(mknod);
+	ops->create = OP(create);
+	ops->mkdir = OP(mkdir);
+	ops->link = OP(link);
+	ops->unlink = OP(unlink);
+	ops->rmdir = OP(rmdir);
+	ops->rename = OP(rename);
+	ops->chmod = OP(chmod);
+	ops->truncate = OP(truncate);
+	ops->ftruncate = OP(ftruncate);
+	ops->open = OP(open);
+	ops->release = OP(release);
+	ops->read = OP(read);
+	ops->read_buf = OP(read_buf);
+	ops->write = OP(write);
+	ops->write_buf = OP(write_buf);
+	ops->flush = OP(flush);
+	ops->fsync = OP(fsync);
+	ops->fsyncdir = OP(fsyncdir);
+	ops->utimens = OP(utimens);
+	ops->fallocate = OP(fallocate);
+	ops->ioctl = OP(ioctl);
+	// operations on open files and directories use their handles, so FUSE needn't
+	// build their paths
+	ops->flag_nullpath_ok = 1;
+	ops->flag_nopath = 1;
 };
 
 struct fuse_operations nufs_ops;
 
+// The mount options nufs handles itself.
+typedef struct nufs_config {
+	writeback_config_t writeback;
+	int trace; // record every operation in the ring buffers read through /.nufs/trace
+	int compress; // compress every file written, not just those marked with chattr +c
+	char *backend; // the engine doing the I/O of file data (see backend.h)
+	int direct; // bypass the page cache for file data
+	int cache_size; // MB of file data cached in nufs itself (see cache.h), or -1 for the default
+} nufs_config_t;
+
+// Mount options, e.g. -o dirty_expire=10,trace.
+static const struct fuse_opt nufs_opts[] = {
+	{ "dirty_background=%d", offsetof(nufs_config_t, writeback.background), 0 },
+	{ "dirty_limit=%d", offsetof(nufs_config_t, writeback.limit), 0 },
+	{ "dirty_expire=%d", offsetof(nufs_config_t, writeback.expire), 0 },
+	{ "writeback_interval=%d", offsetof(nufs_config_t, writeback.interval), 0 },
+	{ "trace", offsetof(nufs_config_t, trace), 1 },
+	{ "compress", offsetof(nufs_config_t, compress), 1 },
+	{ "backend=%s", offsetof(nufs_config_t, backend), 0 },
+	{ "direct", offsetof(nufs_config_t, direct), 1 },
+	{ "cache_size=%d", offsetof(nufs_config_t, cache_size), 0 },
+	FUSE_OPT_END
+};
+
 int main(int argc, char *argv[]) {
-	assert(argc > 2 && argc < 6);
+	assert(argc > 2);
+	// the writeback options are read first, since loading the image checks them
+	struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv);
+	nufs_config_t config = { writeback_config, 0, 0, 0, 0, cache_mb };
+	if (fuse_opt_parse(&args, &config, nufs_opts, NULL) != 0) {
+		return 1;
+	}
+	writeback_config = config.writeback;
+	trace_init(config.trace);
+	compress_all = config.compress;
+	cache_mb = config.cache_size;
+	const char *backend = config.backend != 0 ? config.backend : "mmap";
+	if (backend_select(backend, config.direct) != 0) {
+		fprintf(stderr, "nufs: no %s engine%s\n", backend, config.direct ? " that can use O_DIRECT" : "");
+		return 1;
+	}
 	// load and initialize the disk image passed
-	blocks_init(argv[--argc]); 
+	if (blocks_init(argv[argc - 1]) != 0) {
+		return 1;
+	}
 	directory_init();
 	nufs_init_ops(&nufs_ops);
-	return fuse_main(argc, argv, &nufs_ops, NULL);
+	int rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+	fuse_opt_free_args(&args);
+	// commits what is left in the journal
+	blocks_free();
+	return rv;
 }
@@ -0,0 +1,114 @@
+/* Reference counts of shared data blocks.
+ * Counts only change under refcount_lock, but are read without it: a file sees its own
+ * blocks' counts go up only while it is locked, so a count read as 0 stays 0. */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "journal.h"
+#include "refcount.h"
+
+static pthread_mutex_t refcount_lock = PTHREAD_MUTEX_INITIALIZER; // guards the table and its index
+
+// Return the table block holding the counts of the chunk the given block is in, or null.
+static uint32_t *counts_of(int block) {
+	uint32_t table = __atomic_load_n(&get_refcount_map()[block / REFCOUNT_CHUNK], __ATOMIC_ACQUIRE);
+	return table == 0 ? 0 : get_block_at(table);
+}
+
+// Return the count of the given block.
+uint32_t refcount_get(int block) {
+	uint32_t *counts = counts_of(block);
+	return counts == 0 ? 0 : __atomic_load_n(&counts[block % REFCOUNT_CHUNK], __ATOMIC_RELAXED);
+}
+
+// Return how many blocks from block on are shared (or aren't) before the first that differs.
+int refcount_run(int block, int count, int shared) {
+	int n = 0;
+	while (n < count) {
+		int b = block + n;
+		int64_t chunk_end = ((int64_t) b / REFCOUNT_CHUNK + 1) * REFCOUNT_CHUNK;
+		int len = chunk_end - b < count - n ? chunk_end - b : count - n;
+		uint32_t *counts = counts_of(b);
+		if (counts == 0) {
+			// a chunk with no table has no shared blocks
+			if (shared) {
+				return n;
+			}
+			n += len;
+			continue;
+		}
+		for (int end = n + len; n < end; n++) {
+			int is_shared = __atomic_load_n(&counts[(block + n) % REFCOUNT_CHUNK], __ATOMIC_RELAXED) != 0;
+			if (is_shared != shared) {
+				return n;
+			}
+		}
+	}
+	return n;
+}
+
+// Make sure the table has room for the counts of count blocks starting at block.
+// returns 0 on success, -1 if the disk is full.
+int refcount_reserve(int block, int count) {
+	uint32_t *map = get_refcount_map();
+	int first = block / REFCOUNT_CHUNK;
+	int last = (block + count - 1) / REFCOUNT_CHUNK;
+	int rv = 0;
+	pthread_mutex_lock(&refcount_lock);
+	for (int c = first; c <= last && rv == 0; c++) {
+		if (map[c] != 0) {
+			continue;
+		}
+		// the counts go near the blocks they count
+		int got;
+		int table = alloc_blocks(group_first_block(block_group(c * REFCOUNT_CHUNK)), 1, &got);
+		if (table < 0) {
+			rv = -1;
+			break;
+		}
+		journal_dirty(get_block_at(table), BLOCK_SIZE);
+		memset(get_block_at(table), 0, BLOCK_SIZE);
+		journal_dirty(&map[c], sizeof(uint32_t));
+		__atomic_store_n(&map[c], table, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&refcount_lock);
+	return rv;
+}
+
+// Add a reference to count blocks starting at block.
+void refcount_share(int block, int count) {
+	pthread_mutex_lock(&refcount_lock);
+	while (count > 0) {
+		uint32_t *counts = counts_of(block);
+		int within = block % REFCOUNT_CHUNK;
+		int n = REFCOUNT_CHUNK - within < count ? REFCOUNT_CHUNK - within : count;
+		journal_dirty(&counts[within], n * sizeof(uint32_t));
+		for (int i = 0; i < n; i++) {
+			__atomic_store_n(&counts[within + i], counts[within + i] + 1, __ATOMIC_RELAXED);
+		}
+		block += n;
+		count -= n;
+	}
+	pthread_mutex_unlock(&refcount_lock);
+}
+
+// Drop a reference to the given block if it is shared.
+// returns 1 if it was, 0 if the caller should free it.
+int refcount_drop(int block) {
+	uint32_t *counts = counts_of(block);
+	if (counts == 0) {
+		return 0;
+	}
+	uint32_t *count = &counts[block % REFCOUNT_CHUNK];
+	int shared = 0;
+	pthread_mutex_lock(&refcount_lock);
+	if (*count != 0) {
+		journal_dirty(count, sizeof(uint32_t));
+		__atomic_store_n(count, *count - 1, __ATOMIC_RELAXED);
+		shared = 1;
+	}
+	pthread_mutex_unlock(&refcount_lock);
+	return shared;
+}
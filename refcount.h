@@ -0,0 +1,34 @@
+/* Reference counts of data blocks that files share, after a clone.
+ * A block's count is the number of extents mapping it besides the first, so a block only
+ * one file maps has a count of 0, and only shared blocks need the table at all. Like the
+ * inode table (see inode.h), the table is allocated a block at a time: an index in the
+ * superblock's metadata maps each chunk of REFCOUNT_CHUNK blocks to the table block holding
+ * their counts, and a chunk that never had a shared block has none. Table blocks are kept
+ * once allocated. */
+
+#ifndef REFCOUNT_H
+#define REFCOUNT_H
+
+#include <stdint.h>
+
+#define REFCOUNT_CHUNK 1024 // blocks whose counts fit in one block of the table
+
+// Return the count of the given block.
+uint32_t refcount_get(int block);
+
+// Return how many of the count blocks starting at block are shared with other files, or
+// with shared unset, aren't, before the first block that differs. Needs no lock.
+int refcount_run(int block, int count, int shared);
+
+// Make sure the table has room for the counts of count blocks starting at block.
+// Returns 0 on success, -1 if the disk is full.
+int refcount_reserve(int block, int count);
+
+// Add a reference to count blocks starting at block, which must have room in the table.
+void refcount_share(int block, int count);
+
+// Drop a reference to the given block if it is shared, returning whether it was.
+// A block that isn't shared is left for the caller to free.
+int refcount_drop(int block);
+
+#endif
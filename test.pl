@@ -2,11 +2,13 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::Simple tests => 59;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($opts) = @_;
+    $opts //= "";
+    system("(make mount MOUNT_OPTS='$opts' 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -14,6 +16,11 @@ sub unmount {
     system("(make unmount 2>&1) >> test.log");
 }
 
+# As if the machine went down: nufs gets no chance to commit or write back anything.
+sub crash {
+    system("pkill -KILL -x nufs; sleep 1; (fusermount -u mnt 2>&1) >> test.log");
+}
+
 sub write_text {
     my ($name, $data) = @_;
     open my $fh, ">", "mnt/$name" or return;
@@ -31,6 +38,14 @@ sub read_text {
     return $data;
 }
 
+sub write_text_slice {
+    my ($name, $data, $offset) = @_;
+    open my $fh, "+<", "mnt/$name" or return;
+    seek $fh, $offset, 0;
+    print $fh $data;
+    close $fh;
+}
+
 sub read_text_slice {
     my ($name, $count, $offset) = @_;
     open my $fh, "<", "mnt/$name" or return "";
@@ -41,6 +56,12 @@ sub read_text_slice {
     return $data;
 }
 
+# Returns a counter from the statistics of the mounted filesystem.
+sub stat_count {
+    my ($name) = @_;
+    return read_text(".nufs/stats") =~ /^$name\s+(\d+)$/m ? $1 : -1;
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -75,6 +96,11 @@ my $long2 = read_text_slice("2k.txt", 10, 50);
 my $right = "ng is four";
 ok($long2 eq $right, "Read with offset & length");
 
+write_text_slice("2k.txt", "OVERWRITTEN", 4090);
+my $long3 = read_text_slice("2k.txt", 20, 4085);
+ok($long3 eq substr($long0, 4085, 5) . "OVERWRITTEN" . substr($long0, 4101, 4),
+   "Write across a block boundary");
+
 unmount();
 
 (!-e "mnt/one.txt") or die "one.txt exists after umount; FS never mounted?";
@@ -131,6 +157,42 @@ system("mv mnt/tmp/file.txt mnt/foo");
 ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
+write_text("tmp/old.txt", "old");
+rename("mnt/foo/file.txt", "mnt/tmp/old.txt");
+ok(read_text("tmp/old.txt") eq $msg4 && !-e "mnt/foo/file.txt", "Rename over an existing file");
+ok(!rename("mnt/tmp", "mnt/foo") && $!{ENOTEMPTY} && -d "mnt/foo/bar/baz",
+    "Rename over a non-empty directory fails");
+
+say "# Open files";
+open my $of, "+>", "mnt/open.txt";
+$of->autoflush(1);
+print $of "written before";
+rename("mnt/open.txt", "mnt/moved.txt");
+print $of ", after renaming";
+ok(read_text("moved.txt") eq "written before, after renaming",
+    "Writing to an open file that was renamed changes it under its new name");
+unlink("mnt/moved.txt");
+print $of ", after unlinking";
+seek $of, 0, 0;
+my $unlinked = do { local $/ = undef; <$of> } // "";
+close $of;
+ok(!-e "mnt/moved.txt" && $unlinked eq "written before, after renaming, after unlinking",
+    "An open file that was unlinked can still be written and read");
+
+say "# Large directories";
+mkdir("mnt/big");
+write_text("big/name$_", $_) for 1..300;
+opendir(my $dh, "mnt/big");
+my %seen;
+my $made = 0;
+while (defined(my $name = readdir($dh))) {
+    $seen{$name}++;
+    # names made while listing may or may not show up, but never twice
+    write_text("big/late" . $made++, "") if $made < 100;
+}
+closedir($dh);
+ok(!grep({ ($seen{"name$_"} // 0) != 1 } 1..300) && !grep({ $_ > 1 } values %seen),
+    "Listing a growing directory shows each name once");
 
 unmount();
 
@@ -171,5 +233,127 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# Sparse files";
+# far bigger than the 1MB volume, so only a hole can hold it
+write_text("sparse.txt", "start");
+truncate("mnt/sparse.txt", 64 * 1024 * 1024);
+write_text_slice("sparse.txt", "end", 32 * 1024 * 1024);
+ok((-s "mnt/sparse.txt") == 64 * 1024 * 1024, "Truncating a file past the volume's size leaves a hole");
+ok(read_text_slice("sparse.txt", 8, 32 * 1024 * 1024 - 5) eq "\0\0\0\0\0end",
+    "A hole reads as zeros up to the data after it");
+
+say "# Clones";
+system("./clone.nufs mnt/larger.txt mnt/clone.txt");
+ok(read_text("clone.txt") eq $content, "A clone reads the same as its source");
+write_text_slice("clone.txt", "changed", 4096);
+ok(read_text("larger.txt") eq $content && read_text_slice("clone.txt", 7, 4096) eq "changed",
+    "Writing to a clone leaves its source as it was");
+system("./dedup.nufs mnt >> test.log");
+ok(read_text("larger.txt") eq $content && read_text_slice("clone.txt", 7, 4096) eq "changed",
+    "Deduplicating leaves files reading as they did");
+
+say "# Compression";
+write_text("packed.txt", "");
+system("chattr +c mnt/packed.txt");
+my $repeated = "compress me " x 20000;
+write_text("packed.txt", $repeated);
+ok(read_text("packed.txt") eq $repeated, "Read back a compressed file correctly");
+
+say "# Inline data";
+my $allocated = stat_count("blocks_allocated");
+write_text("small.txt", "s" x 223);
+ok(read_text("small.txt") eq "s" x 223 && stat_count("blocks_allocated") == $allocated,
+    "A file of up to 224 bytes needs no block");
+write_text_slice("small.txt", "grown", 224);
+ok(read_text("small.txt") eq ("s" x 223) . "\ngrown" && stat_count("blocks_allocated") > $allocated,
+    "Growing a file past 224 bytes moves its data to a block");
+truncate("mnt/small.txt", 0);
+$allocated = stat_count("blocks_allocated");
+write_text("small.txt", "small again");
+mkdir("mnt/small");
+write_text("small/$_", $_) for 1..3;
+my $inline = stat_count("blocks_allocated") == $allocated;
+write_text("small/$_", $_) for 4..20;
+my @names = sort { $a <=> $b } split /\n/, `ls mnt/small`;
+ok($inline && read_text("small.txt") eq "small again" && stat_count("blocks_allocated") > $allocated
+    && "@names" eq "@{[1..20]}" && !grep({ read_text("small/$_") ne $_ } 1..20),
+    "Files truncated to nothing and small directories need no blocks until they grow");
 
+unmount();
+sleep 1;
+
+ok(system("./fsck.nufs -n data.nufs >> test.log") == 0, "fsck finds the image consistent");
+
+say "# Engines";
+for my $opts ("backend=pread", "backend=uring", "backend=pread,direct") {
+    system("rm -f data.nufs");
+    mount("-o $opts");
+    my $data = "1_2_3_4_5_6_7_8_" x 2000;
+    write_text("data.txt", $data);
+    write_text_slice("data.txt", "OVERWRITTEN", 4090);
+    substr($data, 4090, 11) = "OVERWRITTEN";
+    write_text("sparse.txt", "start");
+    truncate("mnt/sparse.txt", 8 * 1024 * 1024);
+    write_text_slice("sparse.txt", "end", 4 * 1024 * 1024);
+    ok(read_text("data.txt") eq $data
+        && read_text_slice("sparse.txt", 8, 4 * 1024 * 1024 - 5) eq "\0\0\0\0\0end",
+        "Read back files written with $opts");
+    unmount();
+    mount("-o $opts");
+    ok(read_text("data.txt") eq $data && read_text_slice("sparse.txt", 5, 0) eq "start",
+        "Read back files written with $opts after remounting");
+    unmount();
+}
+
+say "# Block cache";
+system("rm -f data.nufs");
+mount("-o cache_size=1");
+my $cached = "cache me, " x 8000;
+write_text("cached.txt", $cached);
+my $misses = stat_count("buffer_misses");
+my $first = read_text("cached.txt");
+my $hits = stat_count("buffer_hits");
+my $missed = stat_count("buffer_misses") - $misses;
+my $second = read_text("cached.txt");
+ok($first eq $cached && $second eq $cached && $missed > 0
+    && stat_count("buffer_hits") > $hits && stat_count("buffer_misses") == $misses + $missed,
+    "A file read again comes from the cache");
+write_text_slice("cached.txt", "OVERWRITTEN", 40000);
+$hits = stat_count("buffer_hits");
+ok(read_text_slice("cached.txt", 11, 40000) eq "OVERWRITTEN"
+    && stat_count("buffer_hits") > $hits && stat_count("buffer_misses") == $misses + $missed,
+    "Overwriting a cached file updates the cache");
+unmount();
+
+say "# Durability";
+for my $engine ("pread", "uring") {
+    system("rm -f data.nufs");
+    mount("-o backend=$engine");
+    open my $fh, ">", "mnt/synced.txt";
+    print $fh "made durable by fsync";
+    my $synced = $fh->sync;
+    close $fh;
+    crash();
+    mount("-o backend=$engine");
+    ok($synced && read_text("synced.txt") eq "made durable by fsync",
+        "A file fsynced on the $engine engine survives a crash");
+    unmount();
+}
+
+say "# Crash recovery";
+system("rm -f data.nufs");
+mount();
+my $kept = "kept through the crash." x 2000;
+open my $fh, ">", "mnt/kept.txt";
+print $fh $kept;
+$fh->sync;
+close $fh;
+unlink("mnt/kept.txt");
+# fills the volume, so its blocks would be reused if the unlink didn't have to commit first
+write_text("filler.txt", "F" x (2 * 1024 * 1024));
+crash();
+mount();
+ok(!-e "mnt/kept.txt" || read_text("kept.txt") eq $kept,
+    "A file deleted just before a crash comes back intact or not at all");
+unmount();
+ok(system("./fsck.nufs -n data.nufs >> test.log") == 0, "fsck finds the image consistent after a crash");
@@ -0,0 +1,283 @@
+/* Tracing and statistics.
+ * Each thread registers its own trace_thread_t the first time it records anything. Only
+ * that thread ever writes it, with plain atomic stores rather than read-modify-writes;
+ * readers load the fields atomically and may see them a moment out of date. The state of
+ * a thread that exits is handed to the next new thread, so totals are never lost. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#if NUFS_TRACE
+
+static const char *op_names[OP_COUNT] = {
+	"access", "getattr", "fgetattr", "opendir", "readdir", "releasedir", "mknod", "create",
+	"mkdir", "unlink", "link", "rmdir", "rename", "chmod", "truncate", "ftruncate", "open",
+	"release", "read", "read_buf", "write", "write_buf", "flush", "fsync", "fsyncdir",
+	"utimens", "fallocate", "ioctl",
+};
+
+static const char *stat_names[STAT_COUNT] = {
+	"bytes_read", "bytes_written", "block_allocs", "blocks_allocated", "blocks_freed",
+	"inodes_allocated", "inodes_freed", "dcache_hits", "dcache_misses", "buffer_hits",
+	"buffer_misses", "journal_commits", "journal_blocks", "journal_replays", "journal_splits",
+	"writeback_blocks",
+};
+
+// Everything one thread has recorded.
+typedef struct trace_thread {
+	uint64_t ops[OP_COUNT];
+	uint64_t total_ns[OP_COUNT];
+	uint64_t histogram[OP_COUNT][TRACE_BUCKETS];
+	int64_t counts[STAT_COUNT];
+	trace_event_t *ring; // null unless tracing
+	uint64_t head;       // events ever recorded; the newest is at head - 1
+	int id;
+	int in_use;
+	struct trace_thread *next;
+} trace_thread_t;
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER; // guards the list of threads
+static trace_thread_t *threads = 0;
+static int thread_count = 0;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key; // lets a thread's state be handed on when it exits
+static __thread trace_thread_t *self = 0;
+static int tracing = 0;
+static uint64_t epoch = 0; // when the volume was mounted
+
+// Return the time in ns.
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Add n to a field only the calling thread writes.
+static void add(uint64_t *field, uint64_t n) {
+	__atomic_store_n(field, __atomic_load_n(field, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// Let the next new thread take over the state of an exiting one.
+static void release_thread(void *arg) {
+	trace_thread_t *t = arg;
+	pthread_mutex_lock(&threads_lock);
+	t->in_use = 0;
+	pthread_mutex_unlock(&threads_lock);
+}
+
+// Set up the key that notices threads exiting.
+static void make_key() {
+	pthread_key_create(&key, release_thread);
+}
+
+// Return the calling thread's state, registering it the first time.
+static trace_thread_t *get_self() {
+	if (self != 0) {
+		return self;
+	}
+	pthread_once(&key_once, make_key);
+	pthread_mutex_lock(&threads_lock);
+	trace_thread_t *t = threads;
+	while (t != 0 && t->in_use) {
+		t = t->next;
+	}
+	if (t == 0) {
+		t = calloc(1, sizeof(trace_thread_t));
+		t->id = thread_count++;
+		t->next = threads;
+		threads = t;
+	}
+	t->in_use = 1;
+	if (tracing && t->ring == 0) {
+		t->ring = calloc(TRACE_RING_SIZE, sizeof(trace_event_t));
+	}
+	pthread_mutex_unlock(&threads_lock);
+	pthread_setspecific(key, t);
+	self = t;
+	return t;
+}
+
+// Start keeping statistics, and record events too if tracing is set.
+void trace_init(int tracing_on) {
+	tracing = tracing_on;
+	epoch = now_ns();
+}
+
+// Return the time an operation starts, to pass to trace_end.
+uint64_t trace_begin() {
+	return now_ns();
+}
+
+// Note that an operation started at start just finished with the given result.
+void trace_end(trace_op_t op, uint64_t start, int64_t result, int64_t size, int64_t offset) {
+	uint64_t ns = now_ns() - start;
+	trace_thread_t *t = get_self();
+	add(&t->ops[op], 1);
+	add(&t->total_ns[op], ns);
+	int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+	add(&t->histogram[op][bucket < TRACE_BUCKETS ? bucket : TRACE_BUCKETS - 1], 1);
+	if (t->ring == 0) {
+		return;
+	}
+
+	trace_event_t ev = {
+		.start = start - epoch,
+		.duration = ns < UINT32_MAX ? ns : UINT32_MAX,
+		.op = op,
+		.thread = t->id,
+		.result = result,
+		.size = size,
+		.offset = offset,
+	};
+	// stored a word at a time, since a reader may be copying the slot
+	uint64_t *slot = (uint64_t *) &t->ring[t->head % TRACE_RING_SIZE];
+	for (int i = 0; i < sizeof(trace_event_t) / 8; i++) {
+		__atomic_store_n(&slot[i], ((uint64_t *) &ev)[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+
+// Add n to a counter.
+void trace_count(trace_stat_t stat, int64_t n) {
+	add((uint64_t *) &get_self()->counts[stat], n);
+}
+
+// Format a time given in ns with a sensible unit into buf, and return it.
+static char *format_time(char *buf, const char *prefix, double ns) {
+	if (ns < 1000) {
+		sprintf(buf, "%s%.0fns", prefix, ns);
+	} else if (ns < 1e6) {
+		sprintf(buf, "%s%.1fus", prefix, ns / 1e3);
+	} else if (ns < 1e9) {
+		sprintf(buf, "%s%.1fms", prefix, ns / 1e6);
+	} else {
+		sprintf(buf, "%s%.1fs", prefix, ns / 1e9);
+	}
+	return buf;
+}
+
+// Return the bucket below whose upper bound the given fraction of the operations fall.
+static int percentile(uint64_t *histogram, uint64_t count, double fraction) {
+	uint64_t seen = 0;
+	for (int i = 0; i < TRACE_BUCKETS; i++) {
+		seen += histogram[i];
+		if (seen >= fraction * count) {
+			return i;
+		}
+	}
+	return TRACE_BUCKETS - 1;
+}
+
+// Write the statistics as text into a new buffer, setting size to its length.
+char *trace_stats(size_t *size) {
+	uint64_t ops[OP_COUNT] = {0};
+	uint64_t total_ns[OP_COUNT] = {0};
+	uint64_t histogram[OP_COUNT][TRACE_BUCKETS] = {{0}};
+	int64_t counts[STAT_COUNT] = {0};
+	pthread_mutex_lock(&threads_lock);
+	for (trace_thread_t *t = threads; t != 0; t = t->next) {
+		for (int op = 0; op < OP_COUNT; op++) {
+			ops[op] += __atomic_load_n(&t->ops[op], __ATOMIC_RELAXED);
+			total_ns[op] += __atomic_load_n(&t->total_ns[op], __ATOMIC_RELAXED);
+			for (int i = 0; i < TRACE_BUCKETS; i++) {
+				histogram[op][i] += __atomic_load_n(&t->histogram[op][i], __ATOMIC_RELAXED);
+			}
+		}
+		for (int s = 0; s < STAT_COUNT; s++) {
+			counts[s] += __atomic_load_n(&t->counts[s], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	char *buf;
+	char avg[32], p50[32], p99[32], bound[32];
+	FILE *out = open_memstream(&buf, size);
+	fprintf(out, "%-10s %10s %10s %10s %10s\n", "op", "count", "avg", "p50", "p99");
+	for (int op = 0; op < OP_COUNT; op++) {
+		if (ops[op] == 0) {
+			continue;
+		}
+		// percentiles are the upper bounds of their buckets
+		fprintf(out, "%-10s %10lu %10s %10s %10s\n", op_names[op], ops[op],
+			format_time(avg, "", (double) total_ns[op] / ops[op]),
+			format_time(p50, "<", 1ull << percentile(histogram[op], ops[op], 0.5)),
+			format_time(p99, "<", 1ull << percentile(histogram[op], ops[op], 0.99)));
+	}
+
+	fprintf(out, "\nlatency histograms\n");
+	for (int op = 0; op < OP_COUNT; op++) {
+		if (ops[op] == 0) {
+			continue;
+		}
+		fprintf(out, "%-10s", op_names[op]);
+		for (int i = 0; i < TRACE_BUCKETS; i++) {
+			if (histogram[op][i] != 0) {
+				fprintf(out, " %s:%lu", format_time(bound, "<", 1ull << i), histogram[op][i]);
+			}
+		}
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "\ncounters\n");
+	for (int s = 0; s < STAT_COUNT; s++) {
+		fprintf(out, "%-18s %ld\n", stat_names[s], counts[s]);
+	}
+	fclose(out);
+	return buf;
+}
+
+// Order events by start time.
+static int compare_start(const void *a, const void *b) {
+	uint64_t x = ((const trace_event_t *) a)->start;
+	uint64_t y = ((const trace_event_t *) b)->start;
+	return x < y ? -1 : x > y;
+}
+
+// Write the events in the ring buffers as text into a new buffer, setting size to its length.
+char *trace_events(size_t *size) {
+	pthread_mutex_lock(&threads_lock);
+	trace_event_t *events = malloc((size_t) (thread_count + 1) * TRACE_RING_SIZE * sizeof(trace_event_t));
+	int count = 0;
+	for (trace_thread_t *t = threads; t != 0; t = t->next) {
+		if (t->ring == 0) {
+			continue;
+		}
+		uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+		uint64_t from = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+		for (uint64_t i = from; i < head; i++) {
+			uint64_t *slot = (uint64_t *) &t->ring[i % TRACE_RING_SIZE];
+			for (int w = 0; w < sizeof(trace_event_t) / 8; w++) {
+				((uint64_t *) &events[count + i - from])[w] = __atomic_load_n(&slot[w], __ATOMIC_RELAXED);
+			}
+		}
+		// drop the oldest events if the thread wrapped around onto them while they were copied
+		uint64_t now = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+		uint64_t valid = now > TRACE_RING_SIZE ? now - TRACE_RING_SIZE : 0;
+		int skip = valid > from ? (valid - from < head - from ? valid - from : head - from) : 0;
+		memmove(&events[count], &events[count + skip], (head - from - skip) * sizeof(trace_event_t));
+		count += head - from - skip;
+	}
+	pthread_mutex_unlock(&threads_lock);
+	qsort(events, count, sizeof(trace_event_t), compare_start);
+
+	char *buf;
+	FILE *out = open_memstream(&buf, size);
+	fprintf(out, "%14s %10s %6s %-10s %10s %10s %12s\n",
+		"start_ns", "ns", "thread", "op", "result", "size", "offset");
+	for (int i = 0; i < count; i++) {
+		trace_event_t *ev = &events[i];
+		fprintf(out, "%14lu %10u %6u %-10s %10ld %10ld %12ld\n", ev->start, ev->duration,
+			ev->thread, op_names[ev->op], ev->result, ev->size, ev->offset);
+	}
+	fclose(out);
+	free(events);
+	return buf;
+}
+
+#endif
@@ -0,0 +1,119 @@
+/* Tracing and statistics.
+ * Every FUSE operation is timed into a latency histogram, and counters track bytes,
+ * allocations, cache hits and so on. With the trace mount option, each operation is also
+ * recorded as a fixed-size binary event in a ring buffer. All of this lives in state owned
+ * by the thread doing the work, so recording takes no locks and formats nothing; the
+ * threads' state is only summed up when /.nufs/stats or /.nufs/trace is read.
+ * Building with NUFS_TRACE=0 compiles it all out. */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef NUFS_TRACE
+#define NUFS_TRACE 1
+#endif
+
+#define TRACE_RING_SIZE 4096 // events kept per thread, a power of two
+#define TRACE_BUCKETS 32     // latency buckets: bucket i holds times below 2^i ns
+
+// The operations that are timed.
+typedef enum trace_op {
+	OP_ACCESS,
+	OP_GETATTR,
+	OP_FGETATTR,
+	OP_OPENDIR,
+	OP_READDIR,
+	OP_RELEASEDIR,
+	OP_MKNOD,
+	OP_CREATE,
+	OP_MKDIR,
+	OP_UNLINK,
+	OP_LINK,
+	OP_RMDIR,
+	OP_RENAME,
+	OP_CHMOD,
+	OP_TRUNCATE,
+	OP_FTRUNCATE,
+	OP_OPEN,
+	OP_RELEASE,
+	OP_READ,
+	OP_READ_BUF,
+	OP_WRITE,
+	OP_WRITE_BUF,
+	OP_FLUSH,
+	OP_FSYNC,
+	OP_FSYNCDIR,
+	OP_UTIMENS,
+	OP_FALLOCATE,
+	OP_IOCTL,
+	OP_COUNT
+} trace_op_t;
+
+// The counters.
+typedef enum trace_stat {
+	STAT_BYTES_READ,
+	STAT_BYTES_WRITTEN,
+	STAT_BLOCK_ALLOCS,     // calls to alloc_blocks
+	STAT_BLOCKS_ALLOCATED,
+	STAT_BLOCKS_FREED,
+	STAT_INODES_ALLOCATED,
+	STAT_INODES_FREED,
+	STAT_DCACHE_HITS,
+	STAT_DCACHE_MISSES,
+	STAT_BUFFER_HITS,      // data blocks read from the cache of cache.h
+	STAT_BUFFER_MISSES,
+	STAT_JOURNAL_COMMITS,
+	STAT_JOURNAL_BLOCKS,   // blocks logged by commits
+	STAT_JOURNAL_REPLAYS,  // transactions replayed when the image was loaded
+	STAT_JOURNAL_SPLITS,   // commits too big for the journal, logged in pieces
+	STAT_WRITEBACK_BLOCKS, // data blocks written back
+	STAT_COUNT
+} trace_stat_t;
+
+// An operation recorded in a ring buffer.
+typedef struct trace_event {
+	uint64_t start;    // ns since the mount
+	uint32_t duration; // ns
+	uint16_t op;
+	uint16_t thread;   // which thread's ring it is in
+	int64_t result;
+	int64_t size;      // bytes asked for, for reads and writes
+	int64_t offset;
+} trace_event_t;
+
+#if NUFS_TRACE
+
+// Start keeping statistics, and record events too if tracing is set.
+void trace_init(int tracing);
+
+// Return the time an operation starts, to pass to trace_end.
+uint64_t trace_begin();
+
+// Note that an operation started at start just finished with the given result.
+void trace_end(trace_op_t op, uint64_t start, int64_t result, int64_t size, int64_t offset);
+
+// Add n to a counter.
+void trace_count(trace_stat_t stat, int64_t n);
+
+// Write the statistics as text into a new buffer, setting size to its length.
+char *trace_stats(size_t *size);
+
+// Write the events in the ring buffers as text into a new buffer, setting size to its length.
+char *trace_events(size_t *size);
+
+#else
+
+static inline void trace_init(int tracing) {}
+static inline uint64_t trace_begin() { return 0; }
+static inline void trace_end(trace_op_t op, uint64_t start, int64_t result, int64_t size,
+		int64_t offset) {}
+static inline void trace_count(trace_stat_t stat, int64_t n) {}
+static inline char *trace_stats(size_t *size) { *size = 0; return 0; }
+static inline char *trace_events(size_t *size) { *size = 0; return 0; }
+
+#endif
+
+#endif
@@ -0,0 +1,249 @@
+/* The io_uring engine of backend.h.
+ * Each thread gets a ring of its own the first time it does I/O, so threads never wait on
+ * each other's batches. A batch is queued a ring's worth at a time and submitted with a
+ * single system call, and the thread then waits for all of it to complete. A ring that
+ * io_uring_enter fails on is dropped, and the thread sets up another. The rings are set
+ * up with the raw system calls, as liburing isn't needed for this little. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "backend.h"
+
+#define RING_ENTRIES 64 // pieces of I/O in flight at once per thread
+
+// A thread's ring, as mapped from the kernel.
+typedef struct ring {
+	int fd;
+	unsigned entries;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_size;
+	size_t cq_size;
+} ring_t;
+
+static int image_fd = -1;
+static pthread_key_t ring_key;
+
+// Tear down a thread's ring once the thread exits.
+static void free_ring(void *arg) {
+	ring_t *ring = arg;
+	munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_map != ring->sq_map) {
+		munmap(ring->cq_map, ring->cq_size);
+	}
+	munmap(ring->sq_map, ring->sq_size);
+	close(ring->fd);
+	free(ring);
+}
+
+// Set up a ring.
+// returns it, or null on fail.
+static ring_t *new_ring() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (fd < 0) {
+		return 0;
+	}
+	ring_t *ring = calloc(1, sizeof(ring_t));
+	ring->fd = fd;
+	ring->entries = p.sq_entries;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		// both rings share one mapping
+		ring->sq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sq_map = mmap(0, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, IORING_OFF_SQ_RING);
+	ring->cq_map = p.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_map
+		: mmap(0, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		close(fd);
+		free(ring);
+		return 0;
+	}
+	ring->sq_tail = ring->sq_map + p.sq_off.tail;
+	ring->sq_mask = ring->sq_map + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_map + p.sq_off.array;
+	ring->cq_head = ring->cq_map + p.cq_off.head;
+	ring->cq_tail = ring->cq_map + p.cq_off.tail;
+	ring->cq_mask = ring->cq_map + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_map + p.cq_off.cqes;
+	return ring;
+}
+
+// Return the calling thread's ring, setting it up if it has none.
+static ring_t *get_ring() {
+	ring_t *ring = pthread_getspecific(ring_key);
+	if (ring == 0) {
+		ring = new_ring();
+		pthread_setspecific(ring_key, ring);
+	}
+	return ring;
+}
+
+// Check that io_uring can be used, and keep the image file.
+// returns 0 on success, -1 on fail.
+static int uring_open(int fd, size_t size) {
+	image_fd = fd;
+	pthread_key_create(&ring_key, free_ring);
+	return get_ring() == 0 ? -1 : 0;
+}
+
+// Tear down the calling thread's ring; those of threads still running go when they exit.
+static void uring_close() {
+	ring_t *ring = pthread_getspecific(ring_key);
+	if (ring != 0) {
+		free_ring(ring);
+		pthread_setspecific(ring_key, 0);
+	}
+	image_fd = -1;
+}
+
+// Give up on the calling thread's ring after io_uring_enter fails in a way it can't
+// recover from, once the pending pieces submitted have completed, as they still use
+// buffers the caller is about to free. The thread sets up a new ring for its next I/O.
+static void drop_ring(ring_t *ring, int pending) {
+	while (pending > 0) {
+		unsigned head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			head++;
+			pending--;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		if (pending > 0 && syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0
+				&& errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			// closing the ring cancels whatever is left
+			break;
+		}
+	}
+	free_ring(ring);
+	pthread_setspecific(ring_key, 0);
+}
+
+// Queue, submit and wait for up to a ring's worth of pieces, finishing any that come back
+// short with pread or pwrite.
+// returns 0 on success, -1 on fail.
+static int run_batch(ring_t *ring, data_io_t *ios, int count, int write) {
+	unsigned tail = *ring->sq_tail;
+	for (int i = 0; i < count; i++, tail++) {
+		unsigned slot = tail & *ring->sq_mask;
+		struct io_uring_sqe *sqe = &ring->sqes[slot];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = image_fd;
+		sqe->addr = (uintptr_t) ios[i].buf;
+		sqe->len = ios[i].size;
+		sqe->off = ios[i].pos;
+		sqe->user_data = i;
+		ring->sq_array[slot] = slot;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	int rv = 0;
+	int submitted = 0;
+	int completed = 0;
+	while (completed < count) {
+		int n = syscall(__NR_io_uring_enter, ring->fd, count - submitted, 1, IORING_ENTER_GETEVENTS, 0, 0);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+			continue;
+		}
+		if (n < 0) {
+			drop_ring(ring, submitted - completed);
+			return -1;
+		}
+		submitted += n;
+		unsigned head = *ring->cq_head;
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			data_io_t *io = &ios[cqe->user_data];
+			if (cqe->res < 0 || data_io_sync(image_fd, io, cqe->res, write) != 0) {
+				rv = -1;
+			}
+			head++;
+			completed++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return rv;
+}
+
+// Run a batch of reads or writes through the calling thread's ring.
+// returns 0 on success, -1 on fail.
+static int uring_io(data_io_t *ios, int count, int write) {
+	ring_t *ring = get_ring();
+	if (ring == 0) {
+		// out of memory for another ring, so this thread makes do without
+		for (int i = 0; i < count; i++) {
+			if (data_io_sync(image_fd, &ios[i], 0, write) != 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+	int rv = 0;
+	for (int done = 0; done < count; done += ring->entries) {
+		int n = count - done < (int) ring->entries ? count - done : (int) ring->entries;
+		rv |= run_batch(ring, ios + done, n, write);
+		if (pthread_getspecific(ring_key) != ring) {
+			// the ring was dropped, so the rest of the batch fails with it
+			return -1;
+		}
+	}
+	return rv;
+}
+
+// Read each piece, all in flight together.
+// returns 0 on success, -1 on fail.
+static int uring_read(data_io_t *ios, int count) {
+	return uring_io(ios, count, 0);
+}
+
+// Write each piece, all in flight together.
+// returns 0 on success, -1 on fail.
+static int uring_write(data_io_t *ios, int count) {
+	return uring_io(ios, count, 1);
+}
+
+// Write back a range of the image file, and wait for it.
+// returns 0 on success, -1 on fail.
+static int uring_sync(int64_t pos, int64_t size) {
+	// as with the pread engine, the flush is what makes the writes durable
+	if (sync_file_range(image_fd, pos, size,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+		return -1;
+	}
+	return fdatasync(image_fd);
+}
+
+const backend_t uring_backend = {
+	.name = "uring",
+	.splice = 0,
+	.direct = 1,
+	.open = uring_open,
+	.close = uring_close,
+	.read = uring_read,
+	.write = uring_write,
+	.sync = uring_sync,
+};
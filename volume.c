@@ -0,0 +1,37 @@
+/* Finding the mounted volume a path is on. */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "volume.h"
+
+// Find the root of the mount holding the given absolute path, by climbing until the device
+// changes, and put it in root.
+// returns 0 on success, -1 on fail.
+int find_root(const char *path, char *root) {
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return -1;
+	}
+	strcpy(root, path);
+	for (;;) {
+		char *slash = strrchr(root, '/');
+		if (slash == root) {
+			// the volume is never mounted on / itself
+			return -1;
+		}
+		char parent[PATH_MAX];
+		snprintf(parent, sizeof(parent), "%.*s", (int) (slash - root), root);
+		struct stat up;
+		if (stat(parent, &up) != 0) {
+			return -1;
+		}
+		if (up.st_dev != st.st_dev) {
+			return 0;
+		}
+		*slash = 0;
+	}
+}
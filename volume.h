@@ -0,0 +1,11 @@
+/* Finding the mounted volume a path is on, for the tools that work on the files of a
+ * mounted volume through its ioctls. */
+
+#ifndef VOLUME_H
+#define VOLUME_H
+
+// Find the root of the mount holding the given absolute path, and put it in root.
+// Returns 0 on success, -1 on fail.
+int find_root(const char *path, char *root);
+
+#endif
@@ -0,0 +1,258 @@
+/* Writing file data back to the disk image.
+ * Blocks are marked clean when they are taken for writing back, before the write starts,
+ * so a block changed again meanwhile is just marked dirty again. The thread holds
+ * pass_lock until everything it took is durable, which is what writeback_wait waits on. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "blocks.h"
+#include "trace.h"
+#include "writeback.h"
+
+writeback_config_t writeback_config = {
+	.background = 4096, // 16MB
+	.limit = 16384,     // 64MB
+	.expire = 30,
+	.interval = 5,
+};
+
+// What scan does with the dirty blocks it finds.
+enum {
+	SCAN_START, // start writing them, leaving them dirty
+	SCAN_TAKE,  // mark them clean and start writing them
+	SCAN_SYNC,  // mark them clean and write them, returning once they are durable
+};
+
+static uint64_t *dirty_bits = 0; // set and cleared atomically, since writers don't share a lock
+static uint32_t *dirtied = 0;    // when each dirty block was first changed, in seconds
+static int dirty_count = 0;
+static int block_count = 0;
+
+static pthread_mutex_t pass_lock = PTHREAD_MUTEX_INITIALIZER; // held by a pass until its blocks are durable
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER; // guards running and kicked
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER; // wakes up the thread
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER; // signaled after each pass
+static pthread_t thread;
+static int running = 0;
+static int kicked = 0; // a writer wants a pass right away
+
+// Return the current time in seconds.
+static uint32_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+// Set up dirty tracking for the mapped image.
+void writeback_init() {
+	block_count = get_superblock()->block_count;
+	dirty_bits = calloc((block_count + 63) / 64, sizeof(uint64_t));
+	dirtied = calloc(block_count, sizeof(uint32_t));
+	dirty_count = 0;
+	// writers must never wait on a pass that won't write everything
+	if (writeback_config.background > writeback_config.limit) {
+		writeback_config.background = writeback_config.limit;
+	}
+}
+
+// Write out count blocks starting at block as the given mode says.
+// returns 0 on success, -1 on fail.
+static int write_run(int block, int count, int mode) {
+	if (mode == SCAN_SYNC) {
+		return data_sync(block, count);
+	}
+	return sync_file_range(get_blocks_fd(), (off_t) block * BLOCK_SIZE,
+			(off_t) count * BLOCK_SIZE, SYNC_FILE_RANGE_WRITE);
+}
+
+// Write out the dirty blocks in [block, end) first changed no later than cutoff,
+// a contiguous run at a time, as the given mode says.
+// returns the number of blocks written, or -1 on fail.
+static int scan(int block, int end, int64_t cutoff, int mode) {
+	int written = 0;
+	int rv = 0;
+	int run = -1;
+	for (int b = block; b < end; b++) {
+		uint64_t *word = &dirty_bits[b / 64];
+		uint64_t bit = 1ull << (b % 64);
+		int take = 0;
+		if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+				&& __atomic_load_n(&dirtied[b], __ATOMIC_RELAXED) <= cutoff) {
+			take = mode == SCAN_START || (__atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED) & bit);
+		}
+		if (take) {
+			written++;
+			if (run < 0) {
+				run = b;
+			}
+			continue;
+		}
+		if (run >= 0) {
+			rv |= write_run(run, b - run, mode);
+			run = -1;
+		}
+		// most of the image is clean, so skip the rest of a clean word at once
+		if ((__atomic_load_n(word, __ATOMIC_RELAXED) >> (b % 64)) == 0) {
+			b |= 63;
+		}
+	}
+	if (run >= 0) {
+		rv |= write_run(run, end - run, mode);
+	}
+	if (mode != SCAN_START) {
+		__atomic_sub_fetch(&dirty_count, written, __ATOMIC_RELAXED);
+		trace_count(STAT_WRITEBACK_BLOCKS, written);
+	}
+	return rv == 0 ? written : -1;
+}
+
+// Write back blocks older than the expiry, or every dirty block if there are too many,
+// and wait until they are durable.
+static void pass() {
+	pthread_mutex_lock(&pass_lock);
+	int64_t cutoff = (int64_t) now() - writeback_config.expire;
+	if (__atomic_load_n(&dirty_count, __ATOMIC_RELAXED) > writeback_config.background) {
+		cutoff = INT64_MAX;
+	}
+	if (scan(0, block_count, cutoff, SCAN_TAKE) != 0) {
+		// one flush makes every run durable
+		fdatasync(get_blocks_fd());
+	}
+	pthread_mutex_unlock(&pass_lock);
+
+	pthread_mutex_lock(&state_lock);
+	pthread_cond_broadcast(&done);
+	pthread_mutex_unlock(&state_lock);
+}
+
+// Make a pass every interval, or sooner when kicked.
+static void *writeback_thread(void *arg) {
+	pthread_mutex_lock(&state_lock);
+	while (running) {
+		if (!kicked) {
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += writeback_config.interval;
+			pthread_cond_timedwait(&wake, &state_lock, &until);
+		}
+		kicked = 0;
+		pthread_mutex_unlock(&state_lock);
+		pass();
+		pthread_mutex_lock(&state_lock);
+	}
+	pthread_mutex_unlock(&state_lock);
+	return 0;
+}
+
+// Start the thread that writes back dirty blocks.
+void writeback_start_thread() {
+	running = 1;
+	pthread_create(&thread, NULL, writeback_thread, NULL);
+}
+
+// Stop the writeback thread.
+void writeback_close() {
+	pthread_mutex_lock(&state_lock);
+	int was_running = running;
+	running = 0;
+	pthread_cond_signal(&wake);
+	pthread_cond_broadcast(&done);
+	pthread_mutex_unlock(&state_lock);
+	if (was_running) {
+		pthread_join(thread, NULL);
+	}
+	free(dirty_bits);
+	free(dirtied);
+	dirty_bits = 0;
+	dirtied = 0;
+}
+
+// Ask the thread for a pass right away. The caller holds state_lock.
+static void kick() {
+	kicked = 1;
+	pthread_cond_signal(&wake);
+}
+
+// Note that count data blocks starting at block were just written.
+void writeback_dirty(int block, int count) {
+	uint32_t stamp = now();
+	int added = 0;
+	for (int b = block; b < block + count; b++) {
+		uint64_t *word = &dirty_bits[b / 64];
+		uint64_t bit = 1ull << (b % 64);
+		// rewriting a block that is already dirty is the common case, so check first
+		if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) {
+			continue;
+		}
+		if (!(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit)) {
+			__atomic_store_n(&dirtied[b], stamp, __ATOMIC_RELAXED);
+			added++;
+		}
+	}
+	int total = __atomic_add_fetch(&dirty_count, added, __ATOMIC_RELAXED);
+	if (total > writeback_config.background && total - added <= writeback_config.background) {
+		pthread_mutex_lock(&state_lock);
+		kick();
+		pthread_mutex_unlock(&state_lock);
+	}
+}
+
+// Note that count blocks starting at block were freed, so their data needn't be written back.
+void writeback_forget(int block, int count) {
+	int dropped = 0;
+	for (int b = block; b < block + count; b++) {
+		uint64_t bit = 1ull << (b % 64);
+		dropped += (__atomic_fetch_and(&dirty_bits[b / 64], ~bit, __ATOMIC_RELAXED) & bit) != 0;
+	}
+	__atomic_sub_fetch(&dirty_count, dropped, __ATOMIC_RELAXED);
+}
+
+// Check whether none of count blocks starting at block are dirty.
+int writeback_clean(int block, int count) {
+	for (int b = block; b < block + count; b++) {
+		if (__atomic_load_n(&dirty_bits[b / 64], __ATOMIC_RELAXED) & (1ull << (b % 64))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Write back the dirty blocks among count blocks starting at block.
+// returns 0 on success, -1 on fail.
+int writeback_range(int block, int count, int wait) {
+	return scan(block, block + count, INT64_MAX, wait ? SCAN_SYNC : SCAN_START) < 0 ? -1 : 0;
+}
+
+// Wait until the blocks the thread has already taken are durable.
+void writeback_wait() {
+	pthread_mutex_lock(&pass_lock);
+	pthread_mutex_unlock(&pass_lock);
+}
+
+// Make a writer wait while too many blocks are dirty.
+void writeback_throttle() {
+	if (__atomic_load_n(&dirty_count, __ATOMIC_RELAXED) <= writeback_config.limit) {
+		return;
+	}
+	pthread_mutex_lock(&state_lock);
+	if (!running) {
+		// without the thread, the writer does the pass itself
+		pthread_mutex_unlock(&state_lock);
+		pass();
+		return;
+	}
+	while (running && __atomic_load_n(&dirty_count, __ATOMIC_RELAXED) > writeback_config.limit) {
+		kick();
+		pthread_cond_wait(&done, &state_lock);
+	}
+	pthread_mutex_unlock(&state_lock);
+}
@@ -0,0 +1,53 @@
+/* Writing file data back to the disk image.
+ *
+ * File data is written to the page cache by the I/O engine (see backend.h), so it sits
+ * there until it is written back. Every data block changed since it was last written
+ * back is marked in a dirty bitmap, along with when it was first changed. fsync writes back just the
+ * dirty blocks of one file, and a background thread writes back blocks once they are old
+ * enough or once too many are dirty, so an fsync rarely has much left to do. */
+
+#ifndef WRITEBACK_H
+#define WRITEBACK_H
+
+// Tunables of the writeback thread, set with -o options when mounting.
+typedef struct writeback_config {
+	int background; // dirty blocks beyond which the thread writes everything back
+	int limit;      // dirty blocks beyond which writers wait for the thread
+	int expire;     // seconds a block may stay dirty before the thread writes it back
+	int interval;   // seconds between passes of the thread
+} writeback_config_t;
+
+extern writeback_config_t writeback_config;
+
+// Set up dirty tracking for the mapped image.
+void writeback_init();
+
+// Start the thread that writes back dirty blocks.
+void writeback_start_thread();
+
+// Stop the writeback thread.
+void writeback_close();
+
+// Note that count data blocks starting at block were just written.
+void writeback_dirty(int block, int count);
+
+// Note that count blocks starting at block were freed, so their data needn't be written back.
+void writeback_forget(int block, int count);
+
+// Check whether none of count blocks starting at block are dirty, that is changed since
+// they were last taken for writing back.
+int writeback_clean(int block, int count);
+
+// Write back the dirty blocks among count blocks starting at block.
+// With wait set, return once they are durable, and mark them clean. Otherwise only start
+// writing them, and leave them dirty for a later fsync to wait on.
+// returns 0 on success, -1 on fail.
+int writeback_range(int block, int count, int wait);
+
+// Wait until the blocks the thread has already taken are durable.
+void writeback_wait();
+
+// Make a writer wait while too many blocks are dirty.
+void writeback_throttle();
+
+#endif